@@ -2,8 +2,10 @@
 #include "json.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static bool maybe_realloc(const char *k, size_t *sz, size_t read_sz, struct CommandConfig **cmds) {
   if (*sz != 0) {
@@ -28,11 +30,241 @@ static bool maybe_realloc(const char *k, size_t *sz, size_t read_sz, struct Comm
   return true;
 }
 
+static const struct {
+  const char *name;
+  int signo;
+} stop_signals[] = {
+    {"SIGINT", SIGINT},   {"SIGTERM", SIGTERM}, {"SIGHUP", SIGHUP}, {"SIGQUIT", SIGQUIT},
+    {"SIGUSR1", SIGUSR1}, {"SIGUSR2", SIGUSR2}, {"SIGKILL", SIGKILL},
+};
+static const size_t stop_signals_sz = sizeof(stop_signals) / sizeof(stop_signals[0]);
+
+static bool parse_stop_signal(struct json_object* handle, int *signo) {
+  const char *name = NULL;
+  if (!json_get_optional_strdup(handle, "stop_signal", &name)) {
+    // Missing, keep default
+    free((void*)name);
+    return true;
+  }
+
+  bool found = false;
+  for (size_t i = 0; i < stop_signals_sz; ++i) {
+    if (strcmp(stop_signals[i].name, name) == 0) {
+      *signo = stop_signals[i].signo;
+      found = true;
+    }
+  }
+
+  if (!found) {
+    fprintf(stderr, "Config error: unknown stop_signal %s\n", name);
+  }
+  free((void*)name);
+  return found;
+}
+
+static const char *stop_signal_name(int signo) {
+  for (size_t i = 0; i < stop_signals_sz; ++i) {
+    if (stop_signals[i].signo == signo) {
+      return stop_signals[i].name;
+    }
+  }
+  return "?";
+}
+
+static bool parse_standby(struct json_object* handle, bool *freeze) {
+  const char *policy = NULL;
+  if (!json_get_optional_strdup(handle, "standby", &policy)) {
+    // Missing, keep default
+    free((void*)policy);
+    return true;
+  }
+
+  bool ok = true;
+  if (strcmp(policy, "freeze") == 0) {
+    *freeze = true;
+  } else if (strcmp(policy, "stop") == 0) {
+    *freeze = false;
+  } else {
+    fprintf(stderr, "Config error: unknown standby policy %s, expected freeze or stop\n", policy);
+    ok = false;
+  }
+
+  free((void*)policy);
+  return ok;
+}
+
+static bool parse_occupancy_detector(struct json_object* handle,
+                                     enum OccupancyDetectorKind *kind) {
+  const char *name = NULL;
+  if (!json_get_optional_strdup(handle, "occupancy_detector", &name)) {
+    // Missing, keep default
+    free((void*)name);
+    return true;
+  }
+
+  bool ok = true;
+  if (strcmp(name, "window") == 0) {
+    *kind = DETECTOR_WINDOW;
+  } else if (strcmp(name, "ewma") == 0) {
+    *kind = DETECTOR_EWMA;
+  } else if (strcmp(name, "hmm") == 0) {
+    *kind = DETECTOR_HMM;
+  } else {
+    fprintf(stderr, "Config error: unknown occupancy_detector %s, expected window, ewma or hmm\n",
+            name);
+    ok = false;
+  }
+
+  free((void*)name);
+  return ok;
+}
+
+static const char *occupancy_detector_name(enum OccupancyDetectorKind kind) {
+  switch (kind) {
+  case DETECTOR_WINDOW:
+    return "window";
+  case DETECTOR_EWMA:
+    return "ewma";
+  case DETECTOR_HMM:
+    return "hmm";
+  }
+  return "?";
+}
+
+static bool parse_sensor_filter(struct json_object* handle, enum GlitchFilterKind *kind) {
+  const char *name = NULL;
+  if (!json_get_optional_strdup(handle, "sensor_filter", &name)) {
+    // Missing, keep default
+    free((void*)name);
+    return true;
+  }
+
+  bool ok = true;
+  if (strcmp(name, "none") == 0) {
+    *kind = GLITCH_FILTER_NONE;
+  } else if (strcmp(name, "stable") == 0) {
+    *kind = GLITCH_FILTER_STABLE;
+  } else if (strcmp(name, "majority") == 0) {
+    *kind = GLITCH_FILTER_MAJORITY;
+  } else {
+    fprintf(stderr, "Config error: unknown sensor_filter %s, expected none, stable or majority\n",
+            name);
+    ok = false;
+  }
+
+  free((void*)name);
+  return ok;
+}
+
+static const char *sensor_filter_name(enum GlitchFilterKind kind) {
+  switch (kind) {
+  case GLITCH_FILTER_NONE:
+    return "none";
+  case GLITCH_FILTER_STABLE:
+    return "stable";
+  case GLITCH_FILTER_MAJORITY:
+    return "majority";
+  }
+  return "?";
+}
+
+static const char *command_action_names[] = {
+    [CMD_ACTION_EXEC] = "exec",
+    [CMD_ACTION_DISPLAY_ON] = "display_on",
+    [CMD_ACTION_DISPLAY_OFF] = "display_off",
+};
+static const size_t command_action_names_sz =
+    sizeof(command_action_names) / sizeof(command_action_names[0]);
+
+static const char *log_level_names[] = {"debug", "info", "warn", "error"};
+
+static bool parse_log_cfg(struct json_object* handle, struct PiPresenceMonConfig *cfg) {
+  cfg->log_level = cfg->gpio_debug ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO;
+  cfg->log_syslog = false;
+
+  bool ok = true;
+  const char *name = NULL;
+  if (json_get_optional_strdup(handle, "log_level", &name)) {
+    bool found = false;
+    for (size_t i = 0; i < sizeof(log_level_names) / sizeof(log_level_names[0]); ++i) {
+      if (strcmp(log_level_names[i], name) == 0) {
+        cfg->log_level = i;
+        found = true;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "Config error: unknown log_level %s, expected debug, info, warn or error\n",
+              name);
+      ok = false;
+    }
+  }
+  free((void*)name);
+
+  name = NULL;
+  if (json_get_optional_strdup(handle, "log_target", &name)) {
+    if (strcmp(name, "syslog") == 0) {
+      cfg->log_syslog = true;
+    } else if (strcmp(name, "stderr") != 0) {
+      fprintf(stderr, "Config error: unknown log_target %s, expected stderr or syslog\n", name);
+      ok = false;
+    }
+  }
+  free((void*)name);
+  return ok;
+}
+
+static bool parse_command_action(struct json_object* handle, enum CommandAction *action) {
+  const char *name = NULL;
+  if (!json_get_optional_strdup(handle, "action", &name)) {
+    // Missing, keep default
+    free((void*)name);
+    return true;
+  }
+
+  bool found = false;
+  for (size_t i = 0; i < command_action_names_sz; ++i) {
+    if (strcmp(command_action_names[i], name) == 0) {
+      *action = i;
+      found = true;
+    }
+  }
+
+  if (!found) {
+    fprintf(stderr, "Config error: unknown action %s, expected exec, display_on or display_off\n",
+            name);
+  }
+  free((void*)name);
+  return found;
+}
+
 static bool parse_cmd(struct json_object* handle, struct CommandConfig *cmd) {
   bool ok = true;
+  cmd->action = CMD_ACTION_EXEC;
+  cmd->cmd = NULL;
+  cmd->should_restart_on_crash = false;
+  cmd->max_restarts = 0;
+  cmd->stop_signal = SIGINT;
+  cmd->stop_timeout_ms = 5000;
+  cmd->start_delay_ms = 0;
+  cmd->standby_freeze = false;
+  if (!parse_command_action(handle, &cmd->action)) {
+    return false;
+  }
+
+  if (cmd->action != CMD_ACTION_EXEC) {
+    cmd->cmd = strdup(command_action_names[cmd->action]);
+    ok &= cmd->cmd != NULL;
+    ok &= json_get_optional_size_t(handle, "start_delay_ms", &cmd->start_delay_ms, 0, 60000);
+    return ok;
+  }
+
   ok &= json_get_bool(handle, "should_restart_on_crash", &cmd->should_restart_on_crash);
   ok &= json_get_size_t(handle, "max_restarts", &cmd->max_restarts, 0, 99);
   ok &= json_get_strdup(handle, "cmd", &cmd->cmd);
+  ok &= parse_stop_signal(handle, &cmd->stop_signal);
+  ok &= json_get_optional_size_t(handle, "stop_timeout_ms", &cmd->stop_timeout_ms, 0, 60000);
+  ok &= json_get_optional_size_t(handle, "start_delay_ms", &cmd->start_delay_ms, 0, 60000);
+  ok &= parse_standby(handle, &cmd->standby_freeze);
   return ok;
 }
 
@@ -48,9 +280,182 @@ static bool parse_on_vacancy(size_t arr_len, size_t idx, struct json_object* han
          parse_cmd(handle, &cfg->on_vacancy[idx]);
 }
 
+static bool parse_extra_sensor_pins(size_t arr_len, size_t idx, struct json_object* handle,
+                                    void *usr) {
+  struct PiPresenceMonConfig *cfg = usr;
+  if (arr_len > CFG_MAX_EXTRA_SENSOR_PINS) {
+    fprintf(stderr, "Config error: too many extra_sensor_pins, max %d\n",
+            CFG_MAX_EXTRA_SENSOR_PINS);
+    return false;
+  }
+  cfg->extra_sensor_pins_sz = arr_len;
+  return jsonobj_get_size_t(handle, &cfg->extra_sensor_pins[idx], 0, 31);
+}
+
+static bool parse_input_devices(size_t arr_len, size_t idx, struct json_object* handle,
+                                void *usr) {
+  struct PiPresenceMonConfig *cfg = usr;
+  if (arr_len > CFG_MAX_INPUT_DEVICES) {
+    fprintf(stderr, "Config error: too many input_devices, max %d\n", CFG_MAX_INPUT_DEVICES);
+    return false;
+  }
+  cfg->input_devices_sz = idx + 1;
+  return jsonobj_strdup(handle, &cfg->input_devices[idx]);
+}
+
+static const struct {
+  const char *name;
+  enum SensorType type;
+  size_t default_weight;
+  enum SensorVeto default_veto;
+} sensor_types[] = {
+    {"pir", SENSOR_PIR, 1, SENSOR_VETO_NONE},
+    {"radar", SENSOR_RADAR, 1, SENSOR_VETO_BLOCK_VACANCY},
+    {"door", SENSOR_DOOR, 0, SENSOR_VETO_FORCE_OCCUPANCY},
+    {"generic", SENSOR_GENERIC, 1, SENSOR_VETO_NONE},
+};
+static const size_t sensor_types_sz = sizeof(sensor_types) / sizeof(sensor_types[0]);
+
+static const char *sensor_veto_names[] = {
+    [SENSOR_VETO_NONE] = "none",
+    [SENSOR_VETO_FORCE_OCCUPANCY] = "force_occupancy",
+    [SENSOR_VETO_BLOCK_VACANCY] = "block_vacancy",
+};
+static const size_t sensor_veto_names_sz = sizeof(sensor_veto_names) / sizeof(sensor_veto_names[0]);
+
+static bool parse_sensor_veto(struct json_object* handle, enum SensorVeto *veto) {
+  const char *name = NULL;
+  if (!json_get_optional_strdup(handle, "veto", &name)) {
+    // Missing, keep the default of the sensor type
+    free((void*)name);
+    return true;
+  }
+
+  bool found = false;
+  for (size_t i = 0; i < sensor_veto_names_sz; ++i) {
+    if (strcmp(sensor_veto_names[i], name) == 0) {
+      *veto = i;
+      found = true;
+    }
+  }
+
+  if (!found) {
+    fprintf(stderr, "Config error: unknown sensor veto %s, expected none, force_occupancy or "
+                    "block_vacancy\n", name);
+  }
+  free((void*)name);
+  return found;
+}
+
+static bool parse_sensor(size_t arr_len, size_t idx, struct json_object* handle, void *usr) {
+  struct PiPresenceMonConfig *cfg = usr;
+  if (arr_len > CFG_MAX_SENSORS) {
+    fprintf(stderr, "Config error: too many sensors, max %d\n", CFG_MAX_SENSORS);
+    return false;
+  }
+  cfg->sensors_sz = idx + 1;
+
+  struct SensorConfig *sensor = &cfg->sensors[idx];
+  const char *type = NULL;
+  if (!json_get_strdup(handle, "type", &type)) {
+    return false;
+  }
+
+  bool found = false;
+  for (size_t i = 0; i < sensor_types_sz; ++i) {
+    if (strcmp(sensor_types[i].name, type) == 0) {
+      sensor->type = sensor_types[i].type;
+      sensor->weight = sensor_types[i].default_weight;
+      sensor->veto = sensor_types[i].default_veto;
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "Config error: unknown sensor type %s, expected pir, radar, door or generic\n",
+            type);
+  }
+
+  // Unnamed sensors are named after their type
+  if (found && !json_get_optional_strdup(handle, "name", &sensor->name)) {
+    sensor->name = type;
+    type = NULL;
+  }
+  free((void*)type);
+
+  bool ok = found;
+  sensor->active_low = false;
+  sensor->window_seconds = cfg->sensor_monitor_window_seconds;
+  sensor->uart = NULL;
+  sensor->max_distance_cm = 600;
+  sensor->min_energy = 0;
+  if (json_get_optional_strdup(handle, "uart", &sensor->uart)) {
+    if (sensor->type != SENSOR_RADAR) {
+      fprintf(stderr, "Config error: sensor %s has a uart, but only radars can use one\n",
+              sensor->name);
+      ok = false;
+    }
+    ok &= json_get_optional_size_t(handle, "max_distance_cm", &sensor->max_distance_cm, 0,
+                                   65535);
+    ok &= json_get_optional_size_t(handle, "min_energy", &sensor->min_energy, 0, 100);
+  } else {
+    ok &= json_get_size_t(handle, "pin", &sensor->pin, 0, 31);
+  }
+  ok &= json_get_optional_bool(handle, "active_low", &sensor->active_low);
+  ok &= json_get_optional_size_t(handle, "window_seconds", &sensor->window_seconds, 1,
+                                 6 * 60 * 60);
+  ok &= json_get_optional_size_t(handle, "weight", &sensor->weight, 0, 100);
+  ok &= parse_sensor_veto(handle, &sensor->veto);
+  return ok;
+}
+
+static const char *sensor_type_name(enum SensorType type) {
+  for (size_t i = 0; i < sensor_types_sz; ++i) {
+    if (sensor_types[i].type == type) {
+      return sensor_types[i].name;
+    }
+  }
+  return "?";
+}
+
+// Sensors are sampled together, with a single register read per poll
+static bool validate_sensors(const struct PiPresenceMonConfig *cfg) {
+  size_t total_weight = 0;
+  for (size_t i = 0; i < cfg->sensors_sz; ++i) {
+    total_weight += cfg->sensors[i].weight;
+    for (size_t j = 0; j < i && !cfg->sensors[i].uart; ++j) {
+      if (!cfg->sensors[j].uart && cfg->sensors[i].pin == cfg->sensors[j].pin) {
+        fprintf(stderr, "Config error: sensors %s and %s share pin %zu\n", cfg->sensors[j].name,
+                cfg->sensors[i].name, cfg->sensors[i].pin);
+        return false;
+      }
+    }
+  }
+
+  if (cfg->sensors_sz > 0 && total_weight == 0) {
+    fprintf(stderr, "Config error: at least one sensor needs a non-zero weight\n");
+    return false;
+  }
+  return true;
+}
+
+// sensor_poll_period_secs is still accepted, for configs written before sub-second periods
+static bool parse_poll_period(struct json_object* cfgbase, size_t *period_ms) {
+  int unused;
+  if (json_get_int(cfgbase, "sensor_poll_period_ms", &unused)) {
+    return json_get_size_t(cfgbase, "sensor_poll_period_ms", period_ms, 10, 30000);
+  }
+
+  size_t period_secs;
+  if (!json_get_size_t(cfgbase, "sensor_poll_period_secs", &period_secs, 1, 30)) {
+    return false;
+  }
+  *period_ms = 1000 * period_secs;
+  return true;
+}
+
 struct PiPresenceMonConfig *pipresencemon_cfg_init(const char *fpath) {
   bool ok = true;
-  struct PiPresenceMonConfig *cfg = malloc(sizeof(struct PiPresenceMonConfig));
+  struct PiPresenceMonConfig *cfg = calloc(1, sizeof(struct PiPresenceMonConfig));
   struct json_object* cfgbase = json_init(fpath);
   if (!cfg || !cfgbase) {
     ok = false;
@@ -61,23 +466,81 @@ struct PiPresenceMonConfig *pipresencemon_cfg_init(const char *fpath) {
   cfg->on_vacancy_sz = 0;
   cfg->on_occupancy = NULL;
   cfg->on_vacancy = NULL;
+  cfg->gpio_chip = NULL;
+  cfg->gpio_mock_trace = NULL;
+  cfg->gpio_scope_dump_path = NULL;
+  cfg->display_backlight = NULL;
+  cfg->display_drm_card = NULL;
+  cfg->metrics_socket = NULL;
+  cfg->control_socket = NULL;
+  cfg->trace_dump_path = NULL;
+  cfg->state_page_path = NULL;
 
   ok &= json_get_bool(cfgbase, "gpio_debug", &cfg->gpio_debug);
   ok &= json_get_bool(cfgbase, "gpio_use_mock", &cfg->gpio_use_mock);
-  ok &= json_get_size_t(cfgbase, "sensor_pin", &cfg->sensor_pin, 0, 40);
-  ok &= json_get_size_t(cfgbase, "sensor_poll_period_secs", &cfg->sensor_poll_period_secs, 1, 30);
+  ok &= parse_log_cfg(cfgbase, cfg);
+  json_get_optional_strdup(cfgbase, "gpio_chip", &cfg->gpio_chip);
+  json_get_optional_strdup(cfgbase, "gpio_mock_trace", &cfg->gpio_mock_trace);
+  json_get_optional_strdup(cfgbase, "display_backlight", &cfg->display_backlight);
+  json_get_optional_strdup(cfgbase, "display_drm_card", &cfg->display_drm_card);
+  json_get_optional_strdup(cfgbase, "metrics_socket", &cfg->metrics_socket);
+  json_get_optional_strdup(cfgbase, "control_socket", &cfg->control_socket);
+  cfg->metrics_port = 0;
+  ok &= json_get_optional_size_t(cfgbase, "metrics_port", &cfg->metrics_port, 0, 65535);
+  json_get_optional_strdup(cfgbase, "state_page_path", &cfg->state_page_path);
+  if (!json_get_optional_strdup(cfgbase, "trace_dump_path", &cfg->trace_dump_path)) {
+    cfg->trace_dump_path = strdup("/tmp/pipresencemon_trace.json");
+  }
+  cfg->gpio_scope_period_us = 0;
+  cfg->gpio_scope_ring_kb = 64;
+  ok &= json_get_optional_size_t(cfgbase, "gpio_scope_period_us", &cfg->gpio_scope_period_us, 0,
+                                 1000000);
+  ok &= json_get_optional_size_t(cfgbase, "gpio_scope_ring_kb", &cfg->gpio_scope_ring_kb, 1,
+                                 64 * 1024);
+  if (!json_get_optional_strdup(cfgbase, "gpio_scope_dump_path", &cfg->gpio_scope_dump_path)) {
+    cfg->gpio_scope_dump_path = strdup("/tmp/pipresencemon_scope.bin");
+  }
+  ok &= parse_poll_period(cfgbase, &cfg->sensor_poll_period_ms);
+  cfg->sensor_filter = GLITCH_FILTER_NONE;
+  cfg->sensor_filter_stable_ms = 3 * cfg->sensor_poll_period_ms;
+  cfg->sensor_filter_majority_n = 3;
+  cfg->gpio_line_debounce_us = 0;
+  ok &= parse_sensor_filter(cfgbase, &cfg->sensor_filter);
+  ok &= json_get_optional_size_t(cfgbase, "sensor_filter_stable_ms",
+                                 &cfg->sensor_filter_stable_ms, 1, 60000);
+  ok &= json_get_optional_size_t(cfgbase, "sensor_filter_majority_n",
+                                 &cfg->sensor_filter_majority_n, 3, 31);
+  ok &= json_get_optional_size_t(cfgbase, "gpio_line_debounce_us", &cfg->gpio_line_debounce_us,
+                                 0, 1000000);
   ok &= json_get_size_t(cfgbase, "sensor_monitor_window_seconds",
-                       &cfg->sensor_monitor_window_seconds, 5, 100);
+                       &cfg->sensor_monitor_window_seconds, 5, 6 * 60 * 60);
+  ok &= json_get_optional_arr(cfgbase, "sensors", parse_sensor, cfg);
+  ok &= validate_sensors(cfg);
+  if (cfg->sensors_sz == 0) {
+    ok &= json_get_size_t(cfgbase, "sensor_pin", &cfg->sensor_pin, 0, 31);
+    ok &= json_get_optional_arr(cfgbase, "extra_sensor_pins", parse_extra_sensor_pins, cfg);
+  }
+  ok &= json_get_optional_arr(cfgbase, "input_devices", parse_input_devices, cfg);
   ok &= json_get_size_t(cfgbase, "rising_edge_occupancy_threshold_pct",
                        &cfg->rising_edge_occupancy_threshold_pct, 10, 100);
   ok &= json_get_size_t(cfgbase, "falling_edge_vacancy_threshold_pct",
                        &cfg->falling_edge_vacancy_threshold_pct, 1, 100);
+  cfg->occupancy_detector = DETECTOR_WINDOW;
+  cfg->hmm_active_when_occupied_pct = 30;
+  cfg->hmm_active_when_vacant_pct = 2;
+  ok &= parse_occupancy_detector(cfgbase, &cfg->occupancy_detector);
+  ok &= json_get_optional_size_t(cfgbase, "hmm_active_when_occupied_pct",
+                                 &cfg->hmm_active_when_occupied_pct, 1, 99);
+  ok &= json_get_optional_size_t(cfgbase, "hmm_active_when_vacant_pct",
+                                 &cfg->hmm_active_when_vacant_pct, 1, 99);
   ok &= json_get_size_t(cfgbase, "vacancy_motion_timeout_seconds",
                        &cfg->vacancy_motion_timeout_seconds, 1, 600);
   ok &= json_get_size_t(cfgbase, "restart_cmd_wait_time_seconds",
                        &cfg->restart_cmd_wait_time_seconds, 0, 100);
   ok &= json_get_size_t(cfgbase, "crash_on_repeated_cmd_failure_count",
                        &cfg->crash_on_repeated_cmd_failure_count, 0, 50);
+  ok &= json_get_optional_bool(cfgbase, "launch_before_stop_completes",
+                               &cfg->launch_before_stop_completes);
   ok &= json_get_arr(cfgbase, "on_occupancy", parse_on_occupancy, cfg);
   ok &= json_get_arr(cfgbase, "on_vacancy", parse_on_vacancy, cfg);
 
@@ -88,6 +551,32 @@ struct PiPresenceMonConfig *pipresencemon_cfg_init(const char *fpath) {
     ok = false;
   }
 
+  if (cfg->hmm_active_when_occupied_pct <= cfg->hmm_active_when_vacant_pct) {
+    fprintf(stderr, "hmm_active_when_occupied_pct must be higher than hmm_active_when_vacant_pct, "
+                    "otherwise activity would point to vacancy\n");
+    ok = false;
+  }
+
+  if (cfg->sensor_filter_majority_n % 2 == 0) {
+    fprintf(stderr, "sensor_filter_majority_n must be odd, so that votes can't tie\n");
+    ok = false;
+  }
+
+  if (cfg->gpio_line_debounce_us && !cfg->gpio_chip) {
+    fprintf(stderr, "Warning: gpio_line_debounce_us needs gpio_chip, ignoring it\n");
+  }
+
+  if (cfg->gpio_scope_period_us != 0 && cfg->gpio_scope_period_us < 100) {
+    fprintf(stderr, "gpio_scope_period_us must be at least 100, or 0 to disable the scope\n");
+    ok = false;
+  }
+
+  if ((cfg->extra_sensor_pins_sz > 0 || cfg->sensors_sz > 0) &&
+      cfg->occupancy_detector != DETECTOR_WINDOW) {
+    fprintf(stderr, "Warning: extra_sensor_pins and sensors only support the window "
+                    "occupancy_detector\n");
+  }
+
   if (cfg->on_occupancy_sz == 0) {
     fprintf(stderr, "Warning: no occupancy commands specified, this looks buggy\n");
   }
@@ -113,6 +602,23 @@ void pipresencemon_cfg_free(struct PiPresenceMonConfig *cfg) {
     return;
   }
 
+  free((void *)cfg->gpio_chip);
+  free((void *)cfg->gpio_mock_trace);
+  free((void *)cfg->gpio_scope_dump_path);
+  free((void *)cfg->display_backlight);
+  free((void *)cfg->display_drm_card);
+  free((void *)cfg->metrics_socket);
+  free((void *)cfg->control_socket);
+  free((void *)cfg->trace_dump_path);
+  free((void *)cfg->state_page_path);
+  for (size_t i = 0; i < cfg->sensors_sz; ++i) {
+    free((void *)cfg->sensors[i].name);
+    free((void *)cfg->sensors[i].uart);
+  }
+  for (size_t i = 0; i < cfg->input_devices_sz; ++i) {
+    free((void *)cfg->input_devices[i]);
+  }
+
   if (cfg->on_occupancy) {
     for (size_t i = 0; i < cfg->on_occupancy_sz; ++i) {
       free((void *)cfg->on_occupancy[i].cmd);
@@ -133,24 +639,99 @@ void pipresencemon_cfg_free(struct PiPresenceMonConfig *cfg) {
 void cfg_debug(struct PiPresenceMonConfig *cfg) {
   printf("PiPresenceMonConfig: {\n");
   printf("\t gpio_debug: %d,\n", cfg->gpio_debug);
+  printf("\t log_level: %s,\n", log_level_names[cfg->log_level]);
+  printf("\t log_target: %s,\n", cfg->log_syslog ? "syslog" : "stderr");
   printf("\t gpio_use_mock: %d,\n", cfg->gpio_use_mock);
-  printf("\t sensor_pin: %zu,\n", cfg->sensor_pin);
-  printf("\t sensor_poll_period_secs: %zu,\n", cfg->sensor_poll_period_secs);
+  if (cfg->gpio_mock_trace) {
+    printf("\t gpio_mock_trace: %s,\n", cfg->gpio_mock_trace);
+  }
+  if (cfg->gpio_scope_period_us) {
+    printf("\t gpio_scope_period_us: %zu,\n", cfg->gpio_scope_period_us);
+    printf("\t gpio_scope_ring_kb: %zu,\n", cfg->gpio_scope_ring_kb);
+    printf("\t gpio_scope_dump_path: %s,\n", cfg->gpio_scope_dump_path);
+  }
+  printf("\t gpio_chip: %s,\n", cfg->gpio_chip ? cfg->gpio_chip : "(none, polling /dev/gpiomem)");
+  if (cfg->sensors_sz == 0) {
+    printf("\t sensor_pin: %zu,\n", cfg->sensor_pin);
+    printf("\t extra_sensor_pins: [");
+    for (size_t i = 0; i < cfg->extra_sensor_pins_sz; ++i) {
+      printf(" %zu", cfg->extra_sensor_pins[i]);
+    }
+    printf(" ],\n");
+  }
+  printf("\t sensors: [\n");
+  for (size_t i = 0; i < cfg->sensors_sz; ++i) {
+    const struct SensorConfig *sensor = &cfg->sensors[i];
+    printf("\t\t { name: %s, type: %s, ", sensor->name, sensor_type_name(sensor->type));
+    if (sensor->uart) {
+      printf("uart: %s, max_distance_cm: %zu, min_energy: %zu, ", sensor->uart,
+             sensor->max_distance_cm, sensor->min_energy);
+    } else {
+      printf("pin: %zu%s, ", sensor->pin, sensor->active_low ? " (active low)" : "");
+    }
+    printf("window_seconds: %zu, weight: %zu, veto: %s },\n", sensor->window_seconds,
+           sensor->weight, sensor_veto_names[sensor->veto]);
+  }
+  printf("\t ],\n");
+  printf("\t input_devices: [");
+  for (size_t i = 0; i < cfg->input_devices_sz; ++i) {
+    printf(" %s", cfg->input_devices[i]);
+  }
+  printf(" ],\n");
+  printf("\t sensor_poll_period_ms: %zu,\n", cfg->sensor_poll_period_ms);
+  printf("\t sensor_filter: %s,\n", sensor_filter_name(cfg->sensor_filter));
+  if (cfg->sensor_filter == GLITCH_FILTER_STABLE) {
+    printf("\t sensor_filter_stable_ms: %zu,\n", cfg->sensor_filter_stable_ms);
+  } else if (cfg->sensor_filter == GLITCH_FILTER_MAJORITY) {
+    printf("\t sensor_filter_majority_n: %zu,\n", cfg->sensor_filter_majority_n);
+  }
+  if (cfg->gpio_chip) {
+    printf("\t gpio_line_debounce_us: %zu,\n", cfg->gpio_line_debounce_us);
+  }
   printf("\t sensor_monitor_window_seconds: %zu,\n", cfg->sensor_monitor_window_seconds);
   printf("\t rising_edge_occupancy_threshold_pct: %zu,\n",
          cfg->rising_edge_occupancy_threshold_pct);
   printf("\t falling_edge_vacancy_threshold_pct: %zu,\n", cfg->falling_edge_vacancy_threshold_pct);
+  printf("\t occupancy_detector: %s,\n", occupancy_detector_name(cfg->occupancy_detector));
+  if (cfg->occupancy_detector == DETECTOR_HMM) {
+    printf("\t hmm_active_when_occupied_pct: %zu,\n", cfg->hmm_active_when_occupied_pct);
+    printf("\t hmm_active_when_vacant_pct: %zu,\n", cfg->hmm_active_when_vacant_pct);
+  }
   printf("\t vacancy_motion_timeout_seconds: %zu,\n", cfg->vacancy_motion_timeout_seconds);
   printf("\t restart_cmd_wait_time_seconds: %zu,\n", cfg->restart_cmd_wait_time_seconds);
   printf("\t crash_on_repeated_cmd_failure_count: %zu,\n",
          cfg->crash_on_repeated_cmd_failure_count);
+  printf("\t launch_before_stop_completes: %d,\n", cfg->launch_before_stop_completes);
+  if (cfg->display_drm_card) {
+    printf("\t display_drm_card: %s,\n", cfg->display_drm_card);
+  } else if (cfg->display_backlight) {
+    printf("\t display_backlight: %s,\n", cfg->display_backlight);
+  }
+  if (cfg->metrics_socket) {
+    printf("\t metrics_socket: %s,\n", cfg->metrics_socket);
+  }
+  if (cfg->metrics_port) {
+    printf("\t metrics_port: %zu,\n", cfg->metrics_port);
+  }
+  if (cfg->control_socket) {
+    printf("\t control_socket: %s,\n", cfg->control_socket);
+  }
+  printf("\t trace_dump_path: %s,\n", cfg->trace_dump_path);
+  if (cfg->state_page_path) {
+    printf("\t state_page_path: %s,\n", cfg->state_page_path);
+  }
 
   printf("\t on_occupancy: [\n");
   for (size_t i = 0; i < cfg->on_occupancy_sz; ++i) {
     printf("\t CommandConfig {\n");
+    printf("\t\t action: %s\n", command_action_names[cfg->on_occupancy[i].action]);
     printf("\t\t cmd: %s\n", cfg->on_occupancy[i].cmd);
     printf("\t\t should_restart_on_crash: %d,\n", cfg->on_occupancy[i].should_restart_on_crash);
     printf("\t\t max_restarts: %zu,\n", cfg->on_occupancy[i].max_restarts);
+    printf("\t\t stop_signal: %s,\n", stop_signal_name(cfg->on_occupancy[i].stop_signal));
+    printf("\t\t stop_timeout_ms: %zu,\n", cfg->on_occupancy[i].stop_timeout_ms);
+    printf("\t\t start_delay_ms: %zu,\n", cfg->on_occupancy[i].start_delay_ms);
+    printf("\t\t standby: %s,\n", cfg->on_occupancy[i].standby_freeze ? "freeze" : "stop");
     printf("\t },\n");
   }
   printf("\t ]\n");
@@ -158,9 +739,14 @@ void cfg_debug(struct PiPresenceMonConfig *cfg) {
   printf("\t on_vacancy: [\n");
   for (size_t i = 0; i < cfg->on_vacancy_sz; ++i) {
     printf("\t CommandConfig {\n");
+    printf("\t\t action: %s\n", command_action_names[cfg->on_vacancy[i].action]);
     printf("\t\t cmd: %s\n", cfg->on_vacancy[i].cmd);
     printf("\t\t should_restart_on_crash: %d,\n", cfg->on_vacancy[i].should_restart_on_crash);
     printf("\t\t max_restarts: %zu,\n", cfg->on_vacancy[i].max_restarts);
+    printf("\t\t stop_signal: %s,\n", stop_signal_name(cfg->on_vacancy[i].stop_signal));
+    printf("\t\t stop_timeout_ms: %zu,\n", cfg->on_vacancy[i].stop_timeout_ms);
+    printf("\t\t start_delay_ms: %zu,\n", cfg->on_vacancy[i].start_delay_ms);
+    printf("\t\t standby: %s,\n", cfg->on_vacancy[i].standby_freeze ? "freeze" : "stop");
     printf("\t },\n");
   }
   printf("\t ]\n");
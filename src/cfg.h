@@ -3,21 +3,156 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#define CFG_MAX_EXTRA_SENSOR_PINS 32
+#define CFG_MAX_SENSORS 16
+#define CFG_MAX_INPUT_DEVICES 8
+
+// Algorithm deciding if a sensor reports occupancy, from its samples
+enum OccupancyDetectorKind {
+  // % of active samples in the sensor history
+  DETECTOR_WINDOW,
+  // Exponentially weighted moving average of the samples, same time constant as the history
+  DETECTOR_EWMA,
+  // Posterior probability of occupancy, from a two state hidden Markov model
+  DETECTOR_HMM,
+};
+
+// Filter applied to raw sensor reads, before they're added to the sensor history
+enum GlitchFilterKind {
+  GLITCH_FILTER_NONE,
+  // A new value is accepted once every read for sensor_filter_stable_ms has returned it
+  GLITCH_FILTER_STABLE,
+  // Majority vote of the last sensor_filter_majority_n reads
+  GLITCH_FILTER_MAJORITY,
+};
+
+// Least severe message logged (see logger.h)
+enum LogLevel {
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_ERROR,
+};
+
+// Kind of device behind a fused sensor. Only sets defaults for its weight and veto.
+enum SensorType {
+  // Motion: misses people sitting still. Default weight 1, no veto.
+  SENSOR_PIR,
+  // Presence output of a radar: sees static people. Default weight 1, blocks vacancy.
+  SENSOR_RADAR,
+  // Door contact: someone just came in or out. Default weight 0, forces occupancy.
+  SENSOR_DOOR,
+  // Anything else. Default weight 1, no veto.
+  SENSOR_GENERIC,
+};
+
+// What a fused sensor does while it's active (any active sample in its window), regardless of
+// the fused score
+enum SensorVeto {
+  SENSOR_VETO_NONE,
+  // The space is occupied
+  SENSOR_VETO_FORCE_OCCUPANCY,
+  // The space can't become vacant, but this doesn't make it occupied
+  SENSOR_VETO_BLOCK_VACANCY,
+};
+
+struct SensorConfig {
+  const char *name;
+  enum SensorType type;
+  // GPIO pin of the sensor, unless it has another source below
+  size_t pin;
+  // Optional, radar only: tty of an LD2410 class radar (eg "/dev/ttyAMA0") to read reports from,
+  // instead of a pin. The radar is active while it reports a target closer than max_distance_cm
+  // (default 600) with at least min_energy (0-100, default 0).
+  const char *uart;
+  size_t max_distance_cm;
+  size_t min_energy;
+  // Optional: pin reads 0 when the sensor is active (eg a normally closed door contact)
+  bool active_low;
+  // Optional: history of this sensor, default sensor_monitor_window_seconds
+  size_t window_seconds;
+  // Optional: share of this sensor in the fused score (its active % times its weight, over the
+  // sum of weights). 0 means it only acts through its veto.
+  size_t weight;
+  enum SensorVeto veto;
+};
+
+// What a command does when its state starts
+enum CommandAction {
+  // Launch cmd as a background app
+  CMD_ACTION_EXEC,
+  // Built-in, run by the daemon itself without spawning anything (see DisplayPower)
+  CMD_ACTION_DISPLAY_ON,
+  CMD_ACTION_DISPLAY_OFF,
+};
+
 struct CommandConfig {
+  // Optional, default "exec". Built-in actions don't need a cmd (it's set to the action name), and
+  // the restart and stop settings don't apply to them.
+  enum CommandAction action;
   const char *cmd;
   bool should_restart_on_crash;
   size_t max_restarts;
+  // Signal sent to stop the command (default SIGINT), and grace period before it's SIGKILL'd
+  int stop_signal;
+  size_t stop_timeout_ms;
+  // Wait before starting the command, counted from the transition (default 0)
+  size_t start_delay_ms;
+  // If true ("standby": "freeze"), the command is frozen instead of stopped when its state ends,
+  // and thawed when its state starts again. Default ("standby": "stop") stops it.
+  bool standby_freeze;
 };
 
 struct PiPresenceMonConfig {
   bool gpio_debug;
+  // Optional: "debug", "info" (default, "debug" with gpio_debug), "warn" or "error"
+  enum LogLevel log_level;
+  // Optional: log_target "stderr" (default) or "syslog"
+  bool log_syslog;
   bool gpio_use_mock;
+  // Optional: with gpio_use_mock, replay this trace of register values instead of ./gpio_mock
+  const char *gpio_mock_trace;
+
+  // If set (eg "/dev/gpiochip0"), request the sensor pin through the GPIO character device and
+  // react to edge events, instead of polling /dev/gpiomem
+  const char *gpio_chip;
+
+  // Optional diagnostics: if gpio_scope_period_us is set (100 to 1000000), capture every change of
+  // the GPIO input register at that rate into a gpio_scope_ring_kb ring (default 64), written to
+  // gpio_scope_dump_path on SIGUSR1. Decode dumps with pipresencemon_scope_decode.
+  size_t gpio_scope_period_us;
+  size_t gpio_scope_ring_kb;
+  const char *gpio_scope_dump_path;
 
   // Pin to monitor
   size_t sensor_pin;
 
-  // Sleep between sensor reads
-  size_t sensor_poll_period_secs;
+  // Optional: more pins to monitor, with the same settings as sensor_pin. If any is set, all pins
+  // are sampled together and any pin reporting occupancy means the space is occupied.
+  size_t extra_sensor_pins_sz;
+  size_t extra_sensor_pins[CFG_MAX_EXTRA_SENSOR_PINS];
+
+  // Optional: fuse several sensors, of different types, into one occupancy state. If set,
+  // sensor_pin and extra_sensor_pins aren't used, and the rising/falling thresholds apply to the
+  // weighted score of all sensors. All sensors are sampled together, every sensor_poll_period_ms.
+  size_t sensors_sz;
+  struct SensorConfig sensors[CFG_MAX_SENSORS];
+
+  // Optional: input devices (eg /dev/input/event0) to watch for user activity. Any key, touch or
+  // motion event means someone is present: it reports occupancy right away, and restarts the
+  // vacancy timeout like a sensor detection would.
+  size_t input_devices_sz;
+  const char *input_devices[CFG_MAX_INPUT_DEVICES];
+
+  // Period between sensor reads
+  size_t sensor_poll_period_ms;
+
+  // Optional, default "none": "stable" or "majority" reject sensor glitches (see GlitchFilterKind)
+  enum GlitchFilterKind sensor_filter;
+  size_t sensor_filter_stable_ms;
+  size_t sensor_filter_majority_n;
+  // Optional, with gpio_chip: debounce period applied by the kernel to the line, 0 (default) is off
+  size_t gpio_line_debounce_us;
 
   // Time to keep sensor history
   size_t sensor_monitor_window_seconds;
@@ -30,6 +165,14 @@ struct PiPresenceMonConfig {
   // one present
   size_t falling_edge_vacancy_threshold_pct;
 
+  // Optional, default "window". The thresholds above apply to the score of whichever detector is
+  // used: active % of the window, the EWMA level, or the HMM probability of occupancy.
+  enum OccupancyDetectorKind occupancy_detector;
+  // HMM emission model: how often the sensor reads active when there is someone around, and when
+  // there isn't (false triggers)
+  size_t hmm_active_when_occupied_pct;
+  size_t hmm_active_when_vacant_pct;
+
   // Minimum timeout before declaring no-presence
   size_t vacancy_motion_timeout_seconds;
 
@@ -37,6 +180,33 @@ struct PiPresenceMonConfig {
   size_t restart_cmd_wait_time_seconds;
   size_t crash_on_repeated_cmd_failure_count;
 
+  // If false (default), the commands of a new state are launched once all the commands of the
+  // previous state have exited. If true, they are launched while the old ones are still stopping.
+  bool launch_before_stop_completes;
+
+  // Optional, for display_on/display_off actions: backlight device (or directory of them, default
+  // /sys/class/backlight) to switch. If display_drm_card is set (eg "/dev/dri/card0"), the DPMS
+  // property of its connected connectors is used instead.
+  const char *display_backlight;
+  const char *display_drm_card;
+
+  // Optional: serve metrics (Prometheus text format) on a Unix socket at metrics_socket, and/or
+  // over HTTP on 127.0.0.1:metrics_port (0, default, to disable)
+  const char *metrics_socket;
+  size_t metrics_port;
+
+  // Optional: Unix socket for local apps to query the state, force occupancy or vacancy for a
+  // while, hold wakelocks and subscribe to transitions (see control_server.h)
+  const char *control_socket;
+
+  // Optional: publish the occupancy state in a file (eg /run/pipresencemon.state) that local apps
+  // can mmap and read without syscalls, see state_page.h
+  const char *state_page_path;
+
+  // Where SIGUSR2 dumps the trace of recent transitions (see trace.h), default
+  // /tmp/pipresencemon_trace.json
+  const char *trace_dump_path;
+
   // Commands to be executed when transitioning from no-presence to presence
   size_t on_occupancy_sz;
   struct CommandConfig* on_occupancy;
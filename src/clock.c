@@ -0,0 +1,22 @@
+#include "clock.h"
+#include "periodic_timer.h"
+
+struct Clock *clock_real() {
+  static struct Clock real = {.simulated = false, .sim_now_ns = 0};
+  return &real;
+}
+
+void clock_sim_init(struct Clock *clock, uint64_t start_ns) {
+  clock->simulated = true;
+  clock->sim_now_ns = start_ns;
+}
+
+void clock_sim_set(struct Clock *clock, uint64_t now_ns) {
+  if (now_ns > clock->sim_now_ns) {
+    clock->sim_now_ns = now_ns;
+  }
+}
+
+uint64_t clock_now_ns(const struct Clock *clock) {
+  return clock->simulated ? clock->sim_now_ns : monotonic_now_ns();
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Source of monotonic time for timeouts, deadlines and cooldowns. The real clock reads
+// CLOCK_MONOTONIC. A simulated clock only moves when it's set, so the logic using it (and the
+// event loop timers, see event_loop.h) can run a day's worth of transitions in milliseconds.
+struct Clock {
+  bool simulated;
+  atomic_uint_least64_t sim_now_ns;
+};
+
+// Shared real clock
+struct Clock *clock_real();
+
+void clock_sim_init(struct Clock *clock, uint64_t start_ns);
+// Move a simulated clock forward. Time never goes back: earlier values are ignored.
+void clock_sim_set(struct Clock *clock, uint64_t now_ns);
+
+uint64_t clock_now_ns(const struct Clock *clock);
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+
+#include "control_server.h"
+#include "event_loop.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CONTROL_MAX_CLIENTS 32
+#define CONTROL_MAX_LINE 128
+#define CONTROL_MAX_REPLY 256
+// Longest override accepted, one day
+#define CONTROL_MAX_FORCE_MINUTES (24 * 60)
+
+struct ControlClient {
+  struct ControlServer *srv;
+  int fd;
+  struct EventLoopFd *handle;
+  // Partial command, until its \n arrives
+  char line[CONTROL_MAX_LINE];
+  size_t line_sz;
+  bool subscribed;
+  bool wakelock;
+};
+
+struct ControlServer {
+  struct EventLoop *loop;
+  struct ControlHandlers handlers;
+  const char *socket_path;
+  int listen_fd;
+  struct EventLoopFd *listen_handle;
+  struct ControlClient clients[CONTROL_MAX_CLIENTS];
+  size_t wakelocks;
+};
+
+const char *control_force_name(enum ControlForce force) {
+  switch (force) {
+  case CONTROL_FORCE_NONE:
+    return "none";
+  case CONTROL_FORCE_OCCUPIED:
+    return "occupied";
+  case CONTROL_FORCE_VACANT:
+    return "vacant";
+  }
+  return "unknown";
+}
+
+static void set_wakelock(struct ControlClient *client, bool held, bool notify) {
+  struct ControlServer *srv = client->srv;
+  if (client->wakelock == held) {
+    return;
+  }
+  client->wakelock = held;
+  srv->wakelocks = held ? srv->wakelocks + 1 : srv->wakelocks - 1;
+  if (notify) {
+    srv->handlers.wakelocks_changed(srv->handlers.usr, srv->wakelocks);
+  }
+}
+
+// Closing a client releases its wakelock; on shutdown there is no one left to notify
+static void client_close(struct ControlClient *client, bool notify) {
+  event_loop_remove_fd(client->srv->loop, client->handle);
+  close(client->fd);
+  client->handle = NULL;
+  client->fd = -1;
+  client->line_sz = 0;
+  client->subscribed = false;
+  set_wakelock(client, false, notify);
+}
+
+// Replies and events are a few bytes, a client that lets its socket buffer fill up is dropped
+// instead of blocking the loop. Returns false if the client was closed.
+static bool client_send(struct ControlClient *client, const char *fmt, ...) {
+  char msg[CONTROL_MAX_REPLY];
+  va_list args;
+  va_start(args, fmt);
+  const int msg_sz = vsnprintf(msg, sizeof(msg) - 1, fmt, args);
+  va_end(args);
+  // Truncated messages keep their \n
+  size_t sz = (msg_sz < 0) ? 0 : msg_sz;
+  if (sz > sizeof(msg) - 2) {
+    sz = sizeof(msg) - 2;
+  }
+  msg[sz] = '\n';
+
+  const ssize_t wr = send(client->fd, msg, sz + 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (wr != (ssize_t)(sz + 1)) {
+    fprintf(stderr, "ControlServer dropping client: %s\n",
+            wr < 0 ? strerror(errno) : "socket buffer full");
+    client_close(client, true);
+    return false;
+  }
+  return true;
+}
+
+static bool parse_minutes(const char *val, size_t *minutes) {
+  if (!val) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  const unsigned long n = strtoul(val, &end, 10);
+  if (errno || end == val || *end != '\0' || n == 0 || n > CONTROL_MAX_FORCE_MINUTES) {
+    return false;
+  }
+  *minutes = n;
+  return true;
+}
+
+static bool handle_force(struct ControlClient *client, const char *arg, const char *val) {
+  struct ControlServer *srv = client->srv;
+  enum ControlForce force;
+  if (arg && strcmp(arg, "off") == 0) {
+    if (client_send(client, "ok")) {
+      srv->handlers.force(srv->handlers.usr, CONTROL_FORCE_NONE, 0);
+    }
+    return client->fd >= 0;
+  } else if (arg && strcmp(arg, "occupied") == 0) {
+    force = CONTROL_FORCE_OCCUPIED;
+  } else if (arg && strcmp(arg, "vacant") == 0) {
+    force = CONTROL_FORCE_VACANT;
+  } else {
+    return client_send(client, "error usage: force occupied|vacant <minutes>, or force off");
+  }
+
+  size_t minutes;
+  if (!parse_minutes(val, &minutes)) {
+    return client_send(client, "error minutes must be between 1 and %d",
+                       CONTROL_MAX_FORCE_MINUTES);
+  }
+  if (client_send(client, "ok")) {
+    srv->handlers.force(srv->handlers.usr, force, minutes);
+  }
+  return client->fd >= 0;
+}
+
+// Handlers may report a transition, which is pushed to subscribers (maybe this client, maybe
+// closing it if it can't keep up): commands reply before calling them, so the ok comes before any
+// event. Returns false if the client was closed.
+static bool handle_command(struct ControlClient *client, char *line) {
+  struct ControlServer *srv = client->srv;
+  char *save;
+  const char *cmd = strtok_r(line, " \t\r", &save);
+  const char *arg = strtok_r(NULL, " \t\r", &save);
+  const char *val = strtok_r(NULL, " \t\r", &save);
+  if (!cmd) {
+    return true;
+  }
+
+  if (strcmp(cmd, "state") == 0) {
+    char state[CONTROL_MAX_REPLY - 8];
+    srv->handlers.query(srv->handlers.usr, state, sizeof(state));
+    return client_send(client, "ok %s", state);
+  } else if (strcmp(cmd, "force") == 0) {
+    return handle_force(client, arg, val);
+  } else if (strcmp(cmd, "wakelock") == 0 && arg &&
+             (strcmp(arg, "acquire") == 0 || strcmp(arg, "release") == 0)) {
+    if (client_send(client, "ok")) {
+      set_wakelock(client, strcmp(arg, "acquire") == 0, true);
+    }
+    return client->fd >= 0;
+  } else if (strcmp(cmd, "subscribe") == 0) {
+    client->subscribed = true;
+    return client_send(client, "ok");
+  }
+
+  return client_send(client, "error unknown command, expected state, force, wakelock, subscribe");
+}
+
+static void on_client_readable(void *usr, int fd, uint32_t events) {
+  struct ControlClient *client = usr;
+
+  char buf[512];
+  const ssize_t rd = read(fd, buf, sizeof(buf));
+  if (rd < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (rd <= 0) {
+    client_close(client, true);
+    return;
+  }
+
+  for (ssize_t i = 0; i < rd; ++i) {
+    if (buf[i] != '\n') {
+      if (client->line_sz + 1 >= sizeof(client->line)) {
+        client_send(client, "error command too long");
+        // Nothing sensible to do with the rest of it
+        if (client->fd >= 0) {
+          client_close(client, true);
+        }
+        return;
+      }
+      client->line[client->line_sz++] = buf[i];
+      continue;
+    }
+
+    client->line[client->line_sz] = '\0';
+    client->line_sz = 0;
+    if (!handle_command(client, client->line)) {
+      return;
+    }
+  }
+}
+
+static void on_listen_readable(void *usr, int fd, uint32_t events) {
+  struct ControlServer *srv = usr;
+  const int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client_fd < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("ControlServer can't accept client");
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+    struct ControlClient *client = &srv->clients[i];
+    if (client->fd >= 0) {
+      continue;
+    }
+
+    client->handle = event_loop_add_fd(srv->loop, client_fd, EPOLLIN, on_client_readable, client);
+    if (!client->handle) {
+      break;
+    }
+    client->fd = client_fd;
+    return;
+  }
+
+  fprintf(stderr, "ControlServer busy, dropping client\n");
+  close(client_fd);
+}
+
+struct ControlServer *control_server_init(struct EventLoop *loop, const char *socket_path,
+                                          const struct ControlHandlers *handlers) {
+  struct ControlServer *srv = malloc(sizeof(struct ControlServer));
+  if (!srv) {
+    perror("ControlServer bad alloc");
+    return NULL;
+  }
+
+  memset(srv, 0, sizeof(*srv));
+  srv->loop = loop;
+  srv->handlers = *handlers;
+  srv->socket_path = socket_path;
+  srv->listen_fd = -1;
+  for (size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+    srv->clients[i].srv = srv;
+    srv->clients[i].fd = -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ControlServer socket path too long: %s\n", socket_path);
+    goto ERR;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (srv->listen_fd < 0) {
+    perror("ControlServer can't create Unix socket");
+    goto ERR;
+  }
+
+  // A previous run may have left it behind
+  unlink(socket_path);
+  if (bind(srv->listen_fd, (const void *)&addr, sizeof(addr)) != 0 ||
+      listen(srv->listen_fd, 8) != 0) {
+    fprintf(stderr, "ControlServer can't listen on %s: %s\n", socket_path, strerror(errno));
+    goto ERR;
+  }
+
+  srv->listen_handle = event_loop_add_fd(loop, srv->listen_fd, EPOLLIN, on_listen_readable, srv);
+  if (!srv->listen_handle) {
+    goto ERR;
+  }
+
+  printf("Serving control socket on %s\n", socket_path);
+  return srv;
+
+ERR:
+  control_server_free(srv);
+  return NULL;
+}
+
+void control_server_free(struct ControlServer *srv) {
+  if (!srv) {
+    return;
+  }
+
+  for (size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+    if (srv->clients[i].fd >= 0) {
+      client_close(&srv->clients[i], false);
+    }
+  }
+
+  if (srv->listen_handle) {
+    event_loop_remove_fd(srv->loop, srv->listen_handle);
+  }
+  if (srv->listen_fd >= 0) {
+    close(srv->listen_fd);
+    unlink(srv->socket_path);
+  }
+  free(srv);
+}
+
+size_t control_server_wakelocks(const struct ControlServer *srv) {
+  return srv ? srv->wakelocks : 0;
+}
+
+void control_server_notify(struct ControlServer *srv, bool occupied, uint64_t timestamp_ns) {
+  if (!srv) {
+    return;
+  }
+
+  for (size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+    struct ControlClient *client = &srv->clients[i];
+    if (client->fd >= 0 && client->subscribed) {
+      client_send(client, "event %s %llu", occupied ? "occupied" : "vacant",
+                  (unsigned long long)timestamp_ns);
+    }
+  }
+}
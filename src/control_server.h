@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Control API, on a Unix socket served from the event loop (no thread per client: an idle client
+// is an fd in epoll and nothing else). Line based text protocol, one reply line per command:
+//
+//   state                          -> ok occupied=1 sensors=0 force=none force_left_s=0 ...
+//   force occupied|vacant <mins>   -> ok, report that state for mins, whatever the sensors say
+//   force off                      -> ok, back to the sensors
+//   wakelock acquire|release       -> ok, while any client holds one, vacancy isn't reported
+//   subscribe                      -> ok, then "event occupied|vacant <CLOCK_MONOTONIC ns>" lines
+//
+// Errors reply "error <reason>". A wakelock belongs to the connection that acquired it: it's
+// released when the client disconnects, so a crashed app can't keep the display on.
+
+enum ControlForce {
+  CONTROL_FORCE_NONE,
+  CONTROL_FORCE_OCCUPIED,
+  CONTROL_FORCE_VACANT,
+};
+
+const char *control_force_name(enum ControlForce force);
+
+struct ControlHandlers {
+  // Write the "state" reply (after "ok "), a single line without the \n
+  void (*query)(void *usr, char *buf, size_t sz);
+  // Override the sensors for minutes, or stop overriding them (CONTROL_FORCE_NONE)
+  void (*force)(void *usr, enum ControlForce force, size_t minutes);
+  // Number of wakelocks held, across all clients, changed
+  void (*wakelocks_changed)(void *usr, size_t held);
+  void *usr;
+};
+
+struct EventLoop;
+struct ControlServer;
+
+struct ControlServer *control_server_init(struct EventLoop *loop, const char *socket_path,
+                                          const struct ControlHandlers *handlers);
+void control_server_free(struct ControlServer *srv);
+
+size_t control_server_wakelocks(const struct ControlServer *srv);
+// Push a transition to every subscriber
+void control_server_notify(struct ControlServer *srv, bool occupied, uint64_t timestamp_ns);
@@ -0,0 +1,285 @@
+#include "display_power.h"
+#include "cfg.h"
+#include "periodic_timer.h"
+
+#include <dirent.h>
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define DISPLAY_POWER_MAX_CONNECTORS 8
+#define DISPLAY_POWER_MAX_PROPS 64
+#define DISPLAY_POWER_DEFAULT_BACKLIGHT "/sys/class/backlight"
+// bl_power values, from linux/fb.h
+#define BACKLIGHT_POWER_ON 0
+#define BACKLIGHT_POWER_OFF 4
+
+struct DrmConnector {
+  uint32_t connector_id;
+  uint32_t dpms_prop_id;
+};
+
+struct DisplayPower {
+  // DRM backend, if drm_fd >= 0
+  int drm_fd;
+  size_t connectors_sz;
+  struct DrmConnector connectors[DISPLAY_POWER_MAX_CONNECTORS];
+
+  // Backlight backend, if backlight_dir >= 0
+  int backlight_dir;
+  char backlight_path[256];
+  size_t max_brightness;
+  // Brightness to restore when switching on
+  size_t brightness;
+};
+
+static bool read_attr(int dir, const char *attr, size_t *val) {
+  const int fd = openat(dir, attr, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  char buf[32];
+  const ssize_t rd = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (rd <= 0) {
+    return false;
+  }
+
+  buf[rd] = '\0';
+  char *end;
+  *val = strtoul(buf, &end, 10);
+  return end != buf;
+}
+
+// sysfs attributes take a single write at offset 0; O_TRUNC is ignored by sysfs, and keeps plain
+// files (eg a fake tree, for tests) from ending up with leftovers of a longer value
+static bool write_attr(int dir, const char *attr, size_t val) {
+  const int fd = openat(dir, attr, O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  char buf[32];
+  const int sz = snprintf(buf, sizeof(buf), "%zu\n", val);
+  const bool ok = write(fd, buf, sz) == sz;
+  close(fd);
+  return ok;
+}
+
+static int is_visible(const struct dirent *entry) {
+  return entry->d_name[0] != '.';
+}
+
+// path is either a backlight device, or a directory of them (like /sys/class/backlight), in
+// which case the first device (by name) is used
+static bool backlight_open(struct DisplayPower *dp, const char *path) {
+  snprintf(dp->backlight_path, sizeof(dp->backlight_path), "%s", path);
+  if (access(path, F_OK) == 0) {
+    char bl_power[sizeof(dp->backlight_path) + 16];
+    snprintf(bl_power, sizeof(bl_power), "%s/bl_power", path);
+    if (access(bl_power, F_OK) != 0) {
+      struct dirent **entries;
+      const int entries_sz = scandir(path, &entries, is_visible, alphasort);
+      if (entries_sz > 0 &&
+          (size_t)snprintf(dp->backlight_path, sizeof(dp->backlight_path), "%s/%s", path,
+                           entries[0]->d_name) >= sizeof(dp->backlight_path)) {
+        fprintf(stderr, "DisplayPower: backlight path too long\n");
+      }
+      for (int i = 0; i < entries_sz; ++i) {
+        free(entries[i]);
+      }
+      free(entries);
+    }
+  }
+
+  dp->backlight_dir = open(dp->backlight_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dp->backlight_dir < 0) {
+    fprintf(stderr, "DisplayPower can't open backlight %s: %s\n", dp->backlight_path,
+            strerror(errno));
+    return false;
+  }
+
+  size_t bl_power;
+  if (!read_attr(dp->backlight_dir, "bl_power", &bl_power) ||
+      !read_attr(dp->backlight_dir, "max_brightness", &dp->max_brightness) ||
+      !read_attr(dp->backlight_dir, "brightness", &dp->brightness)) {
+    fprintf(stderr, "DisplayPower: %s doesn't look like a backlight device\n", dp->backlight_path);
+    return false;
+  }
+
+  // If the display starts off, there's nothing to restore
+  if (dp->brightness == 0) {
+    dp->brightness = dp->max_brightness;
+  }
+
+  printf("DisplayPower using backlight %s, brightness %zu of %zu\n", dp->backlight_path,
+         dp->brightness, dp->max_brightness);
+  return true;
+}
+
+static bool backlight_set(struct DisplayPower *dp, bool on) {
+  if (on) {
+    return write_attr(dp->backlight_dir, "brightness", dp->brightness) &&
+           write_attr(dp->backlight_dir, "bl_power", BACKLIGHT_POWER_ON);
+  }
+
+  // Brightness may have been changed while on, keep that for next time
+  size_t brightness;
+  if (read_attr(dp->backlight_dir, "brightness", &brightness) && brightness > 0) {
+    dp->brightness = brightness;
+  }
+  // Some panels ignore bl_power, dimming to 0 gets those too
+  return write_attr(dp->backlight_dir, "bl_power", BACKLIGHT_POWER_OFF) &&
+         write_attr(dp->backlight_dir, "brightness", 0);
+}
+
+static bool drm_find_dpms_prop(struct DisplayPower *dp, uint32_t connector_id,
+                               uint32_t *dpms_prop_id) {
+  uint32_t props[DISPLAY_POWER_MAX_PROPS];
+  uint64_t prop_values[DISPLAY_POWER_MAX_PROPS];
+  struct drm_mode_get_connector conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.connector_id = connector_id;
+  // No modes requested: that makes the kernel probe the connector, so only do this on init
+  conn.props_ptr = (uintptr_t)props;
+  conn.prop_values_ptr = (uintptr_t)prop_values;
+  conn.count_props = DISPLAY_POWER_MAX_PROPS;
+  if (ioctl(dp->drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) != 0) {
+    perror("DisplayPower can't get DRM connector");
+    return false;
+  }
+
+  const bool connected = conn.connection == 1 /* DRM_MODE_CONNECTED */;
+  // The kernel only fills the arrays if they are big enough for all properties
+  if (!connected || conn.count_props > DISPLAY_POWER_MAX_PROPS) {
+    return false;
+  }
+
+  for (size_t i = 0; i < conn.count_props; ++i) {
+    struct drm_mode_get_property prop;
+    memset(&prop, 0, sizeof(prop));
+    prop.prop_id = props[i];
+    if (ioctl(dp->drm_fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) == 0 &&
+        strcmp(prop.name, "DPMS") == 0) {
+      *dpms_prop_id = props[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool drm_open(struct DisplayPower *dp, const char *card) {
+  dp->drm_fd = open(card, O_RDWR | O_CLOEXEC);
+  if (dp->drm_fd < 0) {
+    fprintf(stderr, "DisplayPower can't open DRM card %s: %s\n", card, strerror(errno));
+    return false;
+  }
+
+  uint32_t connector_ids[DISPLAY_POWER_MAX_CONNECTORS];
+  struct drm_mode_card_res res;
+  memset(&res, 0, sizeof(res));
+  res.connector_id_ptr = (uintptr_t)connector_ids;
+  res.count_connectors = DISPLAY_POWER_MAX_CONNECTORS;
+  if (ioctl(dp->drm_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) != 0) {
+    perror("DisplayPower can't get DRM resources, is this a KMS device?");
+    return false;
+  }
+
+  if (res.count_connectors > DISPLAY_POWER_MAX_CONNECTORS) {
+    fprintf(stderr, "DisplayPower supports up to %d connectors, %s has %u\n",
+            DISPLAY_POWER_MAX_CONNECTORS, card, res.count_connectors);
+    return false;
+  }
+
+  for (size_t i = 0; i < res.count_connectors; ++i) {
+    struct DrmConnector *conn = &dp->connectors[dp->connectors_sz];
+    if (drm_find_dpms_prop(dp, connector_ids[i], &conn->dpms_prop_id)) {
+      conn->connector_id = connector_ids[i];
+      dp->connectors_sz++;
+    }
+  }
+
+  if (dp->connectors_sz == 0) {
+    fprintf(stderr, "DisplayPower: no connected display on %s\n", card);
+    return false;
+  }
+
+  printf("DisplayPower using %zu connectors of %s\n", dp->connectors_sz, card);
+  return true;
+}
+
+static bool drm_set(struct DisplayPower *dp, bool on) {
+  bool ok = true;
+  for (size_t i = 0; i < dp->connectors_sz; ++i) {
+    struct drm_mode_connector_set_property set;
+    memset(&set, 0, sizeof(set));
+    set.value = on ? DRM_MODE_DPMS_ON : DRM_MODE_DPMS_OFF;
+    set.prop_id = dp->connectors[i].dpms_prop_id;
+    set.connector_id = dp->connectors[i].connector_id;
+    if (ioctl(dp->drm_fd, DRM_IOCTL_MODE_SETPROPERTY, &set) != 0) {
+      fprintf(stderr, "DisplayPower can't set DPMS of connector %u: %s\n",
+              dp->connectors[i].connector_id, strerror(errno));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+struct DisplayPower *display_power_init(const struct PiPresenceMonConfig *cfg) {
+  struct DisplayPower *dp = malloc(sizeof(struct DisplayPower));
+  if (!dp) {
+    perror("DisplayPower bad alloc");
+    return NULL;
+  }
+
+  memset(dp, 0, sizeof(*dp));
+  dp->drm_fd = -1;
+  dp->backlight_dir = -1;
+
+  const char *backlight =
+      cfg->display_backlight ? cfg->display_backlight : DISPLAY_POWER_DEFAULT_BACKLIGHT;
+  const bool ok = cfg->display_drm_card ? drm_open(dp, cfg->display_drm_card)
+                                        : backlight_open(dp, backlight);
+  if (!ok) {
+    display_power_free(dp);
+    return NULL;
+  }
+
+  return dp;
+}
+
+void display_power_free(struct DisplayPower *dp) {
+  if (!dp) {
+    return;
+  }
+
+  if (dp->drm_fd >= 0) {
+    close(dp->drm_fd);
+  }
+  if (dp->backlight_dir >= 0) {
+    close(dp->backlight_dir);
+  }
+  free(dp);
+}
+
+bool display_power_set(struct DisplayPower *dp, bool on) {
+  const uint64_t start_ns = monotonic_now_ns();
+  const bool ok = dp->drm_fd >= 0 ? drm_set(dp, on) : backlight_set(dp, on);
+  const uint64_t end_ns = monotonic_now_ns();
+  if (!ok) {
+    fprintf(stderr, "DisplayPower failed to switch display %s\n", on ? "on" : "off");
+    return false;
+  }
+
+  printf("Display switched %s in %llu us\n", on ? "on" : "off",
+         (unsigned long long)(end_ns - start_ns) / 1000);
+  return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Switches the display on and off from within the daemon, for the "display_on" and "display_off"
+// command actions, without spawning anything. Two backends:
+// * DRM/KMS (display_drm_card set): sets the DPMS property of every connected connector. Needs to
+//   be DRM master, or the only client of the card, so it won't work under a running compositor.
+// * sysfs backlight (default): writes bl_power and brightness of a backlight device, restoring the
+//   previous brightness when switching back on. Works with any DSI panel, even under a compositor.
+// Everything that can be resolved up front (connectors, property ids, backlight dir) is, so a
+// switch is one ioctl or a couple of small writes.
+struct DisplayPower;
+struct PiPresenceMonConfig;
+
+struct DisplayPower *display_power_init(const struct PiPresenceMonConfig *cfg);
+void display_power_free(struct DisplayPower *dp);
+
+// Returns false if the display (or any of its connectors) couldn't be switched
+bool display_power_set(struct DisplayPower *dp, bool on);
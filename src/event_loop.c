@@ -0,0 +1,398 @@
+#include "event_loop.h"
+#include "clock.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define EVENT_LOOP_MAX_EVENTS 16
+// With a simulated clock, real fds (eg a child that was just signalled) get this much real time to
+// become ready before the clock jumps to the next timer, so real processes still look causal
+#define EVENT_LOOP_SIM_IDLE_WAIT_MS 1
+
+struct EventLoopFd {
+  // -1 once removed; removed handlers are freed after the current batch of events is dispatched,
+  // in case an event for them is still pending
+  int fd;
+  event_loop_fd_cb_t cb;
+  void *usr;
+  struct EventLoopFd *next_removed;
+};
+
+struct EventLoopTimer {
+  struct EventLoop *loop;
+  // -1 with a simulated clock: the loop fires the timer itself, using deadline_ns
+  int fd;
+  bool armed;
+  bool periodic;
+  uint64_t deadline_ns;
+  uint64_t period_ns;
+  event_loop_timer_cb_t cb;
+  void *usr;
+  struct EventLoopFd *handle;
+  struct EventLoopTimer *next;
+};
+
+struct SignalHandler {
+  event_loop_signal_cb_t cb;
+  void *usr;
+};
+
+struct EventLoop {
+  struct Clock *clock;
+  // All timers, only needed to find the next deadline with a simulated clock
+  struct EventLoopTimer *timers;
+  int epoll_fd;
+  int signal_fd;
+  struct EventLoopFd *signal_handle;
+  struct SignalHandler signal_handlers[NSIG];
+  struct EventLoopFd *removed;
+  bool stop;
+};
+
+static void handled_signals(sigset_t *set) {
+  sigemptyset(set);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGTERM);
+  sigaddset(set, SIGHUP);
+  sigaddset(set, SIGUSR1);
+  sigaddset(set, SIGUSR2);
+}
+
+static void event_loop_on_signalfd(void *usr, int fd, uint32_t events) {
+  struct EventLoop *loop = usr;
+  struct signalfd_siginfo infos[8];
+  const ssize_t rd = read(fd, infos, sizeof(infos));
+  if (rd < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("EventLoop can't read signalfd");
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < rd / sizeof(infos[0]); ++i) {
+    const int signo = infos[i].ssi_signo;
+    const struct SignalHandler *h = &loop->signal_handlers[signo];
+    if (h->cb) {
+      h->cb(h->usr, signo);
+    } else {
+      printf("EventLoop ignoring unhandled signal %d\n", signo);
+    }
+  }
+}
+
+struct EventLoop *event_loop_init(struct Clock *clock) {
+  struct EventLoop *loop = malloc(sizeof(struct EventLoop));
+  if (!loop) {
+    perror("EventLoop bad alloc");
+    return NULL;
+  }
+
+  memset(loop, 0, sizeof(*loop));
+  loop->clock = clock;
+  loop->timers = NULL;
+  loop->signal_fd = -1;
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    perror("EventLoop can't create epoll fd");
+    free(loop);
+    return NULL;
+  }
+
+  sigset_t sigs;
+  handled_signals(&sigs);
+  if (sigprocmask(SIG_BLOCK, &sigs, NULL) != 0) {
+    perror("EventLoop can't block signals");
+    goto ERR;
+  }
+
+  loop->signal_fd = signalfd(-1, &sigs, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (loop->signal_fd < 0) {
+    perror("EventLoop can't create signalfd");
+    goto ERR;
+  }
+
+  loop->signal_handle =
+      event_loop_add_fd(loop, loop->signal_fd, EPOLLIN, event_loop_on_signalfd, loop);
+  if (!loop->signal_handle) {
+    goto ERR;
+  }
+
+  return loop;
+
+ERR:
+  if (loop->signal_fd >= 0) {
+    close(loop->signal_fd);
+  }
+  close(loop->epoll_fd);
+  free(loop);
+  return NULL;
+}
+
+static void event_loop_free_removed(struct EventLoop *loop) {
+  while (loop->removed) {
+    struct EventLoopFd *h = loop->removed;
+    loop->removed = h->next_removed;
+    free(h);
+  }
+}
+
+void event_loop_free(struct EventLoop *loop) {
+  if (!loop) {
+    return;
+  }
+
+  event_loop_remove_fd(loop, loop->signal_handle);
+  event_loop_free_removed(loop);
+  close(loop->signal_fd);
+  close(loop->epoll_fd);
+  free(loop);
+}
+
+struct Clock *event_loop_clock(struct EventLoop *loop) { return loop->clock; }
+
+static struct EventLoopTimer *event_loop_next_sim_timer(struct EventLoop *loop) {
+  struct EventLoopTimer *next = NULL;
+  for (struct EventLoopTimer *t = loop->timers; t; t = t->next) {
+    if (t->armed && (!next || t->deadline_ns < next->deadline_ns)) {
+      next = t;
+    }
+  }
+  return next;
+}
+
+static void event_loop_fire_sim_timer(struct EventLoopTimer *t) {
+  clock_sim_set(t->loop->clock, t->deadline_ns);
+  if (t->periodic) {
+    t->deadline_ns += t->period_ns;
+  } else {
+    t->armed = false;
+  }
+  t->cb(t->usr);
+}
+
+void event_loop_run(struct EventLoop *loop) {
+  loop->stop = false;
+  while (!loop->stop) {
+    // With a simulated clock, don't block on fds if there is a timer to fire
+    const bool sim_timer_pending =
+        loop->clock->simulated && event_loop_next_sim_timer(loop) != NULL;
+    struct epoll_event evs[EVENT_LOOP_MAX_EVENTS];
+    const int n = epoll_wait(loop->epoll_fd, evs, EVENT_LOOP_MAX_EVENTS,
+                             sim_timer_pending ? EVENT_LOOP_SIM_IDLE_WAIT_MS : -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      perror("EventLoop epoll_wait fail");
+      return;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      struct EventLoopFd *h = evs[i].data.ptr;
+      if (h->fd >= 0) {
+        h->cb(h->usr, h->fd, evs[i].events);
+      }
+    }
+
+    // Callbacks may have changed the timers, look for the next one again
+    struct EventLoopTimer *t = loop->clock->simulated ? event_loop_next_sim_timer(loop) : NULL;
+    if (n == 0 && t) {
+      event_loop_fire_sim_timer(t);
+    }
+
+    event_loop_free_removed(loop);
+  }
+}
+
+void event_loop_stop(struct EventLoop *loop) { loop->stop = true; }
+
+struct EventLoopFd *event_loop_add_fd(struct EventLoop *loop, int fd, uint32_t events,
+                                      event_loop_fd_cb_t cb, void *usr) {
+  struct EventLoopFd *h = malloc(sizeof(struct EventLoopFd));
+  if (!h) {
+    perror("EventLoop bad handler alloc");
+    return NULL;
+  }
+
+  h->fd = fd;
+  h->cb = cb;
+  h->usr = usr;
+  h->next_removed = NULL;
+
+  struct epoll_event ev = {.events = events, .data.ptr = h};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    perror("EventLoop can't watch fd");
+    free(h);
+    return NULL;
+  }
+
+  return h;
+}
+
+void event_loop_remove_fd(struct EventLoop *loop, struct EventLoopFd *h) {
+  if (!h) {
+    return;
+  }
+
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, h->fd, NULL) != 0) {
+    perror("EventLoop can't stop watching fd");
+  }
+
+  h->fd = -1;
+  h->next_removed = loop->removed;
+  loop->removed = h;
+}
+
+static void event_loop_on_timerfd(void *usr, int fd, uint32_t events) {
+  struct EventLoopTimer *t = usr;
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    // Spurious wakeup, eg the timer was re-armed after the event was queued
+    return;
+  }
+
+  if (!t->periodic) {
+    t->armed = false;
+  }
+  t->cb(t->usr);
+}
+
+struct EventLoopTimer *event_loop_timer_init(struct EventLoop *loop, event_loop_timer_cb_t cb,
+                                             void *usr) {
+  struct EventLoopTimer *t = malloc(sizeof(struct EventLoopTimer));
+  if (!t) {
+    perror("EventLoop bad timer alloc");
+    return NULL;
+  }
+
+  t->loop = loop;
+  t->armed = false;
+  t->periodic = false;
+  t->deadline_ns = 0;
+  t->period_ns = 0;
+  t->cb = cb;
+  t->usr = usr;
+  t->handle = NULL;
+  t->next = loop->timers;
+  if (loop->clock->simulated) {
+    t->fd = -1;
+    loop->timers = t;
+    return t;
+  }
+
+  t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (t->fd < 0) {
+    perror("EventLoop can't create timerfd");
+    free(t);
+    return NULL;
+  }
+
+  t->handle = event_loop_add_fd(loop, t->fd, EPOLLIN, event_loop_on_timerfd, t);
+  if (!t->handle) {
+    close(t->fd);
+    free(t);
+    return NULL;
+  }
+
+  loop->timers = t;
+  return t;
+}
+
+void event_loop_timer_free(struct EventLoop *loop, struct EventLoopTimer *t) {
+  if (!t) {
+    return;
+  }
+
+  for (struct EventLoopTimer **it = &loop->timers; *it; it = &(*it)->next) {
+    if (*it == t) {
+      *it = t->next;
+      break;
+    }
+  }
+
+  if (t->fd >= 0) {
+    event_loop_remove_fd(loop, t->handle);
+    close(t->fd);
+  }
+  free(t);
+}
+
+static struct timespec ms_to_timespec(size_t ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+  return ts;
+}
+
+bool event_loop_timer_arm(struct EventLoopTimer *t, size_t delay_ms, size_t period_ms) {
+  if (t->fd < 0) {
+    t->deadline_ns = clock_now_ns(t->loop->clock) + 1000000ull * delay_ms;
+    t->period_ns = 1000000ull * period_ms;
+    t->armed = true;
+    t->periodic = (period_ms != 0);
+    return true;
+  }
+
+  struct itimerspec spec = {
+      .it_interval = ms_to_timespec(period_ms),
+      .it_value = ms_to_timespec(delay_ms),
+  };
+  if (delay_ms == 0) {
+    // A zero it_value would disarm the timer
+    spec.it_value.tv_nsec = 1;
+  }
+
+  if (timerfd_settime(t->fd, 0, &spec, NULL) != 0) {
+    perror("EventLoop can't arm timer");
+    return false;
+  }
+
+  t->armed = true;
+  t->periodic = (period_ms != 0);
+  return true;
+}
+
+void event_loop_timer_disarm(struct EventLoopTimer *t) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (t->fd >= 0 && timerfd_settime(t->fd, 0, &spec, NULL) != 0) {
+    perror("EventLoop can't disarm timer");
+  }
+  t->armed = false;
+}
+
+bool event_loop_timer_armed(const struct EventLoopTimer *t) { return t->armed; }
+
+bool event_loop_on_signal(struct EventLoop *loop, int signo, event_loop_signal_cb_t cb,
+                          void *usr) {
+  sigset_t sigs;
+  handled_signals(&sigs);
+  if (signo <= 0 || signo >= NSIG || !sigismember(&sigs, signo)) {
+    fprintf(stderr, "EventLoop can't handle signal %d\n", signo);
+    return false;
+  }
+
+  if (loop->signal_handlers[signo].cb) {
+    fprintf(stderr, "EventLoop already has a handler for signal %d\n", signo);
+    return false;
+  }
+
+  loop->signal_handlers[signo].cb = cb;
+  loop->signal_handlers[signo].usr = usr;
+  return true;
+}
+
+void event_loop_child_sigmask(sigset_t *mask) {
+  sigset_t sigs;
+  handled_signals(&sigs);
+  sigprocmask(SIG_SETMASK, NULL, mask);
+  for (int signo = 1; signo < NSIG; ++signo) {
+    if (sigismember(&sigs, signo)) {
+      sigdelset(mask, signo);
+    }
+  }
+}
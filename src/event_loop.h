@@ -0,0 +1,52 @@
+#pragma once
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Single threaded epoll reactor. Everything that needs to react to an fd, a timer or a signal in
+// the main thread registers a callback here.
+struct Clock;
+struct EventLoop;
+struct EventLoopFd;
+struct EventLoopTimer;
+
+typedef void (*event_loop_fd_cb_t)(void *usr, int fd, uint32_t events);
+typedef void (*event_loop_timer_cb_t)(void *usr);
+typedef void (*event_loop_signal_cb_t)(void *usr, int signo);
+
+// Creating the loop blocks all signals that may be handled through event_loop_on_signal in the
+// calling thread, so it should be created before any other thread (threads inherit the mask).
+// Timers run on clock. With a simulated clock, whenever no fd is ready the loop jumps the clock to
+// the next timer deadline and fires it, instead of waiting.
+struct EventLoop *event_loop_init(struct Clock *clock);
+void event_loop_free(struct EventLoop *loop);
+struct Clock *event_loop_clock(struct EventLoop *loop);
+
+// Run until event_loop_stop is called
+void event_loop_run(struct EventLoop *loop);
+void event_loop_stop(struct EventLoop *loop);
+
+// Watch fd for events (EPOLLIN, EPOLLOUT...). The fd is still owned by the caller, and must be
+// removed from the loop before it's closed.
+struct EventLoopFd *event_loop_add_fd(struct EventLoop *loop, int fd, uint32_t events,
+                                      event_loop_fd_cb_t cb, void *usr);
+void event_loop_remove_fd(struct EventLoop *loop, struct EventLoopFd *h);
+
+// Timers start disarmed
+struct EventLoopTimer *event_loop_timer_init(struct EventLoop *loop, event_loop_timer_cb_t cb,
+                                             void *usr);
+void event_loop_timer_free(struct EventLoop *loop, struct EventLoopTimer *t);
+// Fire once after delay_ms; if period_ms isn't zero, keep firing every period_ms after that
+bool event_loop_timer_arm(struct EventLoopTimer *t, size_t delay_ms, size_t period_ms);
+void event_loop_timer_disarm(struct EventLoopTimer *t);
+bool event_loop_timer_armed(const struct EventLoopTimer *t);
+
+// Handle signo in the loop (through a signalfd) instead of in a signal handler. Only one callback
+// per signal. Supported signals: SIGINT, SIGTERM, SIGHUP, SIGUSR1, SIGUSR2.
+bool event_loop_on_signal(struct EventLoop *loop, int signo, event_loop_signal_cb_t cb, void *usr);
+
+// Signal mask for child processes: signals handled by the loop are blocked in this process, and
+// children would inherit the mask through exec. Returns the current mask without those signals.
+void event_loop_child_sigmask(sigset_t *mask);
@@ -0,0 +1,19 @@
+#include "glitch_filter.h"
+
+#include <string.h>
+
+void glitch_filter_init(struct GlitchFilter *f, const struct PiPresenceMonConfig *cfg,
+                        gpio_reg_t pins, bool initial) {
+  memset(f, 0, sizeof(*f));
+  f->kind = cfg->sensor_filter;
+  f->pins = pins;
+  f->output = initial ? pins : 0;
+
+  f->stable_ns = cfg->sensor_filter_stable_ms * 1000000ull;
+
+  f->majority_n = cfg->sensor_filter_majority_n;
+  f->majority_mask = ((uint32_t)1 << f->majority_n) - 1;
+  for (size_t pin = 0; pin < GPIO_PINS; ++pin) {
+    f->history[pin] = initial ? f->majority_mask : 0;
+  }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "cfg.h"
+#include "gpio.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest majority vote, in samples: each pin keeps its history in a uint32_t
+#define GLITCH_FILTER_MAX_MAJORITY_N 31
+
+// Filters raw register reads before they reach the occupancy window, so that short spikes (EMI on
+// long cables) don't count as activity. Works on a set of pins, each filtered on its own. A
+// glitch is a raw excursion away from the filtered state that ends before the filter accepts it.
+// Fixed size, no allocations; not thread safe: meant to be owned by a sampler thread.
+struct GlitchFilter {
+  enum GlitchFilterKind kind;
+  gpio_reg_t pins;
+  // Filtered state of each pin
+  gpio_reg_t output;
+  // Pins whose last raw read differs from output
+  gpio_reg_t excursion;
+  // Pins that could still change without a new raw value (eg a partially filled majority)
+  gpio_reg_t unsettled;
+  size_t rejected;
+
+  // GLITCH_FILTER_STABLE: a pin changes once every read of it for stable_ns has been the new value.
+  // Measured in time, not reads, so extra reads can't shorten it. since_ns is when each pin in
+  // excursion first read its new value.
+  uint64_t stable_ns;
+  uint64_t since_ns[GPIO_PINS];
+
+  // GLITCH_FILTER_MAJORITY: output is the majority of the last majority_n samples of each pin
+  size_t majority_n;
+  uint32_t majority_mask;
+  uint32_t history[GPIO_PINS];
+};
+
+// initial is the filtered state to start from, for all pins
+void glitch_filter_init(struct GlitchFilter *f, const struct PiPresenceMonConfig *cfg,
+                        gpio_reg_t pins, bool initial);
+
+static inline size_t glitch_filter_rejected(const struct GlitchFilter *f) {
+  return f->rejected;
+}
+
+// True if nothing will change until a pin reads something different from the filtered output
+static inline bool glitch_filter_settled(const struct GlitchFilter *f) {
+  return (f->excursion | f->unsettled) == 0;
+}
+
+// Feed a raw read taken at now_ns (pins outside the filter are ignored), returns the filtered state
+// of the pins
+static inline gpio_reg_t glitch_filter_update(struct GlitchFilter *f, gpio_reg_t raw,
+                                              uint64_t now_ns) {
+  raw &= f->pins;
+  gpio_reg_t flip = 0;
+  switch (f->kind) {
+  case GLITCH_FILTER_NONE:
+    f->output = raw;
+    return raw;
+
+  case GLITCH_FILTER_STABLE: {
+    // Only pins currently away from their output are visited. A pin that went back to its output
+    // (unsettled but no longer differing) starts over on its next excursion.
+    const gpio_reg_t differ = raw ^ f->output;
+    for (gpio_reg_t started = differ & ~f->unsettled; started; started &= started - 1) {
+      f->since_ns[__builtin_ctz(started)] = now_ns;
+    }
+    for (gpio_reg_t pins = differ; pins; pins &= pins - 1) {
+      const unsigned pin = __builtin_ctz(pins);
+      if (now_ns - f->since_ns[pin] >= f->stable_ns) {
+        flip |= (gpio_reg_t)1 << pin;
+      }
+    }
+    f->unsettled = differ & ~flip;
+    break;
+  }
+
+  case GLITCH_FILTER_MAJORITY: {
+    f->unsettled = 0;
+    for (gpio_reg_t pins = f->pins; pins; pins &= pins - 1) {
+      const unsigned pin = __builtin_ctz(pins);
+      const gpio_reg_t bit = (gpio_reg_t)1 << pin;
+      const uint32_t h = ((f->history[pin] << 1) | !!(raw & bit)) & f->majority_mask;
+      f->history[pin] = h;
+      const bool majority = (size_t)__builtin_popcount(h) > f->majority_n / 2;
+      if (majority != !!(f->output & bit)) {
+        flip |= bit;
+      }
+      if (h != 0 && h != f->majority_mask) {
+        f->unsettled |= bit;
+      }
+    }
+    break;
+  }
+  }
+
+  // Excursions that ended without changing the output were glitches
+  const gpio_reg_t was_away = f->excursion & ~flip;
+  f->output ^= flip;
+  f->excursion = raw ^ f->output;
+  f->rejected += __builtin_popcount(was_away & ~f->excursion);
+  return f->output;
+}
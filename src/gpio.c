@@ -1,34 +1,199 @@
 // https://www.cs.uaf.edu/2016/fall/cs301/lecture/11_09_raspberry_pi.html
 
 #include "gpio.h"
+#include "clock.h"
+#include "logger.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/gpio.h>
+#include <linux/memfd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define GPIO_PATH "/dev/gpiomem"
 #define GPIO_MEM_SZ 4096
 #define GPIO_INPUTS 13
 
+#define GPIO_CONSUMER_NAME "pipresencemon"
+
+#define GPIO_MOCK_FILE "gpio_mock"
+#define GPIO_MOCK_FILE_PERIOD_MS 100
+
+enum GpioBackend {
+  // Read the full input register through /dev/gpiomem
+  GPIO_BACKEND_MMAP,
+  // Read the input register from a memfd page with the same layout as /dev/gpiomem
+  GPIO_BACKEND_MOCK,
+  // A single line requested through /dev/gpiochipN, with edge events
+  GPIO_BACKEND_CHARDEV,
+};
+
 struct GPIO {
-  bool use_mock;
+  enum GpioBackend backend;
+  // mmap backend: /dev/gpiomem fd. chardev backend: line request fd
   int fd;
   gpio_reg_t *mem;
+  // chardev backend: the only pin that can be read
+  size_t line_pin;
+
+  // mock backend: mmap'd trace file and position of the next change to apply, or
+  // GPIO_MOCK_FILE polling if there's no trace. Both follow clock.
+  const struct Clock *clock;
+  const char *trace;
+  size_t trace_sz;
+  size_t trace_pos;
+  size_t trace_line;
+  uint64_t trace_start_ns;
+  bool mock_file;
+  uint64_t mock_file_next_read_ns;
 };
 
-struct GPIO *gpio_open(bool use_mock) {
+static bool gpio_open_mock(struct GPIO *gpio, const char *mock_trace) {
+  gpio->fd = syscall(SYS_memfd_create, "gpio_mock", MFD_CLOEXEC);
+  if (gpio->fd < 0) {
+    perror("GPIO can't create mock register page");
+    return false;
+  }
+
+  if (ftruncate(gpio->fd, GPIO_MEM_SZ) != 0) {
+    perror("GPIO can't size mock register page");
+    close(gpio->fd);
+    return false;
+  }
+
+  gpio->mem = mmap(NULL, GPIO_MEM_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, gpio->fd, 0);
+  if (gpio->mem == MAP_FAILED) {
+    perror("GPIO can't mmap mock register page");
+    close(gpio->fd);
+    return false;
+  }
+
+  gpio->trace_start_ns = clock_now_ns(gpio->clock);
+  if (!mock_trace) {
+    // ./gpio_mock is looked for on every update, it takes over the page whenever it exists
+    printf("Using GPIO mock file at `./%s` if it exists, else the mock register page at "
+           "/proc/%d/fd/%d (inputs at offset %zu)\n",
+           GPIO_MOCK_FILE, getpid(), gpio->fd, GPIO_INPUTS * sizeof(gpio_reg_t));
+    return true;
+  }
+
+  const int trace_fd = open(mock_trace, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (trace_fd < 0 || fstat(trace_fd, &st) != 0) {
+    fprintf(stderr, "Can't open GPIO mock trace %s\n", mock_trace);
+    perror("GPIO init fail");
+    goto ERR;
+  }
+
+  gpio->trace_sz = st.st_size;
+  if (gpio->trace_sz > 0) {
+    gpio->trace = mmap(NULL, gpio->trace_sz, PROT_READ, MAP_PRIVATE, trace_fd, 0);
+    if (gpio->trace == MAP_FAILED) {
+      gpio->trace = NULL;
+      perror("GPIO can't mmap mock trace");
+      goto ERR;
+    }
+  }
+
+  close(trace_fd);
+  printf("Replaying GPIO mock trace %s\n", mock_trace);
+  return true;
+
+ERR:
+  if (trace_fd >= 0) {
+    close(trace_fd);
+  }
+  munmap(gpio->mem, GPIO_MEM_SZ);
+  close(gpio->fd);
+  return false;
+}
+
+// Parse an unsigned number from [*p, end), skipping leading blanks. Accepts a 0x prefix.
+static bool gpio_trace_parse(const char **p, const char *end, uint64_t *v) {
+  while (*p < end && (**p == ' ' || **p == '\t')) {
+    ++*p;
+  }
+
+  unsigned base = 10;
+  if (end - *p > 2 && (*p)[0] == '0' && ((*p)[1] == 'x' || (*p)[1] == 'X')) {
+    base = 16;
+    *p += 2;
+  }
+
+  const char *start = *p;
+  *v = 0;
+  while (*p < end) {
+    const char c = **p;
+    unsigned digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (base == 16 && c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if (base == 16 && c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      break;
+    }
+    *v = *v * base + digit;
+    ++*p;
+  }
+
+  return *p != start;
+}
+
+// Apply every trace change that is due. Trace lines are only parsed once, when they are reached.
+static void gpio_mock_trace_advance(struct GPIO *gpio) {
+  const uint64_t elapsed_ms = (clock_now_ns(gpio->clock) - gpio->trace_start_ns) / 1000000;
+  const char *end = gpio->trace + gpio->trace_sz;
+  while (gpio->trace_pos < gpio->trace_sz) {
+    const char *line = gpio->trace + gpio->trace_pos;
+    const char *eol = memchr(line, '\n', end - line);
+    eol = eol ? eol : end;
+
+    const char *p = line;
+    uint64_t t_ms, reg;
+    if (line[0] != '#' && line != eol) {
+      if (!gpio_trace_parse(&p, eol, &t_ms) || !gpio_trace_parse(&p, eol, &reg)) {
+        logger_log(LOG_LEVEL_WARN, "GPIO mock trace: can't parse line %zu, ignoring",
+                   gpio->trace_line + 1);
+      } else if (t_ms > elapsed_ms) {
+        return;
+      } else {
+        gpio->mem[GPIO_INPUTS] = (gpio_reg_t)reg;
+      }
+    }
+
+    gpio->trace_pos = (eol - gpio->trace) + 1;
+    gpio->trace_line++;
+  }
+}
+
+
+struct GPIO *gpio_open(bool use_mock, const char *mock_trace, const struct Clock *clock) {
   struct GPIO *gpio = malloc(sizeof(struct GPIO));
   if (!gpio) {
     perror("GPIO bad alloc");
     return NULL;
   }
 
-  gpio->use_mock = use_mock;
-  if (gpio->use_mock) {
-    printf("Using GPIO mock file at `./gpio_mock`\n");
+  memset(gpio, 0, sizeof(*gpio));
+  gpio->backend = use_mock ? GPIO_BACKEND_MOCK : GPIO_BACKEND_MMAP;
+  gpio->clock = clock;
+  gpio->fd = -1;
+  gpio->mem = NULL;
+  if (gpio->backend == GPIO_BACKEND_MOCK) {
+    if (!gpio_open_mock(gpio, mock_trace)) {
+      free(gpio);
+      return NULL;
+    }
     return gpio;
   }
 
@@ -54,16 +219,94 @@ struct GPIO *gpio_open(bool use_mock) {
   return gpio;
 }
 
-void gpio_close(struct GPIO *gpio) {
-  if (gpio->use_mock) {
+struct GPIO *gpio_open_line_events(const char *chip_path, size_t pin, size_t debounce_us) {
+  if (pin >= GPIO_PINS) {
+    fprintf(stderr, "Invalid pin number %zu (max %zu)\n", pin, GPIO_PINS);
+    return NULL;
+  }
+
+  struct GPIO *gpio = malloc(sizeof(struct GPIO));
+  if (!gpio) {
+    perror("GPIO bad alloc");
+    return NULL;
+  }
+
+  memset(gpio, 0, sizeof(*gpio));
+  gpio->backend = GPIO_BACKEND_CHARDEV;
+  gpio->mem = NULL;
+  gpio->line_pin = pin;
+  gpio->fd = -1;
+
+  const int chip_fd = open(chip_path, O_RDONLY | O_CLOEXEC);
+  if (chip_fd < 0) {
+    fprintf(stderr, "Error opening %s\n", chip_path);
+    perror("GPIO init fail");
     free(gpio);
-    return;
+    return NULL;
   }
 
+  struct gpio_v2_line_request req;
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = pin;
+  req.num_lines = 1;
+  strncpy(req.consumer, GPIO_CONSUMER_NAME, sizeof(req.consumer) - 1);
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING |
+                     GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  if (debounce_us) {
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+    req.config.attrs[0].attr.debounce_period_us = debounce_us;
+    req.config.attrs[0].mask = 1;
+  }
+
+  int ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  if (ret < 0 && debounce_us) {
+    // Old kernels reject the attribute; the software filter still applies
+    perror("GPIO line debounce not available");
+    req.config.num_attrs = 0;
+    memset(&req.config.attrs[0], 0, sizeof(req.config.attrs[0]));
+    ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  } else if (debounce_us) {
+    printf("Kernel debounces line %zu for %zu usecs\n", pin, debounce_us);
+  }
+  close(chip_fd);
+  if (ret < 0) {
+    fprintf(stderr, "Can't request line %zu from %s\n", pin, chip_path);
+    perror("GPIO init fail");
+    free(gpio);
+    return NULL;
+  }
+
+  // Events are drained after poll() says they're ready, reads should never block
+  gpio->fd = req.fd;
+  if (fcntl(gpio->fd, F_SETFL, fcntl(gpio->fd, F_GETFL) | O_NONBLOCK) != 0) {
+    perror("GPIO can't set line fd to non-blocking");
+    close(gpio->fd);
+    free(gpio);
+    return NULL;
+  }
+
+  printf("Monitoring %s line %zu through GPIO edge events\n", chip_path, pin);
+  return gpio;
+}
+
+void gpio_close(struct GPIO *gpio) {
   if (!gpio) {
     return;
   }
 
+  if (gpio->trace && munmap((void *)gpio->trace, gpio->trace_sz) != 0) {
+    perror("GPIO close mock trace munmap fail");
+  }
+
+  if (gpio->backend == GPIO_BACKEND_CHARDEV) {
+    if (close(gpio->fd) != 0) {
+      perror("GPIO close line fd fail");
+    }
+    free(gpio);
+    return;
+  }
+
   if (munmap(gpio->mem, GPIO_MEM_SZ) != 0) {
     perror("GPIO close munmap fail");
   }
@@ -75,30 +318,124 @@ void gpio_close(struct GPIO *gpio) {
   free(gpio);
 }
 
+static bool gpio_chardev_get_value(struct GPIO *gpio) {
+  struct gpio_v2_line_values vals;
+  memset(&vals, 0, sizeof(vals));
+  vals.mask = 1;
+  if (ioctl(gpio->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) < 0) {
+    logger_log(LOG_LEVEL_ERROR, "GPIO can't read line value: %s", strerror(errno));
+    return false;
+  }
+  return vals.bits & 1;
+}
+
+// Returns false if there is no mock file (it may be created, or removed, at any time)
+static bool gpio_mock_read(bool *active) {
+  FILE *file = fopen(GPIO_MOCK_FILE, "r");
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      logger_log(LOG_LEVEL_ERROR, "GPIO can't read mock file '%s': %s", GPIO_MOCK_FILE,
+                 strerror(errno));
+    }
+    return false;
+  }
+  char ch = fgetc(file);
+  fclose(file);
+  *active = (ch == '1');
+  return true;
+}
+
+// Bring the mock register page up to date. Without a trace or mock file this is a no-op: whoever
+// drives the page writes it directly.
+static void gpio_mock_update(struct GPIO *gpio) {
+  if (gpio->trace) {
+    gpio_mock_trace_advance(gpio);
+    return;
+  }
+
+  const uint64_t now = clock_now_ns(gpio->clock);
+  if (now < gpio->mock_file_next_read_ns) {
+    return;
+  }
+  gpio->mock_file_next_read_ns = now + GPIO_MOCK_FILE_PERIOD_MS * 1000000ull;
+
+  bool active;
+  const bool mock_file = gpio_mock_read(&active);
+  if (mock_file != gpio->mock_file) {
+    logger_log(LOG_LEVEL_INFO, mock_file ? "GPIO mock file `./%s` found, it drives all pins"
+                                         : "GPIO mock file `./%s` removed, pins keep their value",
+               GPIO_MOCK_FILE);
+    gpio->mock_file = mock_file;
+  }
+  if (mock_file) {
+    // The mock file drives all pins at once
+    gpio->mem[GPIO_INPUTS] = active ? ~(gpio_reg_t)0 : 0;
+  }
+}
+
 bool gpio_get_pin(struct GPIO *gpio, size_t pin) {
-  if (gpio->use_mock) {
-    FILE *file = fopen("gpio_mock", "r");
-    if (file == NULL) {
-      perror("ERROR: GPIO mocked, but file 'gpio_mock' can't be found. Do `echo 1 > gpio_mock` to "
-             "mock.");
+  if (gpio->backend == GPIO_BACKEND_CHARDEV) {
+    if (pin != gpio->line_pin) {
+      logger_log(LOG_LEVEL_ERROR, "GPIO pin %zu requested, but only line %zu is available", pin,
+                 gpio->line_pin);
       return false;
     }
-    char ch = fgetc(file);
-    fclose(file);
-    return (ch == '1');
+    return gpio_chardev_get_value(gpio);
+  }
+
+  if (gpio->backend == GPIO_BACKEND_MOCK) {
+    gpio_mock_update(gpio);
   }
 
   return gpio->mem[GPIO_INPUTS] & (1 << pin);
 }
 
 gpio_reg_t gpio_get_inputs(struct GPIO *gpio) {
-  if (gpio->use_mock) {
-    return -1;
+  if (gpio->backend == GPIO_BACKEND_MOCK) {
+    gpio_mock_update(gpio);
+  }
+
+  if (gpio->backend == GPIO_BACKEND_CHARDEV) {
+    return (gpio_reg_t)gpio_chardev_get_value(gpio) << gpio->line_pin;
   }
 
   return gpio->mem[GPIO_INPUTS];
 }
 
+int gpio_get_event_fd(struct GPIO *gpio) {
+  return (gpio->backend == GPIO_BACKEND_CHARDEV) ? gpio->fd : -1;
+}
+
+int gpio_read_edges(struct GPIO *gpio, bool *rising, uint64_t *last_edge_ns) {
+  if (gpio->backend != GPIO_BACKEND_CHARDEV) {
+    return 0;
+  }
+
+  int edges = 0;
+  *rising = false;
+  while (true) {
+    struct gpio_v2_line_event evs[16];
+    const ssize_t rd = read(gpio->fd, evs, sizeof(evs));
+    if (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return edges;
+    } else if (rd < 0) {
+      logger_log(LOG_LEVEL_ERROR, "GPIO can't read line events: %s", strerror(errno));
+      return -1;
+    }
+
+    const size_t cnt = rd / sizeof(evs[0]);
+    for (size_t i = 0; i < cnt; ++i) {
+      *rising |= (evs[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+      *last_edge_ns = evs[i].timestamp_ns;
+    }
+    edges += cnt;
+
+    if (cnt < sizeof(evs) / sizeof(evs[0])) {
+      return edges;
+    }
+  }
+}
+
 #define COL_NOO "\x1B[0m"
 #define COL_RED "\x1B[31m"
 
@@ -3,14 +3,35 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define GPIO_PINS (CHAR_BIT * sizeof(gpio_reg_t))
 
+struct Clock;
 struct GPIO;
 typedef unsigned int gpio_reg_t;
 
-struct GPIO *gpio_open(bool use_mock);
+// With use_mock, the register page is a memfd instead of /dev/gpiomem, and it's read the same way.
+// The page is driven by mock_trace if set (a `<timestamp_ms> <register, eg 0x4000000>` line per
+// change, replayed on clock from open), else by ./gpio_mock while it exists (`echo 1 > gpio_mock`
+// sets all pins; the file is looked for and re-read at most every GPIO_MOCK_FILE_PERIOD_MS, so it
+// can be created after open), else by an external process writing the page through
+// /proc/<pid>/fd/N.
+struct GPIO *gpio_open(bool use_mock, const char *mock_trace, const struct Clock *clock);
+// Request a single input line through the GPIO character device (v2 uAPI), with edge detection
+// on both edges. Only `pin` can be read from the returned handle. If debounce_us is set, ask the
+// kernel to debounce the line (edges and reads); falls back to a plain line if it can't.
+struct GPIO *gpio_open_line_events(const char *chip_path, size_t pin, size_t debounce_us);
 void gpio_close(struct GPIO *gpio);
 gpio_reg_t gpio_get_inputs(struct GPIO *gpio);
 gpio_reg_t gpio_get_and_print_delta(struct GPIO *gpio, gpio_reg_t prev_gpio_reg);
 bool gpio_get_pin(struct GPIO *gpio, size_t pin);
+
+// fd that becomes readable when the line has pending edge events, or -1 if this backend can only
+// be polled
+int gpio_get_event_fd(struct GPIO *gpio);
+
+// Consume all pending edge events (never blocks). Returns the number of edges read, or -1 on
+// error. If any edge was read, *rising is set if at least one of them was a rising edge, and
+// *last_edge_ns gets the CLOCK_MONOTONIC kernel timestamp of the last one.
+int gpio_read_edges(struct GPIO *gpio, bool *rising, uint64_t *last_edge_ns);
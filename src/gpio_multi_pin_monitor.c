@@ -0,0 +1,408 @@
+#include "gpio_multi_pin_monitor.h"
+#include "cfg.h"
+#include "clock.h"
+#include "glitch_filter.h"
+#include "logger.h"
+#include "metrics.h"
+#include "periodic_timer.h"
+#include "trace.h"
+#include "transition_notifier.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Counters are bit-sliced ("vertical"): bit k of plane[k] holds bit k of the counter of every pin,
+// one pin per bit position. Adding one sample register to all 32 counters is then a ripple-carry
+// over the planes, so the cost depends on the counter width, not on the number of pins.
+#define SLICED_COUNTER_MAX_BITS (CHAR_BIT * sizeof(size_t))
+
+struct SlicedCounter {
+  size_t bits;
+  gpio_reg_t plane[SLICED_COUNTER_MAX_BITS];
+};
+
+struct GpioMultiPinMonitor {
+  struct GPIO *gpio;
+  bool gpio_debug;
+  gpio_reg_t pin_mask;
+
+  // History of raw (masked) input registers, one per sample
+  size_t sensor_readings_write_idx;
+  size_t sensor_readings_sz;
+  gpio_reg_t *sensor_readings;
+  // Active samples in window, per pin. Only the sampler thread writes it; readers in other threads
+  // go through window_seq, a seqlock (odd while an update is in progress, readers retry if it
+  // changed under them), so a reader never blocks the sampler.
+  struct SlicedCounter active_count_in_window;
+  atomic_uint window_seq;
+
+  pthread_t thread_id;
+  atomic_bool thread_stop;
+  struct PeriodicTimer sample_timer;
+  // Raw reads go through this before the window. Only used by the sampler thread.
+  struct GlitchFilter filter;
+  atomic_size_t rejected_glitches;
+
+  // Thresholds, pre-converted from % to sample counts
+  size_t rising_edge_active_threshold_cnt;
+  size_t falling_edge_inactive_threshold_cnt;
+  // Pins currently active, without inactivity timeout
+  gpio_reg_t currently_active;
+  // Per-pin countdown before a pin transitions from active->inactive. Counted in sampling periods;
+  // missed periods are still counted, so this tracks wall time.
+  size_t vacancy_motion_timeout_ticks;
+  struct SlicedCounter vacant_timeout_ticks;
+  atomic_uint active;
+  // Set by gpio_multi_pin_monitor_on_user_activity, applied by the sampler thread on its next tick
+  atomic_bool user_activity;
+  // Last filtered reading, and the last time it changed, reported with transitions
+  gpio_reg_t last_reading;
+  uint64_t sensor_change_ns;
+  // Notifies changes between "no pin active" and "any pin active"
+  struct TransitionNotifier transitions;
+};
+
+static size_t bits_needed(size_t max_val) {
+  size_t bits = 1;
+  while (bits < SLICED_COUNTER_MAX_BITS && (max_val >> bits) != 0) {
+    ++bits;
+  }
+  return bits;
+}
+
+static void sliced_counter_set(struct SlicedCounter *c, gpio_reg_t pins, size_t val) {
+  for (size_t k = 0; k < c->bits; ++k) {
+    c->plane[k] = (c->plane[k] & ~pins) | (((val >> k) & 1) ? pins : 0);
+  }
+}
+
+static void sliced_counter_inc(struct SlicedCounter *c, gpio_reg_t pins) {
+  gpio_reg_t carry = pins;
+  for (size_t k = 0; k < c->bits && carry; ++k) {
+    const gpio_reg_t next_carry = c->plane[k] & carry;
+    c->plane[k] ^= carry;
+    carry = next_carry;
+  }
+}
+
+static void sliced_counter_dec(struct SlicedCounter *c, gpio_reg_t pins) {
+  gpio_reg_t borrow = pins;
+  for (size_t k = 0; k < c->bits && borrow; ++k) {
+    const gpio_reg_t next_borrow = ~c->plane[k] & borrow;
+    c->plane[k] ^= borrow;
+    borrow = next_borrow;
+  }
+}
+
+static gpio_reg_t sliced_counter_nonzero(const struct SlicedCounter *c) {
+  gpio_reg_t nonzero = 0;
+  for (size_t k = 0; k < c->bits; ++k) {
+    nonzero |= c->plane[k];
+  }
+  return nonzero;
+}
+
+// Mask of pins whose counter is bigger than val (*gt), and equal to val (*eq)
+static void sliced_counter_cmp(const struct SlicedCounter *c, size_t val, gpio_reg_t *gt,
+                               gpio_reg_t *eq) {
+  *gt = 0;
+  *eq = ~(gpio_reg_t)0;
+  if (val >> c->bits) {
+    // val can't be represented, every counter is smaller
+    *eq = 0;
+    return;
+  }
+
+  for (size_t k = c->bits; k-- > 0;) {
+    if ((val >> k) & 1) {
+      *eq &= c->plane[k];
+    } else {
+      *gt |= *eq & c->plane[k];
+      *eq &= ~c->plane[k];
+    }
+  }
+}
+
+static size_t sliced_counter_get(const struct SlicedCounter *c, size_t pin) {
+  size_t val = 0;
+  for (size_t k = 0; k < c->bits; ++k) {
+    val |= (size_t)((c->plane[k] >> pin) & 1) << k;
+  }
+  return val;
+}
+
+static gpio_reg_t gpio_multi_pin_monitor_read(struct GpioMultiPinMonitor *mon) {
+  const gpio_reg_t reading =
+      glitch_filter_update(&mon->filter, gpio_get_inputs(mon->gpio), monotonic_now_ns());
+  if (glitch_filter_rejected(&mon->filter) != mon->rejected_glitches) {
+    mon->rejected_glitches = glitch_filter_rejected(&mon->filter);
+    if (mon->gpio_debug) {
+      logger_log(LOG_LEVEL_DEBUG, "Glitch rejected (%zu so far)", (size_t)mon->rejected_glitches);
+    }
+  }
+  return reading;
+}
+
+static void log_pins(enum LogLevel level, const char *msg, gpio_reg_t pins) {
+  // Up to 3 chars per pin
+  char pin_list[3 * GPIO_PINS + 1];
+  size_t sz = 0;
+  pin_list[0] = '\0';
+  for (size_t pin = 0; pin < GPIO_PINS; ++pin) {
+    if (pins & ((gpio_reg_t)1 << pin)) {
+      sz += snprintf(pin_list + sz, sizeof(pin_list) - sz, " %zu", pin);
+    }
+  }
+  logger_log(level, "%s:%s", msg, pin_list);
+}
+
+static void *gpio_multi_pin_monitor_update(void *usr) {
+  struct GpioMultiPinMonitor *mon = usr;
+  trace_thread_name("GpioMultiPinMonitor");
+  gpio_reg_t debug_last_reading = 0;
+  uint64_t elapsed_ticks = 1;
+  periodic_timer_arm(&mon->sample_timer);
+  while (!mon->thread_stop) {
+    const gpio_reg_t reading = gpio_multi_pin_monitor_read(mon);
+    const gpio_reg_t evicted = mon->sensor_readings[mon->sensor_readings_write_idx];
+    mon->sensor_readings[mon->sensor_readings_write_idx] = reading;
+    mon->sensor_readings_write_idx = (mon->sensor_readings_write_idx + 1) % mon->sensor_readings_sz;
+
+    // Only pins that changed between the evicted sample and the new one change their count
+    atomic_fetch_add_explicit(&mon->window_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sliced_counter_inc(&mon->active_count_in_window, reading & ~evicted);
+    sliced_counter_dec(&mon->active_count_in_window, evicted & ~reading);
+    atomic_fetch_add_explicit(&mon->window_seq, 1, memory_order_release);
+    relaxed_inc(metrics_pipeline()->samples);
+    if (reading != mon->last_reading) {
+      mon->sensor_change_ns = monotonic_now_ns();
+      mon->last_reading = reading;
+      trace_instant("sensor_edge", mon->sensor_change_ns, reading);
+    }
+
+    gpio_reg_t above_rising, eq_rising, above_falling, eq_falling;
+    sliced_counter_cmp(&mon->active_count_in_window, mon->rising_edge_active_threshold_cnt,
+                       &above_rising, &eq_rising);
+    sliced_counter_cmp(&mon->active_count_in_window, mon->falling_edge_inactive_threshold_cnt,
+                       &above_falling, &eq_falling);
+
+    if (mon->gpio_debug && reading != debug_last_reading) {
+      log_pins(LOG_LEVEL_DEBUG, "Pins reporting active", reading);
+      debug_last_reading = reading;
+    }
+
+    const gpio_reg_t below_falling = ~(above_falling | eq_falling) & mon->pin_mask;
+    const gpio_reg_t going_vacant = mon->currently_active & below_falling;
+    const gpio_reg_t going_occupied = ~mon->currently_active & above_rising & mon->pin_mask;
+    if (going_vacant) {
+      log_pins(LOG_LEVEL_INFO, "GPIO reports vacancy for pins", going_vacant);
+      trace_instant("threshold_vacant", monotonic_now_ns(), going_vacant);
+    }
+    if (going_occupied) {
+      log_pins(LOG_LEVEL_INFO, "GPIO reports occupancy for pins", going_occupied);
+      trace_instant("threshold_occupied", monotonic_now_ns(), going_occupied);
+    }
+    mon->currently_active = (mon->currently_active & ~going_vacant) | going_occupied;
+
+    // Active pins reset their vacancy countdown, inactive ones count down to zero and then report
+    // vacancy
+    sliced_counter_set(&mon->vacant_timeout_ticks, mon->currently_active,
+                       mon->vacancy_motion_timeout_ticks);
+    // User activity is presence everywhere: every pin restarts its countdown and reports occupancy
+    gpio_reg_t user_active = 0;
+    if (atomic_exchange(&mon->user_activity, false)) {
+      sliced_counter_set(&mon->vacant_timeout_ticks, mon->pin_mask,
+                         mon->vacancy_motion_timeout_ticks);
+      user_active = mon->pin_mask;
+    }
+    for (uint64_t i = 0; i < elapsed_ticks; ++i) {
+      const gpio_reg_t counting_down = sliced_counter_nonzero(&mon->vacant_timeout_ticks);
+      sliced_counter_dec(&mon->vacant_timeout_ticks, counting_down & ~mon->currently_active);
+    }
+    const gpio_reg_t counting_down = sliced_counter_nonzero(&mon->vacant_timeout_ticks);
+    const gpio_reg_t timed_out = ~counting_down & ~mon->currently_active & mon->active;
+    if (timed_out) {
+      log_pins(LOG_LEVEL_INFO, "Reporting vacancy for pins", timed_out);
+    }
+    const gpio_reg_t was_active = mon->active;
+    mon->active = (mon->active | mon->currently_active | user_active) & ~timed_out;
+    if ((was_active != 0) != (mon->active != 0)) {
+      // Activity is tracked per pin, there's no single % that triggered this transition
+      trace_span("edge_to_decision", mon->sensor_change_ns, monotonic_now_ns(), mon->active);
+      transition_notifier_publish(&mon->transitions, mon->active != 0, 0, mon->sensor_change_ns);
+    }
+
+    elapsed_ticks = periodic_timer_wait(&mon->sample_timer);
+    if (mon->gpio_debug && (mon->sample_timer.stats.ticks % mon->sensor_readings_sz) == 0) {
+      periodic_timer_print_stats(&mon->sample_timer, "GpioMultiPinMonitor");
+    }
+  }
+  return NULL;
+}
+
+struct GpioMultiPinMonitor *gpio_multi_pin_monitor_init(const struct PiPresenceMonConfig *cfg,
+                                                        gpio_reg_t pin_mask) {
+  const bool start_active = true;
+
+  if (cfg->rising_edge_occupancy_threshold_pct < cfg->falling_edge_vacancy_threshold_pct) {
+    fprintf(stderr,
+            "A 'rising edge threshold' smaller than 'falling edge threshold' is not stable\n");
+    return NULL;
+  }
+
+  if (cfg->gpio_chip && !cfg->gpio_use_mock) {
+    fprintf(stderr, "Warning: GPIO edge events only support a single pin, multi-pin monitor will "
+                    "poll /dev/gpiomem instead\n");
+  }
+
+  struct GPIO *gpio = gpio_open(cfg->gpio_use_mock, cfg->gpio_mock_trace, clock_real());
+  if (!gpio) {
+    return NULL;
+  }
+
+  struct GpioMultiPinMonitor *mon = malloc(sizeof(struct GpioMultiPinMonitor));
+  if (!mon) {
+    perror("GpioMultiPinMonitor bad alloc");
+    gpio_close(gpio);
+    return NULL;
+  }
+
+  memset(mon, 0, sizeof(*mon));
+  mon->gpio = gpio;
+  mon->gpio_debug = cfg->gpio_debug;
+  mon->pin_mask = pin_mask;
+  mon->sensor_readings_write_idx = 0;
+  mon->sensor_readings_sz =
+      1000 * cfg->sensor_monitor_window_seconds / cfg->sensor_poll_period_ms;
+  if (mon->sensor_readings_sz == 0) {
+    fprintf(stderr, "GpioMultiPinMonitor window is shorter than the poll period\n");
+    gpio_close(gpio);
+    free(mon);
+    return NULL;
+  }
+
+  // pct = 100 * cnt / sz, with integer division. These are the counts for which
+  // pct > rising_edge_pct, and pct < falling_edge_pct
+  const size_t sz = mon->sensor_readings_sz;
+  mon->rising_edge_active_threshold_cnt =
+      ((cfg->rising_edge_occupancy_threshold_pct + 1) * sz + 99) / 100 - 1;
+  mon->falling_edge_inactive_threshold_cnt =
+      (cfg->falling_edge_vacancy_threshold_pct * sz + 99) / 100;
+
+  mon->active_count_in_window.bits = bits_needed(sz);
+  sliced_counter_set(&mon->active_count_in_window, pin_mask, start_active ? sz : 0);
+  mon->vacancy_motion_timeout_ticks =
+      1000 * cfg->vacancy_motion_timeout_seconds / cfg->sensor_poll_period_ms;
+  mon->vacant_timeout_ticks.bits = bits_needed(mon->vacancy_motion_timeout_ticks);
+  sliced_counter_set(&mon->vacant_timeout_ticks, pin_mask, mon->vacancy_motion_timeout_ticks);
+  mon->currently_active = start_active ? pin_mask : 0;
+  mon->active = start_active ? pin_mask : 0;
+  mon->last_reading = start_active ? pin_mask : 0;
+  glitch_filter_init(&mon->filter, cfg, pin_mask, start_active);
+  mon->rejected_glitches = 0;
+
+  mon->sensor_readings = malloc(sizeof(mon->sensor_readings[0]) * sz);
+  if (!mon->sensor_readings) {
+    perror("GpioMultiPinMonitor bad window alloc");
+    gpio_close(gpio);
+    free(mon);
+    return NULL;
+  }
+  for (size_t i = 0; i < sz; ++i) {
+    mon->sensor_readings[i] = start_active ? pin_mask : 0;
+  }
+
+  if (!periodic_timer_init(&mon->sample_timer, cfg->sensor_poll_period_ms)) {
+    gpio_close(gpio);
+    free(mon->sensor_readings);
+    free(mon);
+    return NULL;
+  }
+  mon->sample_timer.jitter_us = &metrics_pipeline()->sample_jitter_us;
+
+  if (!transition_notifier_init(&mon->transitions)) {
+    periodic_timer_free(&mon->sample_timer);
+    gpio_close(gpio);
+    free(mon->sensor_readings);
+    free(mon);
+    return NULL;
+  }
+
+  mon->thread_stop = false;
+  if (pthread_create(&mon->thread_id, NULL, gpio_multi_pin_monitor_update, mon) != 0) {
+    perror("GpioMultiPinMonitor thread create error");
+    transition_notifier_free(&mon->transitions);
+    periodic_timer_free(&mon->sample_timer);
+    gpio_close(gpio);
+    free(mon->sensor_readings);
+    free(mon);
+    return NULL;
+  }
+
+  log_pins(LOG_LEVEL_INFO, "GpioMultiPinMonitor sampling pins", pin_mask);
+  return mon;
+}
+
+void gpio_multi_pin_monitor_free(struct GpioMultiPinMonitor *mon) {
+  if (!mon) {
+    return;
+  }
+
+  mon->thread_stop = true;
+  if (pthread_join(mon->thread_id, NULL) != 0) {
+    perror("GpioMultiPinMonitor pthread_join fail");
+  }
+
+  periodic_timer_print_stats(&mon->sample_timer, "GpioMultiPinMonitor");
+  printf("GpioMultiPinMonitor rejected %zu glitches\n", (size_t)mon->rejected_glitches);
+  periodic_timer_free(&mon->sample_timer);
+  transition_notifier_free(&mon->transitions);
+  gpio_close(mon->gpio);
+  free(mon->sensor_readings);
+  free(mon);
+}
+
+size_t gpio_multi_pin_monitor_active_pct(struct GpioMultiPinMonitor *mon, size_t pin) {
+  if (pin >= GPIO_PINS) {
+    return 0;
+  }
+
+  unsigned seq;
+  size_t cnt;
+  do {
+    seq = atomic_load_explicit(&mon->window_seq, memory_order_acquire);
+    cnt = sliced_counter_get(&mon->active_count_in_window, pin);
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) || seq != atomic_load_explicit(&mon->window_seq, memory_order_relaxed));
+  return 100 * cnt / mon->sensor_readings_sz;
+}
+
+bool gpio_multi_pin_monitor_pin_active(struct GpioMultiPinMonitor *mon, size_t pin) {
+  return (pin < GPIO_PINS) && (mon->active & ((gpio_reg_t)1 << pin));
+}
+
+gpio_reg_t gpio_multi_pin_monitor_active_pins(struct GpioMultiPinMonitor *mon) {
+  return mon->active;
+}
+
+void gpio_multi_pin_monitor_on_user_activity(struct GpioMultiPinMonitor *mon) {
+  mon->user_activity = true;
+}
+
+size_t gpio_multi_pin_monitor_rejected_glitches(struct GpioMultiPinMonitor *mon) {
+  return mon->rejected_glitches;
+}
+
+int gpio_multi_pin_monitor_transition_fd(struct GpioMultiPinMonitor *mon) {
+  return transition_notifier_fd(&mon->transitions);
+}
+
+bool gpio_multi_pin_monitor_read_transition(struct GpioMultiPinMonitor *mon,
+                                            struct OccupancyTransition *transition) {
+  return transition_notifier_consume(&mon->transitions, transition);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "gpio.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Same as GpioPinActiveMonitor, but for a set of pins: a single thread samples the whole input
+// register once per tick, and keeps per-pin counters for all pins at the same cost as one.
+struct GpioMultiPinMonitor;
+struct OccupancyTransition;
+struct PiPresenceMonConfig;
+
+struct GpioMultiPinMonitor *gpio_multi_pin_monitor_init(const struct PiPresenceMonConfig *cfg,
+                                                        gpio_reg_t pin_mask);
+void gpio_multi_pin_monitor_free(struct GpioMultiPinMonitor *mon);
+
+size_t gpio_multi_pin_monitor_active_pct(struct GpioMultiPinMonitor *mon, size_t pin);
+bool gpio_multi_pin_monitor_pin_active(struct GpioMultiPinMonitor *mon, size_t pin);
+// Mask of all monitored pins currently reporting occupancy
+gpio_reg_t gpio_multi_pin_monitor_active_pins(struct GpioMultiPinMonitor *mon);
+// Raw sensor excursions discarded by the glitch filter, over all pins (see sensor_filter)
+size_t gpio_multi_pin_monitor_rejected_glitches(struct GpioMultiPinMonitor *mon);
+// Someone is using the device: all pins report occupancy and restart their vacancy timeout, from
+// the next sample on. Thread safe.
+void gpio_multi_pin_monitor_on_user_activity(struct GpioMultiPinMonitor *mon);
+
+// fd that becomes readable when gpio_multi_pin_monitor_active_pins() changes between no pins
+// active and any pin active
+int gpio_multi_pin_monitor_transition_fd(struct GpioMultiPinMonitor *mon);
+// Consume pending transitions (never blocks). Returns true, and the latest one, if there was any.
+bool gpio_multi_pin_monitor_read_transition(struct GpioMultiPinMonitor *mon,
+                                            struct OccupancyTransition *transition);
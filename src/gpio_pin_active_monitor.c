@@ -1,27 +1,51 @@
 #include "gpio_pin_active_monitor.h"
 #include "cfg.h"
+#include "clock.h"
 #include "gpio.h"
+#include "logger.h"
+#include "metrics.h"
+#include "occupancy_detector.h"
+#include "periodic_timer.h"
+#include "sensor_pipeline.h"
+#include "trace.h"
+#include "transition_notifier.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 struct GpioPinActiveMonitor {
   struct GPIO *gpio;
+  const struct Clock *clock;
   bool gpio_debug;
   size_t sensor_pin;
 
-  size_t sensor_readings_write_idx;
-  size_t sensor_readings_sz;
-  atomic_size_t active_count_in_window;
-  bool *sensor_readings;
+  // Filter, window and detector: decides currently_active from the samples. Only updated by the
+  // sampler thread.
+  struct SensorPipeline pipeline;
 
   pthread_t thread_id;
   atomic_bool thread_stop;
-  size_t poll_period_secs;
+  // Wakes up the sampler thread while it's blocked waiting for the next sample
+  int wake_fd;
+  // Time of the latest user activity (see gpio_active_monitor_on_user_activity), and the latest one
+  // applied by the sampler thread
+  atomic_uint_least64_t user_activity_ns;
+  uint64_t seen_user_activity_ns;
+  struct PeriodicTimer sample_timer;
+  // Set if a rising edge was seen since the last sample, so pulses shorter than a poll period
+  // aren't missed
+  bool rising_edge_latched;
+  // Last time the filtered pin state changed, reported with transitions
+  uint64_t sensor_change_ns;
+  atomic_size_t rejected_glitches;
 
   size_t rising_edge_active_threshold_pct;
   size_t falling_edge_inactive_threshold_pct;
@@ -30,75 +54,227 @@ struct GpioPinActiveMonitor {
   // Follows currently_active, but has a delay of $vacancy_motion_timeout_seconds before
   // transitioning from active->inactive
   size_t vacancy_motion_timeout_seconds;
-  size_t vacant_timeout_secs;
+  struct VacancyTimeout vacancy_timeout;
   atomic_bool active;
+  // Notifies changes of `active`
+  struct TransitionNotifier transitions;
 
   size_t debug_last_active_pct;
   bool debug_last_active;
   bool debug_throttle;
 };
 
-static void *gpio_active_monitor_update(void *usr) {
-  struct GpioPinActiveMonitor *mon = usr;
-  while (!mon->thread_stop) {
-    bool pin_state = gpio_get_pin(mon->gpio, mon->sensor_pin);
-    mon->active_count_in_window -= mon->sensor_readings[mon->sensor_readings_write_idx];
-    mon->sensor_readings[mon->sensor_readings_write_idx] = pin_state;
-    mon->active_count_in_window += mon->sensor_readings[mon->sensor_readings_write_idx];
-    mon->sensor_readings_write_idx = (mon->sensor_readings_write_idx + 1) % mon->sensor_readings_sz;
+static void gpio_active_monitor_on_edges(struct GpioPinActiveMonitor *mon) {
+  bool rising = false;
+  uint64_t last_edge_ns = 0;
+  const int edges = gpio_read_edges(mon->gpio, &rising, &last_edge_ns);
+  if (edges <= 0) {
+    return;
+  }
+
+  // A pulse too short for a poll to see only counts without a glitch filter: with one, it's what
+  // the filter is there to reject, so the filter only gets the sampled level
+  mon->rising_edge_latched |= rising && mon->pipeline.filter.kind == GLITCH_FILTER_NONE;
+  if (mon->gpio_debug) {
+    logger_log(LOG_LEVEL_DEBUG, "Pin %zu reports %d edge(s), last one %llu usecs ago",
+               mon->sensor_pin, edges,
+               (unsigned long long)(monotonic_now_ns() - last_edge_ns) / 1000);
+  }
+
+  if (!mon->sample_timer.armed) {
+    periodic_timer_arm(&mon->sample_timer);
+  }
+}
 
+// Block until the next sample is due, returns true if it is. If the GPIO backend can deliver edge
+// events, an edge is latched and restarts the sampling timer if it was stopped, but samples are
+// still only taken on timer ticks: the window must hold one sample per poll period to cover
+// sensor_monitor_window_seconds. An edge or a wake up (to stop, or for user activity) returns
+// false.
+static bool gpio_active_monitor_wait(struct GpioPinActiveMonitor *mon, bool pin_state) {
+  const int line_fd = gpio_get_event_fd(mon->gpio);
+
+  // With edge events, once the window is saturated and the state has settled nothing can change
+  // until the line moves: stop the sampling timer until there is an edge
+  const struct SensorPipeline *p = &mon->pipeline;
+  const bool filter_settled = glitch_filter_settled(&p->filter);
+  const bool settled_vacant = filter_settled && !pin_state && p->active_count == 0 &&
+                              !p->detector.score_changed && !mon->currently_active &&
+                              !mon->active;
+  const bool settled_occupied = filter_settled && pin_state && p->active_count == p->window_sz &&
+                                !p->detector.score_changed && mon->currently_active &&
+                                mon->active;
+  if (line_fd >= 0 && (settled_vacant || settled_occupied) && mon->sample_timer.armed) {
+    periodic_timer_disarm(&mon->sample_timer);
+  }
+
+  struct pollfd fds[] = {
+      {.fd = periodic_timer_fd(&mon->sample_timer), .events = POLLIN},
+      // poll() ignores negative fds, so this is a no-op for backends without edge events
+      {.fd = line_fd, .events = POLLIN},
+      {.fd = mon->wake_fd, .events = POLLIN},
+  };
+  if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+    if (errno == EINTR) {
+      return false;
+    }
+    logger_log(LOG_LEVEL_ERROR, "GpioPinActiveMonitor can't wait for next sample: %s",
+               strerror(errno));
+    // Avoid spinning if poll keeps failing
+    if (!mon->sample_timer.armed) {
+      periodic_timer_arm(&mon->sample_timer);
+    }
+    periodic_timer_wait(&mon->sample_timer);
+    return true;
+  }
+
+  bool sample_due = false;
+  if (fds[0].revents & POLLIN) {
+    periodic_timer_wait(&mon->sample_timer);
+    if (mon->gpio_debug && (mon->sample_timer.stats.ticks % mon->pipeline.window_sz) == 0) {
+      periodic_timer_print_stats(&mon->sample_timer, "GpioPinActiveMonitor");
+    }
+    sample_due = true;
+  }
+
+  if (fds[1].revents & POLLIN) {
+    gpio_active_monitor_on_edges(mon);
+  }
+
+  if (fds[2].revents & POLLIN) {
+    uint64_t wakes;
+    if (read(mon->wake_fd, &wakes, sizeof(wakes)) != sizeof(wakes)) {
+      logger_log(LOG_LEVEL_ERROR, "GpioPinActiveMonitor can't read wake up eventfd: %s",
+                 strerror(errno));
+    }
+    // The vacancy timeout needs ticks to expire, even if the line is quiet
+    if (!mon->sample_timer.armed) {
+      periodic_timer_arm(&mon->sample_timer);
+    }
+  }
+
+  return sample_due;
+}
+
+// Take a sample and run it through the sensor pipeline, returns the (filtered) pin state.
+// Specialized for each detector: kind is a constant in every caller, so the detector update is
+// inlined without a dispatch per sample.
+static inline __attribute__((always_inline)) bool
+gpio_active_monitor_sample(struct GpioPinActiveMonitor *mon,
+                           const enum OccupancyDetectorKind kind) {
+  const bool raw = gpio_get_pin(mon->gpio, mon->sensor_pin) || mon->rising_edge_latched;
+  mon->rising_edge_latched = false;
+  const gpio_reg_t pin_bit = (gpio_reg_t)1 << mon->sensor_pin;
+  const bool prev_pin_state = mon->pipeline.filter.output != 0;
+  const struct SensorPipelineSample s =
+      sensor_pipeline_update(&mon->pipeline, kind, raw ? pin_bit : 0, clock_now_ns(mon->clock));
+  const bool pin_state = s.state;
+  const size_t window_pct = s.window_pct;
+  relaxed_inc(metrics_pipeline()->samples);
+  if (pin_state != prev_pin_state) {
+    mon->sensor_change_ns = monotonic_now_ns();
+    trace_instant("sensor_edge", mon->sensor_change_ns, pin_state);
+  }
+  if (glitch_filter_rejected(&mon->pipeline.filter) != mon->rejected_glitches) {
+    mon->rejected_glitches = glitch_filter_rejected(&mon->pipeline.filter);
     if (mon->gpio_debug) {
-      const size_t active_pct = gpio_active_monitor_active_pct(mon);
-      if (active_pct != mon->debug_last_active_pct || pin_state != mon->debug_last_active) {
-        printf("Pin %zu reports %s, active_pct=%zu\n", mon->sensor_pin,
-               pin_state ? "active" : "inactive", active_pct);
-        mon->debug_last_active_pct = active_pct;
-        mon->debug_last_active = pin_state;
-      } else {
-        if (!mon->debug_throttle) {
-          printf("Pin %zu, will stop debug-logging until it changes state\n", mon->sensor_pin);
-          mon->debug_throttle = true;
-        }
+      logger_log(LOG_LEVEL_DEBUG, "Pin %zu glitch rejected (%zu so far)", mon->sensor_pin,
+                 (size_t)mon->rejected_glitches);
+    }
+  }
+
+  if (mon->gpio_debug) {
+    if (window_pct != mon->debug_last_active_pct || pin_state != mon->debug_last_active) {
+      logger_log(LOG_LEVEL_DEBUG, "Pin %zu reports %s, active_pct=%zu", mon->sensor_pin,
+                 pin_state ? "active" : "inactive", window_pct);
+      mon->debug_last_active_pct = window_pct;
+      mon->debug_last_active = pin_state;
+    } else {
+      if (!mon->debug_throttle) {
+        logger_log(LOG_LEVEL_DEBUG, "Pin %zu, will stop debug-logging until it changes state",
+                   mon->sensor_pin);
+        mon->debug_throttle = true;
       }
     }
+  }
+
+  if (mon->currently_active && !s.detected) {
+    logger_log(LOG_LEVEL_INFO,
+               "GPIO reports vacancy: %zu%% activity (smaller than threshold for vacancy = %zu%%)",
+               occupancy_detector_score_pct(&mon->pipeline.detector, window_pct),
+               mon->falling_edge_inactive_threshold_pct);
+    trace_instant("threshold_vacant", monotonic_now_ns(), window_pct);
+    logger_log(LOG_LEVEL_INFO, "Waiting %zu seconds before reporting vacancy",
+               mon->vacancy_motion_timeout_seconds);
+    mon->currently_active = false;
 
-    if (mon->currently_active &&
-        (gpio_active_monitor_active_pct(mon) < mon->falling_edge_inactive_threshold_pct)) {
-      printf("GPIO reports vacancy: %zu%% activity (smaller than threshold for vacancy = %zu%%)\n",
-             gpio_active_monitor_active_pct(mon), mon->falling_edge_inactive_threshold_pct);
-      printf("Waiting %zu seconds before reporting vacancy\n", mon->vacant_timeout_secs);
-      mon->currently_active = false;
-
-    } else if (!mon->currently_active &&
-               (gpio_active_monitor_active_pct(mon) > mon->rising_edge_active_threshold_pct)) {
-      printf("GPIO reports ocupancy: %zu%% activity (bigger than threshold for ocupancy = %zu%%)\n",
-             gpio_active_monitor_active_pct(mon), mon->rising_edge_active_threshold_pct);
-      mon->currently_active = true;
+  } else if (!mon->currently_active && s.detected) {
+    logger_log(LOG_LEVEL_INFO,
+               "GPIO reports ocupancy: %zu%% activity (bigger than threshold for ocupancy = %zu%%)",
+               occupancy_detector_score_pct(&mon->pipeline.detector, window_pct),
+               mon->rising_edge_active_threshold_pct);
+    trace_instant("threshold_occupied", monotonic_now_ns(), window_pct);
+    mon->currently_active = true;
+  }
+  return pin_state;
+}
+
+static inline __attribute__((always_inline)) void
+gpio_active_monitor_run(struct GpioPinActiveMonitor *mon, const enum OccupancyDetectorKind kind) {
+  bool pin_state = false;
+  bool sample_due = true;
+  periodic_timer_arm(&mon->sample_timer);
+  while (!mon->thread_stop) {
+    if (sample_due) {
+      pin_state = gpio_active_monitor_sample(mon, kind);
     }
 
-    if (mon->currently_active) {
-      mon->vacant_timeout_secs = mon->vacancy_motion_timeout_seconds;
-      mon->active = true;
-    } else {
-      if (mon->vacant_timeout_secs > 0) {
-        mon->vacant_timeout_secs -= 1;
-      } else {
-        if (mon->active) {
-          printf("Reporting vacancy\n");
-          mon->active = false;
-        }
+    // User activity counts as detection at the time it happened
+    const uint64_t user_activity_ns = mon->user_activity_ns;
+    if (user_activity_ns != mon->seen_user_activity_ns) {
+      mon->seen_user_activity_ns = user_activity_ns;
+      vacancy_timeout_update(&mon->vacancy_timeout, true, user_activity_ns);
+    }
+
+    const bool reported =
+        vacancy_timeout_update(&mon->vacancy_timeout, mon->currently_active,
+                               clock_now_ns(mon->clock));
+    if (reported != mon->active) {
+      if (!reported) {
+        logger_log(LOG_LEVEL_INFO, "Reporting vacancy");
       }
+      mon->active = reported;
+      trace_span("edge_to_decision", mon->sensor_change_ns, monotonic_now_ns(), reported);
+      transition_notifier_publish(&mon->transitions, reported,
+                                  gpio_active_monitor_active_pct(mon), mon->sensor_change_ns);
     }
 
-    sleep(mon->poll_period_secs);
+    sample_due = gpio_active_monitor_wait(mon, pin_state);
+  }
+}
+
+static void *gpio_active_monitor_update(void *usr) {
+  struct GpioPinActiveMonitor *mon = usr;
+  trace_thread_name("GpioPinActiveMonitor");
+  switch (mon->pipeline.detector.kind) {
+  case DETECTOR_WINDOW:
+    gpio_active_monitor_run(mon, DETECTOR_WINDOW);
+    break;
+  case DETECTOR_EWMA:
+    gpio_active_monitor_run(mon, DETECTOR_EWMA);
+    break;
+  case DETECTOR_HMM:
+    gpio_active_monitor_run(mon, DETECTOR_HMM);
+    break;
   }
   return NULL;
 }
 
-struct GpioPinActiveMonitor *gpio_active_monitor_init(const struct PiPresenceMonConfig *cfg) {
+struct GpioPinActiveMonitor *gpio_active_monitor_init(const struct PiPresenceMonConfig *cfg,
+                                                      const struct Clock *clock) {
   const bool start_active = true;
 
-  if (cfg->sensor_pin > GPIO_PINS) {
+  if (cfg->sensor_pin >= GPIO_PINS) {
     fprintf(stderr, "Invalid pin number %zu (max %zu)\n", cfg->sensor_pin, GPIO_PINS);
     return NULL;
   }
@@ -109,7 +285,10 @@ struct GpioPinActiveMonitor *gpio_active_monitor_init(const struct PiPresenceMon
     return NULL;
   }
 
-  struct GPIO *gpio = gpio_open(cfg->gpio_use_mock);
+  struct GPIO *gpio = (cfg->gpio_chip && !cfg->gpio_use_mock)
+                          ? gpio_open_line_events(cfg->gpio_chip, cfg->sensor_pin,
+                                                  cfg->gpio_line_debounce_us)
+                          : gpio_open(cfg->gpio_use_mock, cfg->gpio_mock_trace, clock);
   if (!gpio) {
     return NULL;
   }
@@ -117,18 +296,17 @@ struct GpioPinActiveMonitor *gpio_active_monitor_init(const struct PiPresenceMon
   struct GpioPinActiveMonitor *mon = malloc(sizeof(struct GpioPinActiveMonitor));
   if (!mon) {
     perror("GpioPinActiveMonitor bad alloc");
+    gpio_close(gpio);
     return NULL;
   }
 
   mon->gpio = gpio;
+  mon->clock = clock;
   mon->gpio_debug = cfg->gpio_debug;
   mon->sensor_pin = cfg->sensor_pin;
-  mon->sensor_readings_write_idx = 0;
-  mon->sensor_readings_sz = cfg->sensor_monitor_window_seconds / cfg->sensor_poll_period_secs;
-  mon->active_count_in_window = start_active ? mon->sensor_readings_sz : 0;
-
   mon->vacancy_motion_timeout_seconds = cfg->vacancy_motion_timeout_seconds;
-  mon->vacant_timeout_secs = cfg->vacancy_motion_timeout_seconds;
+  vacancy_timeout_init(&mon->vacancy_timeout, 1000000000ull * cfg->vacancy_motion_timeout_seconds,
+                       clock_now_ns(clock), start_active);
   mon->currently_active = start_active;
   mon->active = start_active;
 
@@ -137,22 +315,55 @@ struct GpioPinActiveMonitor *gpio_active_monitor_init(const struct PiPresenceMon
   mon->debug_last_active = 0;
   mon->debug_throttle = false;
 
-  mon->sensor_readings = malloc(sizeof(mon->sensor_readings[0]) * mon->sensor_readings_sz);
-  if (!mon->sensor_readings) {
-    perror("GpioPinActiveMonitor bad window alloc");
+  if (!sensor_pipeline_init(&mon->pipeline, cfg, (gpio_reg_t)1 << cfg->sensor_pin,
+                            start_active)) {
+    gpio_close(gpio);
     free(mon);
     return NULL;
   }
-  memset(mon->sensor_readings, start_active, mon->sensor_readings_sz);
 
   mon->rising_edge_active_threshold_pct = cfg->rising_edge_occupancy_threshold_pct;
   mon->falling_edge_inactive_threshold_pct = cfg->falling_edge_vacancy_threshold_pct;
 
-  mon->poll_period_secs = cfg->sensor_poll_period_secs;
+  mon->rising_edge_latched = false;
+  mon->user_activity_ns = 0;
+  mon->seen_user_activity_ns = 0;
+  mon->rejected_glitches = 0;
   mon->thread_stop = false;
+  mon->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (mon->wake_fd < 0) {
+    perror("GpioPinActiveMonitor can't create wake up eventfd");
+    gpio_close(gpio);
+    sensor_pipeline_free(&mon->pipeline);
+    free(mon);
+    return NULL;
+  }
+
+  if (!periodic_timer_init(&mon->sample_timer, cfg->sensor_poll_period_ms)) {
+    close(mon->wake_fd);
+    gpio_close(gpio);
+    sensor_pipeline_free(&mon->pipeline);
+    free(mon);
+    return NULL;
+  }
+  mon->sample_timer.jitter_us = &metrics_pipeline()->sample_jitter_us;
+
+  if (!transition_notifier_init(&mon->transitions)) {
+    periodic_timer_free(&mon->sample_timer);
+    close(mon->wake_fd);
+    gpio_close(gpio);
+    sensor_pipeline_free(&mon->pipeline);
+    free(mon);
+    return NULL;
+  }
+
   if (pthread_create(&mon->thread_id, NULL, gpio_active_monitor_update, mon) != 0) {
     perror("GpioPinActiveMonitor thread create error");
-    free(mon->sensor_readings);
+    transition_notifier_free(&mon->transitions);
+    periodic_timer_free(&mon->sample_timer);
+    close(mon->wake_fd);
+    gpio_close(gpio);
+    sensor_pipeline_free(&mon->pipeline);
     free(mon);
     return NULL;
   }
@@ -166,19 +377,54 @@ void gpio_active_monitor_free(struct GpioPinActiveMonitor *mon) {
   }
 
   mon->thread_stop = true;
+  const uint64_t wake = 1;
+  if (write(mon->wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+    perror("GpioPinActiveMonitor can't wake up sampler thread");
+  }
+
   if (pthread_join(mon->thread_id, NULL) != 0) {
     perror("GpioPinActiveMonitor pthread_join fail");
   }
 
+  periodic_timer_print_stats(&mon->sample_timer, "GpioPinActiveMonitor");
+  printf("GpioPinActiveMonitor rejected %zu glitches\n", (size_t)mon->rejected_glitches);
+  periodic_timer_free(&mon->sample_timer);
+  transition_notifier_free(&mon->transitions);
+  close(mon->wake_fd);
   gpio_close(mon->gpio);
-  free(mon->sensor_readings);
+  sensor_pipeline_free(&mon->pipeline);
   free(mon);
 }
 
 size_t gpio_active_monitor_active_pct(struct GpioPinActiveMonitor *mon) {
-  return 100 * mon->active_count_in_window / mon->sensor_readings_sz;
+  return sensor_pipeline_active_pct(&mon->pipeline);
 }
 
 bool gpio_active_monitor_pin_active(struct GpioPinActiveMonitor *mon) {
   return mon->active ? true : false;
 }
+
+size_t gpio_active_monitor_active_pct_last(struct GpioPinActiveMonitor *mon, size_t n) {
+  return sensor_pipeline_active_pct_last(&mon->pipeline, n);
+}
+
+void gpio_active_monitor_on_user_activity(struct GpioPinActiveMonitor *mon, uint64_t now_ns) {
+  mon->user_activity_ns = now_ns;
+  const uint64_t wake = 1;
+  if (write(mon->wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+    perror("GpioPinActiveMonitor can't wake up sampler thread");
+  }
+}
+
+size_t gpio_active_monitor_rejected_glitches(struct GpioPinActiveMonitor *mon) {
+  return mon->rejected_glitches;
+}
+
+int gpio_active_monitor_transition_fd(struct GpioPinActiveMonitor *mon) {
+  return transition_notifier_fd(&mon->transitions);
+}
+
+bool gpio_active_monitor_read_transition(struct GpioPinActiveMonitor *mon,
+                                         struct OccupancyTransition *transition) {
+  return transition_notifier_consume(&mon->transitions, transition);
+}
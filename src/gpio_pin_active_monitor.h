@@ -2,12 +2,30 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+struct Clock;
 struct GpioPinActiveMonitor;
+struct OccupancyTransition;
 struct PiPresenceMonConfig;
 
-struct GpioPinActiveMonitor *gpio_active_monitor_init(const struct PiPresenceMonConfig *cfg);
+// Sampling is paced by a real timer; clock is used for the vacancy timeout
+struct GpioPinActiveMonitor *gpio_active_monitor_init(const struct PiPresenceMonConfig *cfg,
+                                                      const struct Clock *clock);
 void gpio_active_monitor_free(struct GpioPinActiveMonitor *mon);
 
 size_t gpio_active_monitor_active_pct(struct GpioPinActiveMonitor *mon);
+// Active % over the last n samples only (clamped to the window size)
+size_t gpio_active_monitor_active_pct_last(struct GpioPinActiveMonitor *mon, size_t n);
 bool gpio_active_monitor_pin_active(struct GpioPinActiveMonitor *mon);
+// Raw sensor excursions discarded by the glitch filter (see sensor_filter)
+size_t gpio_active_monitor_rejected_glitches(struct GpioPinActiveMonitor *mon);
+// Someone is using the device (eg input events), at now_ns of the monitor clock: restart the
+// vacancy timeout from then, and report occupancy if it was vacant. Thread safe.
+void gpio_active_monitor_on_user_activity(struct GpioPinActiveMonitor *mon, uint64_t now_ns);
+
+// fd that becomes readable when gpio_active_monitor_pin_active() changes
+int gpio_active_monitor_transition_fd(struct GpioPinActiveMonitor *mon);
+// Consume pending transitions (never blocks). Returns true, and the latest one, if there was any.
+bool gpio_active_monitor_read_transition(struct GpioPinActiveMonitor *mon,
+                                         struct OccupancyTransition *transition);
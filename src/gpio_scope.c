@@ -0,0 +1,277 @@
+#include "gpio_scope.h"
+#include "cfg.h"
+#include "clock.h"
+#include "gpio.h"
+#include "logger.h"
+#include "periodic_timer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Longest record: two 64 bit varints
+#define GPIO_SCOPE_MAX_RECORD_SZ 20
+
+struct GpioScope {
+  struct GPIO *gpio;
+
+  pthread_t thread_id;
+  atomic_bool thread_stop;
+  int stop_fd;
+  struct PeriodicTimer sample_timer;
+
+  // The sampler thread only takes the lock when the register changes
+  pthread_mutex_t lock;
+  uint8_t *ring;
+  size_t ring_sz;
+  // Next byte to write, and bytes in use; the oldest record starts at head - used
+  size_t head;
+  size_t used;
+  // State right before the oldest record in the ring
+  uint64_t base_us;
+  gpio_reg_t base_reg;
+  size_t records;
+  size_t dropped_records;
+
+  // Sampler thread only: last change seen
+  uint64_t last_us;
+  gpio_reg_t last_reg;
+};
+
+static size_t varint_encode(uint64_t v, uint8_t *out) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+// Decode a varint starting at ring offset *pos, wrapping around the end of the ring
+static size_t ring_varint_decode(const struct GpioScope *scope, size_t *pos, uint64_t *v) {
+  size_t n = 0;
+  *v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    const uint8_t b = scope->ring[*pos];
+    *pos = (*pos + 1) % scope->ring_sz;
+    n++;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  return n;
+}
+
+// Drop the oldest record, folding it into the base state
+static void ring_drop_oldest(struct GpioScope *scope) {
+  size_t pos = (scope->head + scope->ring_sz - scope->used) % scope->ring_sz;
+  uint64_t delta_us, reg;
+  size_t sz = ring_varint_decode(scope, &pos, &delta_us);
+  sz += ring_varint_decode(scope, &pos, &reg);
+  scope->base_us += delta_us;
+  scope->base_reg = (gpio_reg_t)reg;
+  scope->used -= sz;
+  scope->dropped_records++;
+}
+
+static void gpio_scope_record(struct GpioScope *scope, uint64_t now_us, gpio_reg_t reg) {
+  uint8_t rec[GPIO_SCOPE_MAX_RECORD_SZ];
+  size_t sz = varint_encode(now_us - scope->last_us, rec);
+  sz += varint_encode(reg, rec + sz);
+  scope->last_us = now_us;
+  scope->last_reg = reg;
+
+  pthread_mutex_lock(&scope->lock);
+  while (scope->ring_sz - scope->used < sz) {
+    ring_drop_oldest(scope);
+  }
+  for (size_t i = 0; i < sz; ++i) {
+    scope->ring[scope->head] = rec[i];
+    scope->head = (scope->head + 1) % scope->ring_sz;
+  }
+  scope->used += sz;
+  scope->records++;
+  pthread_mutex_unlock(&scope->lock);
+}
+
+static void *gpio_scope_capture(void *usr) {
+  struct GpioScope *scope = usr;
+  periodic_timer_arm(&scope->sample_timer);
+  while (!scope->thread_stop) {
+    const gpio_reg_t reg = gpio_get_inputs(scope->gpio);
+    if (reg != scope->last_reg) {
+      gpio_scope_record(scope, monotonic_now_ns() / 1000, reg);
+    }
+
+    struct pollfd fds[] = {
+        {.fd = periodic_timer_fd(&scope->sample_timer), .events = POLLIN},
+        {.fd = scope->stop_fd, .events = POLLIN},
+    };
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      logger_log(LOG_LEVEL_ERROR, "GpioScope can't wait for next sample: %s", strerror(errno));
+      return NULL;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      periodic_timer_wait(&scope->sample_timer);
+    }
+  }
+  return NULL;
+}
+
+struct GpioScope *gpio_scope_init(const struct PiPresenceMonConfig *cfg) {
+  struct GpioScope *scope = malloc(sizeof(struct GpioScope));
+  if (!scope) {
+    perror("GpioScope bad alloc");
+    return NULL;
+  }
+
+  memset(scope, 0, sizeof(*scope));
+  scope->stop_fd = -1;
+  scope->ring_sz = 1024 * cfg->gpio_scope_ring_kb;
+  scope->ring = malloc(scope->ring_sz);
+  scope->gpio = gpio_open(cfg->gpio_use_mock, cfg->gpio_mock_trace, clock_real());
+  if (!scope->ring || !scope->gpio) {
+    fprintf(stderr, "GpioScope can't start capture\n");
+    goto ERR;
+  }
+
+  scope->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (scope->stop_fd < 0) {
+    perror("GpioScope can't create stop eventfd");
+    goto ERR;
+  }
+
+  if (!periodic_timer_init_ns(&scope->sample_timer, 1000ull * cfg->gpio_scope_period_us)) {
+    goto ERR;
+  }
+
+  scope->last_us = monotonic_now_ns() / 1000;
+  scope->last_reg = gpio_get_inputs(scope->gpio);
+  scope->base_us = scope->last_us;
+  scope->base_reg = scope->last_reg;
+  pthread_mutex_init(&scope->lock, NULL);
+
+  if (pthread_create(&scope->thread_id, NULL, gpio_scope_capture, scope) != 0) {
+    perror("GpioScope thread create error");
+    pthread_mutex_destroy(&scope->lock);
+    periodic_timer_free(&scope->sample_timer);
+    goto ERR;
+  }
+
+  printf("GpioScope capturing register changes every %zu usecs, %zu KB ring\n",
+         cfg->gpio_scope_period_us, cfg->gpio_scope_ring_kb);
+  return scope;
+
+ERR:
+  if (scope->stop_fd >= 0) {
+    close(scope->stop_fd);
+  }
+  gpio_close(scope->gpio);
+  free(scope->ring);
+  free(scope);
+  return NULL;
+}
+
+void gpio_scope_free(struct GpioScope *scope) {
+  if (!scope) {
+    return;
+  }
+
+  scope->thread_stop = true;
+  const uint64_t wake = 1;
+  if (write(scope->stop_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+    perror("GpioScope can't wake up capture thread");
+  }
+
+  if (pthread_join(scope->thread_id, NULL) != 0) {
+    perror("GpioScope pthread_join fail");
+  }
+
+  periodic_timer_print_stats(&scope->sample_timer, "GpioScope");
+  periodic_timer_free(&scope->sample_timer);
+  pthread_mutex_destroy(&scope->lock);
+  close(scope->stop_fd);
+  gpio_close(scope->gpio);
+  free(scope->ring);
+  free(scope);
+}
+
+static bool write_all(int fd, const void *buf, size_t sz) {
+  const uint8_t *p = buf;
+  while (sz > 0) {
+    const ssize_t wr = write(fd, p, sz);
+    if (wr < 0 && errno == EINTR) {
+      continue;
+    } else if (wr < 0) {
+      return false;
+    }
+    p += wr;
+    sz -= wr;
+  }
+  return true;
+}
+
+bool gpio_scope_dump(struct GpioScope *scope, const char *path) {
+  struct GpioScopeDumpHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = GPIO_SCOPE_MAGIC;
+  hdr.period_us = scope->sample_timer.period_ns / 1000;
+
+  // Copy out under the lock, write the file without it
+  uint8_t *data = malloc(scope->ring_sz);
+  if (!data) {
+    perror("GpioScope dump bad alloc");
+    return false;
+  }
+
+  pthread_mutex_lock(&scope->lock);
+  hdr.base_us = scope->base_us;
+  hdr.base_reg = scope->base_reg;
+  hdr.data_sz = scope->used;
+  hdr.records = scope->records;
+  hdr.dropped_records = scope->dropped_records;
+  const size_t tail = (scope->head + scope->ring_sz - scope->used) % scope->ring_sz;
+  for (size_t i = 0; i < scope->used; ++i) {
+    data[i] = scope->ring[(tail + i) % scope->ring_sz];
+  }
+  pthread_mutex_unlock(&scope->lock);
+
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  const int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "GpioScope can't create dump %s\n", tmp_path);
+    perror("GpioScope dump fail");
+    free(data);
+    return false;
+  }
+
+  const bool ok = write_all(fd, &hdr, sizeof(hdr)) && write_all(fd, data, hdr.data_sz);
+  free(data);
+  if (close(fd) != 0 || !ok) {
+    perror("GpioScope can't write dump");
+    unlink(tmp_path);
+    return false;
+  }
+
+  if (rename(tmp_path, path) != 0) {
+    perror("GpioScope can't move dump in place");
+    unlink(tmp_path);
+    return false;
+  }
+
+  printf("GpioScope dumped %llu bytes (%llu changes, %llu dropped) to %s\n",
+         (unsigned long long)hdr.data_sz, (unsigned long long)(hdr.records - hdr.dropped_records),
+         (unsigned long long)hdr.dropped_records, path);
+  return true;
+}
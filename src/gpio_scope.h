@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Diagnostic capture of the GPIO input register. A thread samples the register at a high rate
+// (kHz) and keeps only the changes, as compact records in a fixed-size ring: the oldest changes
+// are dropped when it's full. The ring is written to a file on demand.
+struct GpioScope;
+struct PiPresenceMonConfig;
+
+// Returns NULL on error. Capture starts immediately.
+struct GpioScope *gpio_scope_init(const struct PiPresenceMonConfig *cfg);
+void gpio_scope_free(struct GpioScope *scope);
+
+// Write the current contents of the ring to path (through a temp file and a rename, so readers
+// never see a partial dump). Safe to call while capturing.
+bool gpio_scope_dump(struct GpioScope *scope, const char *path);
+
+// Dump file: a GpioScopeDumpHeader, then data_sz bytes of records. A record is a register change:
+// a LEB128 varint with the microseconds since the previous change (since base_us for the first
+// record), then a LEB128 varint with the new register value. Host endianness.
+#define GPIO_SCOPE_MAGIC 0x45504f4353505050ull
+struct GpioScopeDumpHeader {
+  uint64_t magic;
+  // CLOCK_MONOTONIC time and value of the register just before the first record
+  uint64_t base_us;
+  uint32_t base_reg;
+  uint32_t period_us;
+  uint64_t data_sz;
+  // Records captured, and dropped to make space for newer ones
+  uint64_t records;
+  uint64_t dropped_records;
+};
+
+// Decode a varint from buf[*pos..sz). Returns false if the buffer ends before the varint does.
+static inline bool gpio_scope_varint_decode(const uint8_t *buf, size_t sz, size_t *pos,
+                                            uint64_t *v) {
+  *v = 0;
+  for (unsigned shift = 0; *pos < sz && shift < 64; shift += 7) {
+    const uint8_t b = buf[(*pos)++];
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
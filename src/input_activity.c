@@ -0,0 +1,162 @@
+#include "input_activity.h"
+#include "clock.h"
+#include "event_loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define INPUT_ACTIVITY_MAX_DEVICES 8
+// Events read per syscall
+#define INPUT_ACTIVITY_BATCH 64
+
+struct InputDevice {
+  struct InputActivity *owner;
+  int fd;
+  struct EventLoopFd *handle;
+  char name[64];
+  const char *path;
+};
+
+struct InputActivity {
+  struct EventLoop *loop;
+  input_activity_cb_t cb;
+  void *usr;
+  size_t devices_sz;
+  struct InputDevice devices[INPUT_ACTIVITY_MAX_DEVICES];
+  uint64_t last_report_ns;
+  size_t events;
+};
+
+// Sync and misc (eg scan codes) events come along with real ones, they don't add information
+static bool is_user_activity(const struct input_event *ev) {
+  return ev->type == EV_KEY || ev->type == EV_REL || ev->type == EV_ABS || ev->type == EV_SW;
+}
+
+static void input_device_close(struct InputDevice *dev) {
+  if (dev->handle) {
+    event_loop_remove_fd(dev->owner->loop, dev->handle);
+    dev->handle = NULL;
+  }
+  if (dev->fd >= 0) {
+    close(dev->fd);
+    dev->fd = -1;
+  }
+}
+
+static void on_input_readable(void *usr, int fd, uint32_t events) {
+  struct InputDevice *dev = usr;
+  struct InputActivity *ia = dev->owner;
+
+  size_t activity = 0;
+  struct input_event evs[INPUT_ACTIVITY_BATCH];
+  while (true) {
+    const ssize_t rd = read(fd, evs, sizeof(evs));
+    if (rd < 0 && errno == EINTR) {
+      continue;
+    } else if (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (rd <= 0) {
+      // ENODEV once the device is unplugged
+      fprintf(stderr, "Input device %s (%s) went away, not watching it anymore\n", dev->path,
+              dev->name);
+      input_device_close(dev);
+      break;
+    }
+
+    const size_t cnt = rd / sizeof(evs[0]);
+    for (size_t i = 0; i < cnt; ++i) {
+      activity += is_user_activity(&evs[i]);
+    }
+    if (cnt < INPUT_ACTIVITY_BATCH) {
+      break;
+    }
+  }
+
+  if (activity == 0) {
+    return;
+  }
+
+  ia->events += activity;
+  const uint64_t now_ns = clock_now_ns(event_loop_clock(ia->loop));
+  if (ia->last_report_ns && now_ns - ia->last_report_ns < INPUT_ACTIVITY_HOLDOFF_MS * 1000000ull) {
+    return;
+  }
+  ia->last_report_ns = now_ns;
+  ia->cb(ia->usr, dev->name, now_ns);
+}
+
+struct InputActivity *input_activity_init(struct EventLoop *loop, size_t paths_sz,
+                                          const char *const *paths, input_activity_cb_t cb,
+                                          void *usr) {
+  if (paths_sz > INPUT_ACTIVITY_MAX_DEVICES) {
+    fprintf(stderr, "InputActivity supports up to %d devices\n", INPUT_ACTIVITY_MAX_DEVICES);
+    return NULL;
+  }
+
+  struct InputActivity *ia = malloc(sizeof(struct InputActivity));
+  if (!ia) {
+    perror("InputActivity bad alloc");
+    return NULL;
+  }
+
+  memset(ia, 0, sizeof(*ia));
+  ia->loop = loop;
+  ia->cb = cb;
+  ia->usr = usr;
+
+  size_t watched = 0;
+  for (size_t i = 0; i < paths_sz; ++i) {
+    struct InputDevice *dev = &ia->devices[ia->devices_sz++];
+    dev->owner = ia;
+    dev->path = paths[i];
+    dev->fd = open(paths[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (dev->fd < 0) {
+      fprintf(stderr, "Warning: can't open input device %s, ignoring it: %s\n", paths[i],
+              strerror(errno));
+      continue;
+    }
+
+    if (ioctl(dev->fd, EVIOCGNAME(sizeof(dev->name) - 1), dev->name) < 0) {
+      snprintf(dev->name, sizeof(dev->name), "%s", "unknown device");
+    }
+
+    dev->handle = event_loop_add_fd(loop, dev->fd, EPOLLIN, on_input_readable, dev);
+    if (!dev->handle) {
+      input_device_close(dev);
+      continue;
+    }
+
+    printf("Watching input device %s (%s) for user activity\n", paths[i], dev->name);
+    watched++;
+  }
+
+  if (watched == 0) {
+    fprintf(stderr, "InputActivity can't watch any input device\n");
+    input_activity_free(ia);
+    return NULL;
+  }
+
+  return ia;
+}
+
+void input_activity_free(struct InputActivity *ia) {
+  if (!ia) {
+    return;
+  }
+
+  for (size_t i = 0; i < ia->devices_sz; ++i) {
+    input_device_close(&ia->devices[i]);
+  }
+  free(ia);
+}
+
+size_t input_activity_events(const struct InputActivity *ia) {
+  return ia->events;
+}
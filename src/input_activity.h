@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Watches input devices (evdev, /dev/input/event*) from the event loop: any key, touch, button or
+// motion event means someone is interacting with the device, which is strong evidence of presence.
+// Events are read in batches when the device fd is readable, there is no polling.
+struct EventLoop;
+struct InputActivity;
+
+// Called from the event loop on user activity, at most once per INPUT_ACTIVITY_HOLDOFF_MS while
+// the activity continues. now_ns is the time of the loop clock.
+#define INPUT_ACTIVITY_HOLDOFF_MS 500
+typedef void (*input_activity_cb_t)(void *usr, const char *device_name, uint64_t now_ns);
+
+// Devices that can't be opened are skipped with a warning; returns NULL if none can be.
+struct InputActivity *input_activity_init(struct EventLoop *loop, size_t paths_sz,
+                                          const char *const *paths, input_activity_cb_t cb,
+                                          void *usr);
+void input_activity_free(struct InputActivity *ia);
+
+// Activity events read, over all devices
+size_t input_activity_events(const struct InputActivity *ia);
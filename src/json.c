@@ -91,6 +91,20 @@ bool json_get_int(struct json_object *h, const char *k, int *v) {
   return false;
 }
 
+static bool size_t_in_range(const char *k, int iv, size_t *v, size_t min,
+                            size_t max) {
+  if ((iv < 0) || ((size_t)iv < min) || ((size_t)iv > max)) {
+    fprintf(stderr,
+            "Bad config value: invalid value %d for %s, expected interval is "
+            "[%zu, %zu]\n",
+            iv, k, min, max);
+    return false;
+  }
+
+  *v = (size_t)iv;
+  return true;
+}
+
 bool json_get_size_t(struct json_object *h, const char *k, size_t *v,
                      size_t min, size_t max) {
   int iv;
@@ -100,16 +114,18 @@ bool json_get_size_t(struct json_object *h, const char *k, size_t *v,
     return false;
   }
 
-  if ((iv < 0) || ((size_t)iv < min) || ((size_t)iv > max)) {
-    fprintf(stderr,
-            "Bad config value: invalid value %d for %s, expected interval is "
-            "[%zu, %zu]\n",
-            iv, k, min, max);
+  return size_t_in_range(k, iv, v, min, max);
+}
+
+bool jsonobj_get_size_t(struct json_object *h, size_t *v, size_t min,
+                        size_t max) {
+  if (!json_object_is_type(h, json_type_int)) {
+    fprintf(stderr, "Failed to read config: value is not an int\n");
     return false;
   }
 
-  *v = (size_t)iv;
-  return true;
+  return size_t_in_range("array element", json_object_get_int(h), v, min,
+                         max);
 }
 
 bool json_get_bool(struct json_object *h, const char *k, bool *v) {
@@ -123,6 +139,21 @@ bool json_get_bool(struct json_object *h, const char *k, bool *v) {
   return false;
 }
 
+bool json_get_optional_bool(struct json_object *h, const char *k, bool *v) {
+  if (!json_object_object_get_ex(h, k, NULL)) {
+    return true;
+  }
+  return json_get_bool(h, k, v);
+}
+
+bool json_get_optional_size_t(struct json_object *h, const char *k, size_t *v,
+                              size_t min, size_t max) {
+  if (!json_object_object_get_ex(h, k, NULL)) {
+    return true;
+  }
+  return json_get_size_t(h, k, v, min, max);
+}
+
 bool json_get_arr(struct json_object *h, const char *k, arr_parse_cb cb,
                   void *usr) {
   struct json_object *arr;
@@ -145,6 +176,15 @@ bool json_get_arr(struct json_object *h, const char *k, arr_parse_cb cb,
   return true;
 }
 
+bool json_get_optional_arr(struct json_object *h, const char *k,
+                           arr_parse_cb cb, void *usr) {
+  if (!json_object_object_get_ex(h, k, NULL)) {
+    return true;
+  }
+
+  return json_get_arr(h, k, cb, usr);
+}
+
 const char *json_get_nested_key(struct json_object *obj, const char *key) {
   const size_t max_depth = 10;
   char subkey[32];
@@ -14,12 +14,20 @@ bool json_get_int(struct json_object *h, const char *k, int *v);
 bool json_get_size_t(struct json_object *h, const char *k, size_t *v,
                      size_t min, size_t max);
 bool json_get_bool(struct json_object *h, const char *k, bool *v);
+// Optional values leave *v untouched if the key is missing. They only fail if
+// the key exists but its value is invalid.
+bool json_get_optional_bool(struct json_object *h, const char *k, bool *v);
+bool json_get_optional_size_t(struct json_object *h, const char *k, size_t *v,
+                              size_t min, size_t max);
 
 // Invoke a callback for each element of an array
 typedef bool (*arr_parse_cb)(size_t arr_len, size_t idx, struct json_object *,
                              void *usr);
 bool json_get_arr(struct json_object *h, const char *k, arr_parse_cb cb,
                   void *usr);
+// Same as json_get_arr, but a missing key is not an error
+bool json_get_optional_arr(struct json_object *h, const char *k,
+                           arr_parse_cb cb, void *usr);
 
 // Retrieve a string key from a nested path, eg "foo.bar.baz" will return "baz"
 // as a string Ownership retained by this module
@@ -27,3 +35,6 @@ const char *json_get_nested_key(struct json_object *obj, const char *key);
 
 // Helper to retrieve a string without a key (eg in an arr)
 bool jsonobj_strdup(struct json_object *h, const char **v);
+// Helper to retrieve a size_t without a key (eg in an arr)
+bool jsonobj_get_size_t(struct json_object *h, size_t *v, size_t min,
+                        size_t max);
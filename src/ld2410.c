@@ -0,0 +1,205 @@
+#include "ld2410.h"
+
+#include <asm/termbits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define LD2410_RING_MASK (LD2410_RING_SZ - 1)
+#define LD2410_HEADER_SZ 4
+#define LD2410_LEN_SZ 2
+#define LD2410_FOOTER_SZ 4
+// type, 0xAA, 9 bytes of basic report, 0x55, 0x00
+#define LD2410_MIN_PAYLOAD 13
+#define LD2410_MAX_PAYLOAD 64
+
+static const uint8_t ld2410_header[LD2410_HEADER_SZ] = {0xF4, 0xF3, 0xF2, 0xF1};
+static const uint8_t ld2410_footer[LD2410_FOOTER_SZ] = {0xF8, 0xF7, 0xF6, 0xF5};
+
+int ld2410_open(const char *tty_path) {
+  const int fd = open(tty_path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open radar UART %s\n", tty_path);
+    perror("LD2410 init fail");
+    return -1;
+  }
+
+  // 256000 isn't one of the Bxxx speeds, it needs termios2 with an arbitrary rate
+  struct termios2 tio;
+  if (ioctl(fd, TCGETS2, &tio) != 0) {
+    fprintf(stderr, "%s isn't a tty\n", tty_path);
+    perror("LD2410 init fail");
+    close(fd);
+    return -1;
+  }
+
+  // Raw 8N1, no flow control
+  tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+  tio.c_oflag &= ~OPOST;
+  tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+  tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS | CBAUD);
+  tio.c_cflag |= CS8 | CREAD | CLOCAL | BOTHER;
+  tio.c_ispeed = LD2410_BAUD;
+  tio.c_ospeed = LD2410_BAUD;
+  // The fd is non blocking either way, but with VMIN=0 a read with nothing pending returns 0 as if
+  // the UART hung up; VMIN=1 makes it EAGAIN, so 0 only means hangup
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  if (ioctl(fd, TCSETS2, &tio) != 0) {
+    fprintf(stderr, "Can't configure radar UART %s\n", tty_path);
+    perror("LD2410 init fail");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+void ld2410_parser_init(struct Ld2410Parser *p) {
+  memset(p, 0, sizeof(*p));
+}
+
+bool ld2410_parser_read(struct Ld2410Parser *p, int fd) {
+  while (true) {
+    size_t used = p->head - p->tail;
+    if (used == LD2410_RING_SZ) {
+      // A full ring can't hold a frame start: the parser already skipped anything it could
+      // decode, so make space by dropping the oldest bytes
+      p->tail += LD2410_RING_SZ / 2;
+      p->skipped_bytes += LD2410_RING_SZ / 2;
+      used = p->head - p->tail;
+    }
+
+    // Free space may wrap around the end of the ring
+    const size_t start = p->head & LD2410_RING_MASK;
+    const size_t free_sz = LD2410_RING_SZ - used;
+    const size_t first_sz = (start + free_sz > LD2410_RING_SZ) ? LD2410_RING_SZ - start : free_sz;
+    struct iovec iov[2] = {
+        {.iov_base = &p->ring[start], .iov_len = first_sz},
+        {.iov_base = &p->ring[0], .iov_len = free_sz - first_sz},
+    };
+    const ssize_t rd = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (rd < 0 && errno == EINTR) {
+      continue;
+    } else if (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true;
+    } else if (rd < 0) {
+      perror("LD2410 read fail");
+      return false;
+    } else if (rd == 0) {
+      return false;
+    }
+
+    p->head += rd;
+    if ((size_t)rd < free_sz) {
+      return true;
+    }
+    // Filled the ring, decode before reading more
+    ld2410_parser_parse(p);
+  }
+}
+
+static inline uint8_t ring_at(const struct Ld2410Parser *p, size_t off) {
+  return p->ring[(p->tail + off) & LD2410_RING_MASK];
+}
+
+static inline uint16_t ring_u16(const struct Ld2410Parser *p, size_t off) {
+  return ring_at(p, off) | (uint16_t)ring_at(p, off + 1) << 8;
+}
+
+static bool ring_matches(const struct Ld2410Parser *p, size_t off, const uint8_t *pattern,
+                         size_t sz) {
+  for (size_t i = 0; i < sz; ++i) {
+    if (ring_at(p, off + i) != pattern[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t ld2410_parser_parse(struct Ld2410Parser *p) {
+  size_t reports = 0;
+  while (true) {
+    // Resync on the next header
+    while (p->head - p->tail >= LD2410_HEADER_SZ &&
+           !ring_matches(p, 0, ld2410_header, LD2410_HEADER_SZ)) {
+      p->tail++;
+      p->skipped_bytes++;
+    }
+
+    const size_t avail = p->head - p->tail;
+    if (avail < LD2410_HEADER_SZ + LD2410_LEN_SZ) {
+      return reports;
+    }
+
+    const size_t len = ring_u16(p, LD2410_HEADER_SZ);
+    const size_t payload = LD2410_HEADER_SZ + LD2410_LEN_SZ;
+    if (len < LD2410_MIN_PAYLOAD || len > LD2410_MAX_PAYLOAD) {
+      // Not a report frame (or a corrupt one): skip this header
+      p->tail++;
+      p->bad_frames++;
+      continue;
+    }
+
+    const size_t frame_sz = payload + len + LD2410_FOOTER_SZ;
+    if (avail < frame_sz) {
+      return reports;
+    }
+
+    if (ring_at(p, payload + 1) != 0xAA || ring_at(p, payload + len - 2) != 0x55 ||
+        !ring_matches(p, payload + len, ld2410_footer, LD2410_FOOTER_SZ)) {
+      p->tail++;
+      p->bad_frames++;
+      continue;
+    }
+
+    // Basic and engineering frames share the basic report, right after the 0xAA marker
+    const size_t report = payload + 2;
+    p->last.target_state = ring_at(p, report);
+    p->last.moving_cm = ring_u16(p, report + 1);
+    p->last.moving_energy = ring_at(p, report + 3);
+    p->last.static_cm = ring_u16(p, report + 4);
+    p->last.static_energy = ring_at(p, report + 6);
+    p->last.detection_cm = ring_u16(p, report + 7);
+    p->tail += frame_sz;
+    p->frames++;
+    reports++;
+  }
+}
+
+bool ld2410_report_present(const struct Ld2410Report *r, size_t max_cm, size_t min_energy) {
+  const bool moving = (r->target_state & LD2410_TARGET_MOVING) && r->moving_cm <= max_cm &&
+                      r->moving_energy >= min_energy;
+  const bool stationary = (r->target_state & LD2410_TARGET_STATIC) && r->static_cm <= max_cm &&
+                          r->static_energy >= min_energy;
+  return moving || stationary;
+}
+
+size_t ld2410_encode_basic(const struct Ld2410Report *r, uint8_t *out) {
+  size_t n = 0;
+  memcpy(&out[n], ld2410_header, LD2410_HEADER_SZ);
+  n += LD2410_HEADER_SZ;
+  out[n++] = LD2410_MIN_PAYLOAD;
+  out[n++] = 0;
+  // Basic report type
+  out[n++] = 0x02;
+  out[n++] = 0xAA;
+  out[n++] = r->target_state;
+  out[n++] = r->moving_cm & 0xff;
+  out[n++] = r->moving_cm >> 8;
+  out[n++] = r->moving_energy;
+  out[n++] = r->static_cm & 0xff;
+  out[n++] = r->static_cm >> 8;
+  out[n++] = r->static_energy;
+  out[n++] = r->detection_cm & 0xff;
+  out[n++] = r->detection_cm >> 8;
+  out[n++] = 0x55;
+  out[n++] = 0x00;
+  memcpy(&out[n], ld2410_footer, LD2410_FOOTER_SZ);
+  n += LD2410_FOOTER_SZ;
+  return n;
+}
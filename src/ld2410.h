@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// HLK-LD2410 class 24 GHz presence radars, streaming report frames over a UART (256000 8N1):
+//   F4 F3 F2 F1 | len (u16 LE) | type, 0xAA, target state, moving cm (u16), moving energy,
+//   static cm (u16), static energy, detection cm (u16), [engineering data], 0x55, 0x00 |
+//   F8 F7 F6 F5
+// Bytes are read into a fixed ring and frames are decoded where they sit, with no copies and no
+// allocations. Anything else on the line (eg command ACKs, noise) is skipped until the next header.
+
+#define LD2410_BAUD 256000
+// Power of 2, fits a few frames: the longest (engineering mode) is 45 bytes
+#define LD2410_RING_SZ 256
+
+// Target state bits
+#define LD2410_TARGET_MOVING 0x1
+#define LD2410_TARGET_STATIC 0x2
+
+struct Ld2410Report {
+  uint8_t target_state;
+  uint16_t moving_cm;
+  uint8_t moving_energy;
+  uint16_t static_cm;
+  uint8_t static_energy;
+  uint16_t detection_cm;
+};
+
+struct Ld2410Parser {
+  uint8_t ring[LD2410_RING_SZ];
+  // Bytes ever written and consumed; their difference is the ring occupancy
+  size_t head;
+  size_t tail;
+  size_t frames;
+  size_t bad_frames;
+  size_t skipped_bytes;
+  struct Ld2410Report last;
+};
+
+// Open and configure a tty for the radar (raw, non-blocking). Returns the fd, or -1 on error.
+int ld2410_open(const char *tty_path);
+
+void ld2410_parser_init(struct Ld2410Parser *p);
+
+// Read what's available from a non-blocking fd into the ring (never blocks). Returns false on a
+// read error or EOF.
+bool ld2410_parser_read(struct Ld2410Parser *p, int fd);
+
+// Decode all complete frames in the ring. Returns the number of reports decoded; p->last has the
+// latest one.
+size_t ld2410_parser_parse(struct Ld2410Parser *p);
+
+// Presence of a target within max_cm, with at least min_energy (0-100)
+bool ld2410_report_present(const struct Ld2410Report *r, size_t max_cm, size_t min_energy);
+
+// Encode a basic mode report frame into out (at least LD2410_BASIC_FRAME_SZ bytes). For frame
+// generators; returns the frame size.
+#define LD2410_BASIC_FRAME_SZ 23
+size_t ld2410_encode_basic(const struct Ld2410Report *r, uint8_t *out);
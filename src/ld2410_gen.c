@@ -0,0 +1,140 @@
+// LD2410 frame generator, to test radar sensors without the hardware. Opens a pty, links its
+// device to <link>, and streams basic report frames to it at 10 Hz, following a schedule that
+// repeats forever. Point a radar sensor's "uart" to <link>.
+//
+// Usage: pipresencemon_ld2410_gen <link> <secs>:<target state>:<distance cm>:<energy> ...
+// eg `pipresencemon_ld2410_gen /tmp/radar 5:0:0:0 10:2:150:60` repeats 5 s of no target and 10 s
+// of a static target at 1.5 m. Noise and other frames are mixed in, to exercise resyncs, and
+// frames are written in pieces, like a UART would deliver them.
+#define _XOPEN_SOURCE 600
+#include "ld2410.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LD2410_GEN_MAX_STEPS 32
+#define LD2410_GEN_PERIOD_MS 100
+
+struct ScheduleStep {
+  unsigned secs;
+  struct Ld2410Report report;
+};
+
+static volatile sig_atomic_t stop = 0;
+static void on_signal(int signo) {
+  stop = 1;
+}
+
+static void sleep_ms(unsigned ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000l};
+  nanosleep(&ts, NULL);
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t sz) {
+  while (sz > 0) {
+    const ssize_t wr = write(fd, buf, sz);
+    if (wr < 0) {
+      return false;
+    }
+    buf += wr;
+    sz -= wr;
+  }
+  return true;
+}
+
+static bool parse_step(const char *arg, struct ScheduleStep *step) {
+  unsigned state, cm, energy;
+  if (sscanf(arg, "%u:%u:%u:%u", &step->secs, &state, &cm, &energy) != 4 || state > 3 ||
+      cm > 65535 || energy > 100) {
+    fprintf(stderr, "Bad schedule step %s, expected <secs>:<state 0-3>:<cm>:<energy 0-100>\n",
+            arg);
+    return false;
+  }
+
+  memset(&step->report, 0, sizeof(step->report));
+  step->report.target_state = state;
+  if (state & LD2410_TARGET_MOVING) {
+    step->report.moving_cm = cm;
+    step->report.moving_energy = energy;
+  }
+  if (state & LD2410_TARGET_STATIC) {
+    step->report.static_cm = cm;
+    step->report.static_energy = energy;
+  }
+  step->report.detection_cm = cm;
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  if (argc < 3 || argc - 2 > LD2410_GEN_MAX_STEPS) {
+    fprintf(stderr, "Usage: %s <link> <secs>:<state>:<cm>:<energy> ... (up to %d steps)\n",
+            argv[0], LD2410_GEN_MAX_STEPS);
+    return 1;
+  }
+
+  const char *link_path = argv[1];
+  struct ScheduleStep steps[LD2410_GEN_MAX_STEPS];
+  const size_t steps_sz = argc - 2;
+  for (size_t i = 0; i < steps_sz; ++i) {
+    if (!parse_step(argv[2 + i], &steps[i])) {
+      return 1;
+    }
+  }
+
+  const int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("Can't create pty");
+    return 1;
+  }
+
+  unlink(link_path);
+  if (symlink(ptsname(master), link_path) != 0) {
+    perror("Can't link pty");
+    return 1;
+  }
+  printf("Streaming LD2410 frames to %s (%s)\n", link_path, ptsname(master));
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  // The reader may go away, that shouldn't kill the generator
+  signal(SIGPIPE, SIG_IGN);
+
+  // An ACK frame and some noise, which the parser must skip
+  static const uint8_t ack[] = {0xFD, 0xFC, 0xFB, 0xFA, 0x04, 0x00, 0xFF, 0x01,
+                                0x00, 0x00, 0x04, 0x03, 0x02, 0x01};
+  static const uint8_t noise[] = {0xF4, 0xF3, 0x00, 0x55, 0xAA, 0xF4};
+
+  size_t frames = 0;
+  while (!stop) {
+    for (size_t i = 0; i < steps_sz && !stop; ++i) {
+      printf("Target state %u at %ucm for %us\n", steps[i].report.target_state,
+             steps[i].report.detection_cm, steps[i].secs);
+      fflush(stdout);
+      for (unsigned t = 0; t < steps[i].secs * 1000 && !stop; t += LD2410_GEN_PERIOD_MS) {
+        uint8_t frame[LD2410_BASIC_FRAME_SZ];
+        const size_t sz = ld2410_encode_basic(&steps[i].report, frame);
+        if (frames % 10 == 3) {
+          write_all(master, noise, sizeof(noise));
+        } else if (frames % 10 == 7) {
+          write_all(master, ack, sizeof(ack));
+        }
+        // Split the frame, so the reader sees it across two reads
+        write_all(master, frame, sz / 2);
+        sleep_ms(1);
+        write_all(master, frame + sz / 2, sz - sz / 2);
+        frames++;
+        sleep_ms(LD2410_GEN_PERIOD_MS);
+      }
+    }
+  }
+
+  printf("Sent %zu frames\n", frames);
+  unlink(link_path);
+  close(master);
+  return 0;
+}
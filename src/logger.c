@@ -0,0 +1,233 @@
+#include "logger.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// Records are written to stderr in batches of up to this many bytes
+#define LOGGER_BATCH_SZ 4096
+
+struct LogRecord {
+  // Slot i is free for the producer claiming position p when seq == p, and holds a complete
+  // record for the drain when seq == p + 1 (bounded MPMC queue, with a single consumer)
+  atomic_size_t seq;
+  enum LogLevel level;
+  char msg[LOGGER_MAX_MSG];
+};
+
+struct Logger {
+  struct LogRecord ring[LOGGER_RING_RECORDS];
+  // Next position producers claim, and next one the drain reads (only touched by the drain)
+  atomic_size_t tail;
+  size_t head;
+  atomic_size_t dropped;
+
+  enum LogLevel min_level;
+  bool use_syslog;
+  atomic_bool running;
+
+  // Producers only wake the drain if it isn't already awake, so a burst costs one write
+  atomic_bool kicked;
+  int wake_fd;
+  atomic_bool thread_stop;
+  pthread_t thread_id;
+};
+
+static struct Logger logger = {.wake_fd = -1};
+
+static int syslog_priority(enum LogLevel level) {
+  switch (level) {
+  case LOG_LEVEL_DEBUG:
+    return LOG_DEBUG;
+  case LOG_LEVEL_INFO:
+    return LOG_INFO;
+  case LOG_LEVEL_WARN:
+    return LOG_WARNING;
+  case LOG_LEVEL_ERROR:
+    return LOG_ERR;
+  }
+  return LOG_INFO;
+}
+
+static void write_all(const char *buf, size_t sz) {
+  while (sz > 0) {
+    const ssize_t wr = write(STDERR_FILENO, buf, sz);
+    if (wr < 0 && errno == EINTR) {
+      continue;
+    } else if (wr < 0) {
+      return;
+    }
+    buf += wr;
+    sz -= wr;
+  }
+}
+
+struct LogBatch {
+  char buf[LOGGER_BATCH_SZ];
+  size_t sz;
+};
+
+static void batch_append(struct LogBatch *batch, enum LogLevel level, const char *msg) {
+  if (logger.use_syslog) {
+    syslog(syslog_priority(level), "%s", msg);
+    return;
+  }
+
+  const size_t msg_sz = strlen(msg);
+  if (batch->sz + msg_sz + 1 > sizeof(batch->buf)) {
+    write_all(batch->buf, batch->sz);
+    batch->sz = 0;
+  }
+  memcpy(batch->buf + batch->sz, msg, msg_sz);
+  batch->buf[batch->sz + msg_sz] = '\n';
+  batch->sz += msg_sz + 1;
+}
+
+// Write out every complete record. Only one thread may drain at a time.
+static void logger_drain() {
+  struct LogBatch batch;
+  batch.sz = 0;
+  while (true) {
+    struct LogRecord *rec = &logger.ring[logger.head % LOGGER_RING_RECORDS];
+    if (atomic_load_explicit(&rec->seq, memory_order_acquire) != logger.head + 1) {
+      break;
+    }
+
+    batch_append(&batch, rec->level, rec->msg);
+    // Free the slot for the producer that will claim it on the next lap
+    atomic_store_explicit(&rec->seq, logger.head + LOGGER_RING_RECORDS, memory_order_release);
+    logger.head++;
+  }
+
+  const size_t dropped = atomic_exchange(&logger.dropped, 0);
+  if (dropped > 0) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Logger dropped %zu messages, log ring full", dropped);
+    batch_append(&batch, LOG_LEVEL_WARN, msg);
+  }
+
+  write_all(batch.buf, batch.sz);
+}
+
+static void *logger_run(void *usr) {
+  struct pollfd pfd = {.fd = logger.wake_fd, .events = POLLIN};
+  while (!logger.thread_stop) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      break;
+    }
+
+    uint64_t wakes;
+    if (read(logger.wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN) {
+      break;
+    }
+    // Cleared before draining: a record pushed after this point will wake us again
+    atomic_store(&logger.kicked, false);
+    logger_drain();
+  }
+  return NULL;
+}
+
+bool logger_init(const struct PiPresenceMonConfig *cfg) {
+  logger.min_level = cfg->log_level;
+  logger.use_syslog = cfg->log_syslog;
+  for (size_t i = 0; i < LOGGER_RING_RECORDS; ++i) {
+    atomic_init(&logger.ring[i].seq, i);
+  }
+  atomic_init(&logger.tail, 0);
+  logger.head = 0;
+
+  logger.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (logger.wake_fd < 0) {
+    perror("Logger can't create wake up eventfd");
+    return false;
+  }
+
+  logger.thread_stop = false;
+  if (pthread_create(&logger.thread_id, NULL, logger_run, NULL) != 0) {
+    perror("Logger thread create error");
+    close(logger.wake_fd);
+    logger.wake_fd = -1;
+    return false;
+  }
+
+  atomic_store(&logger.running, true);
+  return true;
+}
+
+void logger_free() {
+  if (!atomic_load(&logger.running)) {
+    return;
+  }
+
+  logger.thread_stop = true;
+  const uint64_t wake = 1;
+  if (write(logger.wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+    perror("Logger can't wake up drain thread");
+  }
+  if (pthread_join(logger.thread_id, NULL) != 0) {
+    perror("Logger pthread_join fail");
+  }
+
+  // Whatever was queued since the last drain
+  atomic_store(&logger.running, false);
+  logger_drain();
+  close(logger.wake_fd);
+  logger.wake_fd = -1;
+}
+
+void logger_log(enum LogLevel level, const char *fmt, ...) {
+  if (level < logger.min_level) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  if (!atomic_load(&logger.running)) {
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return;
+  }
+
+  size_t pos = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+  struct LogRecord *rec;
+  while (true) {
+    rec = &logger.ring[pos % LOGGER_RING_RECORDS];
+    const size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+    const intptr_t lap = (intptr_t)(seq - pos);
+    if (lap == 0) {
+      if (atomic_compare_exchange_weak_explicit(&logger.tail, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (lap < 0) {
+      // The drain hasn't freed this slot yet: the ring is full
+      atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+      va_end(args);
+      return;
+    } else {
+      // Another producer claimed pos
+      pos = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+    }
+  }
+
+  rec->level = level;
+  vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+  va_end(args);
+  atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+
+  if (!atomic_exchange(&logger.kicked, true)) {
+    // Non-blocking; can only fail if the counter would overflow, and then the drain is awake
+    const uint64_t wake = 1;
+    const ssize_t wr = write(logger.wake_fd, &wake, sizeof(wake));
+    (void)wr;
+  }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "cfg.h"
+
+#include <stdbool.h>
+
+// Logging for threads that must never block, like the samplers. logger_log formats into a slot of
+// a preallocated ring (any number of producers, lock-free, no allocations) and returns; a drain
+// thread writes out what's queued in batches, to stderr or syslog. If the ring is full the record
+// is dropped and counted, the drain thread reports how many were lost: a slow stdout or journald
+// pipe can delay the log, but never a sample.
+// Before logger_init and after logger_free, records are written synchronously to stderr.
+
+// Records longer than this are truncated
+#define LOGGER_MAX_MSG 200
+#define LOGGER_RING_RECORDS 128
+
+// Starts the drain thread. Returns false on error (logging stays synchronous).
+bool logger_init(const struct PiPresenceMonConfig *cfg);
+// Writes out any queued records and stops the drain thread
+void logger_free();
+
+void logger_log(enum LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
@@ -0,0 +1,346 @@
+// accept4
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "event_loop.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_MAX_CLIENTS 4
+// A client gets this long to send its request after connecting, so idle connections can't hold
+// every slot
+#define METRICS_CLIENT_TIMEOUT_MS 2000
+
+static const uint64_t histogram_bounds_us[METRICS_HISTOGRAM_BUCKETS] = {
+    100,       250,       500,        1000,       2500,       5000,
+    10000,     25000,     50000,      100000,     250000,     500000,
+    1000000,   5000000,   15000000,   60000000,   180000000,  600000000,
+};
+
+static struct PipelineMetrics pipeline;
+
+struct PipelineMetrics *metrics_pipeline() {
+  return &pipeline;
+}
+
+void metrics_histogram_observe(struct MetricsHistogram *h, uint64_t us) {
+  size_t bucket = 0;
+  while (bucket < METRICS_HISTOGRAM_BUCKETS && us > histogram_bounds_us[bucket]) {
+    ++bucket;
+  }
+  atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+}
+
+void metrics_printf(struct MetricsWriter *w, const char *fmt, ...) {
+  if (w->truncated) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  const int sz = vsnprintf(w->buf + w->sz, sizeof(w->buf) - w->sz, fmt, args);
+  va_end(args);
+  if (sz < 0 || (size_t)sz >= sizeof(w->buf) - w->sz) {
+    w->truncated = true;
+    return;
+  }
+  w->sz += sz;
+}
+
+void metrics_write_help(struct MetricsWriter *w, const char *name, const char *type,
+                        const char *help) {
+  metrics_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write_label_value(struct MetricsWriter *w, const char *val) {
+  for (const char *c = val; *c; ++c) {
+    if (*c == '\\' || *c == '"') {
+      metrics_printf(w, "\\%c", *c);
+    } else if (*c == '\n') {
+      metrics_printf(w, "\\n");
+    } else {
+      metrics_printf(w, "%c", *c);
+    }
+  }
+}
+
+void metrics_write_histogram(struct MetricsWriter *w, const char *name, const char *help,
+                             const struct MetricsHistogram *h) {
+  metrics_write_help(w, name, "histogram", help);
+  // Buckets are stored individually, Prometheus wants them cumulative
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i) {
+    cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    metrics_printf(w, "%s_bucket{le=\"%llu\"} %llu\n", name,
+                   (unsigned long long)histogram_bounds_us[i], (unsigned long long)cumulative);
+  }
+  cumulative +=
+      atomic_load_explicit(&h->buckets[METRICS_HISTOGRAM_BUCKETS], memory_order_relaxed);
+  metrics_printf(w, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+  metrics_printf(w, "%s_sum %llu\n", name,
+                 (unsigned long long)atomic_load_explicit(&h->sum_us, memory_order_relaxed));
+  metrics_printf(w, "%s_count %llu\n", name, (unsigned long long)cumulative);
+}
+
+struct MetricsClient {
+  struct MetricsServer *srv;
+  int fd;
+  struct EventLoopFd *handle;
+  // Armed on accept, closes the client if no request arrives in METRICS_CLIENT_TIMEOUT_MS
+  struct EventLoopTimer *timeout;
+};
+
+struct MetricsServer {
+  struct EventLoop *loop;
+  metrics_collect_cb_t collect;
+  void *usr;
+  const char *socket_path;
+
+  // Unix socket and TCP listeners, -1 if unused
+  int listen_fds[2];
+  struct EventLoopFd *listen_handles[2];
+  struct MetricsClient clients[METRICS_MAX_CLIENTS];
+
+  // Only used while handling a scrape, kept here to stay off the stack
+  struct MetricsWriter response;
+  size_t scrapes;
+};
+
+static void client_close(struct MetricsClient *client) {
+  event_loop_remove_fd(client->srv->loop, client->handle);
+  close(client->fd);
+  client->handle = NULL;
+  client->fd = -1;
+  event_loop_timer_disarm(client->timeout);
+}
+
+static void on_client_timeout(void *usr) {
+  struct MetricsClient *client = usr;
+  fprintf(stderr, "MetricsServer dropping client, no request in %d ms\n",
+          METRICS_CLIENT_TIMEOUT_MS);
+  client_close(client);
+}
+
+// Requests are tiny and come in one piece, so whatever is requested, reply once it's readable
+static void on_client_readable(void *usr, int fd, uint32_t events) {
+  struct MetricsClient *client = usr;
+  struct MetricsServer *srv = client->srv;
+
+  char req[1024];
+  const ssize_t rd = read(fd, req, sizeof(req));
+  if (rd < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (rd <= 0) {
+    client_close(client);
+    return;
+  }
+
+  srv->scrapes++;
+  srv->response.sz = 0;
+  srv->response.truncated = false;
+  srv->collect(srv->usr, &srv->response);
+  if (srv->response.truncated) {
+    fprintf(stderr, "MetricsServer response truncated to %zu bytes\n", srv->response.sz);
+  }
+
+  char header[160];
+  const int header_sz = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\n"
+                                 "Connection: close\r\n\r\n",
+                                 srv->response.sz);
+  struct iovec iov[] = {
+      {.iov_base = header, .iov_len = header_sz},
+      {.iov_base = srv->response.buf, .iov_len = srv->response.sz},
+  };
+  // The response fits in the socket buffer; a client too slow for that doesn't get a retry. A
+  // client that already hung up gets EPIPE instead of a SIGPIPE that would kill the daemon.
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+  const ssize_t wr = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (wr != (ssize_t)(header_sz + srv->response.sz)) {
+    fprintf(stderr, "MetricsServer short write to client: %s\n",
+            wr < 0 ? strerror(errno) : "socket buffer full");
+  }
+  client_close(client);
+}
+
+static void on_listen_readable(void *usr, int fd, uint32_t events) {
+  struct MetricsServer *srv = usr;
+  const int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client_fd < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("MetricsServer can't accept client");
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < METRICS_MAX_CLIENTS; ++i) {
+    struct MetricsClient *client = &srv->clients[i];
+    if (client->fd >= 0) {
+      continue;
+    }
+
+    client->handle = event_loop_add_fd(srv->loop, client_fd, EPOLLIN, on_client_readable, client);
+    if (!client->handle) {
+      break;
+    }
+    client->fd = client_fd;
+    event_loop_timer_arm(client->timeout, METRICS_CLIENT_TIMEOUT_MS, 0);
+    return;
+  }
+
+  fprintf(stderr, "MetricsServer busy, dropping client\n");
+  close(client_fd);
+}
+
+static int listen_unix(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "MetricsServer socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("MetricsServer can't create Unix socket");
+    return -1;
+  }
+
+  // A previous run may have left it behind
+  unlink(path);
+  if (bind(fd, (const void *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+    fprintf(stderr, "MetricsServer can't listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int listen_loopback(size_t port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("MetricsServer can't create TCP socket");
+    return -1;
+  }
+
+  const int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (const void *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+    fprintf(stderr, "MetricsServer can't listen on 127.0.0.1:%zu: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+struct MetricsServer *metrics_server_init(struct EventLoop *loop, const char *socket_path,
+                                          size_t port, metrics_collect_cb_t collect, void *usr) {
+  struct MetricsServer *srv = malloc(sizeof(struct MetricsServer));
+  if (!srv) {
+    perror("MetricsServer bad alloc");
+    return NULL;
+  }
+
+  memset(srv, 0, sizeof(*srv));
+  srv->loop = loop;
+  srv->collect = collect;
+  srv->usr = usr;
+  srv->listen_fds[0] = -1;
+  srv->listen_fds[1] = -1;
+  for (size_t i = 0; i < METRICS_MAX_CLIENTS; ++i) {
+    srv->clients[i].srv = srv;
+    srv->clients[i].fd = -1;
+  }
+  for (size_t i = 0; i < METRICS_MAX_CLIENTS; ++i) {
+    srv->clients[i].timeout = event_loop_timer_init(loop, on_client_timeout, &srv->clients[i]);
+    if (!srv->clients[i].timeout) {
+      goto ERR;
+    }
+  }
+
+  if (socket_path) {
+    srv->socket_path = socket_path;
+    srv->listen_fds[0] = listen_unix(socket_path);
+    if (srv->listen_fds[0] < 0) {
+      goto ERR;
+    }
+  }
+  if (port) {
+    srv->listen_fds[1] = listen_loopback(port);
+    if (srv->listen_fds[1] < 0) {
+      goto ERR;
+    }
+  }
+
+  for (size_t i = 0; i < 2; ++i) {
+    if (srv->listen_fds[i] < 0) {
+      continue;
+    }
+    srv->listen_handles[i] =
+        event_loop_add_fd(loop, srv->listen_fds[i], EPOLLIN, on_listen_readable, srv);
+    if (!srv->listen_handles[i]) {
+      goto ERR;
+    }
+  }
+
+  if (socket_path) {
+    printf("Serving metrics on %s\n", socket_path);
+  }
+  if (port) {
+    printf("Serving metrics on http://127.0.0.1:%zu/metrics\n", port);
+  }
+  return srv;
+
+ERR:
+  metrics_server_free(srv);
+  return NULL;
+}
+
+void metrics_server_free(struct MetricsServer *srv) {
+  if (!srv) {
+    return;
+  }
+
+  for (size_t i = 0; i < METRICS_MAX_CLIENTS; ++i) {
+    if (srv->clients[i].fd >= 0) {
+      client_close(&srv->clients[i]);
+    }
+    event_loop_timer_free(srv->loop, srv->clients[i].timeout);
+  }
+
+  for (size_t i = 0; i < 2; ++i) {
+    if (srv->listen_handles[i]) {
+      event_loop_remove_fd(srv->loop, srv->listen_handles[i]);
+    }
+    if (srv->listen_fds[i] >= 0) {
+      close(srv->listen_fds[i]);
+    }
+  }
+
+  if (srv->socket_path && srv->listen_fds[0] >= 0) {
+    unlink(srv->socket_path);
+  }
+  printf("MetricsServer served %zu scrapes\n", srv->scrapes);
+  free(srv);
+}
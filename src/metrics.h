@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Process-wide metrics, served in Prometheus text format. Counters and histograms are fixed-size
+// atomics updated with relaxed adds: any thread records without locks, and a scrape only loads
+// them, so it can never stall a sampler thread. A scrape may see a histogram mid-update (eg its sum
+// one observation ahead of its buckets); that's fine for monitoring.
+
+// Bucket upper bounds, in usecs: from sub-ms (spawns, jitter) up to the 10 min vacancy timeouts
+#define METRICS_HISTOGRAM_BUCKETS 18
+struct MetricsHistogram {
+  atomic_uint_least64_t buckets[METRICS_HISTOGRAM_BUCKETS + 1];
+  atomic_uint_least64_t sum_us;
+};
+
+void metrics_histogram_observe(struct MetricsHistogram *h, uint64_t us);
+
+// Sensor to command pipeline
+struct PipelineMetrics {
+  // Sensor samples taken by all monitors
+  atomic_uint_least64_t samples;
+  // Lateness of sample timer wakeups
+  struct MetricsHistogram sample_jitter_us;
+  atomic_uint_least64_t transitions_occupied;
+  atomic_uint_least64_t transitions_vacant;
+  // From the sensor reading changing to the monitor deciding a transition (for vacancy, this
+  // includes the window and the vacancy timeout)
+  struct MetricsHistogram edge_to_decision_us;
+  // From the monitor deciding a transition to the main loop picking it up
+  struct MetricsHistogram decision_to_pickup_us;
+  // From the decision to each command of the new state running (spawned, thawed or run built-in)
+  struct MetricsHistogram decision_to_exec_us;
+  // From asking a command to stop to it exiting
+  struct MetricsHistogram command_stop_us;
+};
+
+struct PipelineMetrics *metrics_pipeline();
+
+#define relaxed_inc(counter) atomic_fetch_add_explicit(&(counter), 1, memory_order_relaxed)
+
+// Builds one scrape response, in a fixed buffer. Output past the end is dropped (and reported).
+#define METRICS_MAX_RESPONSE (32 * 1024)
+struct MetricsWriter {
+  char buf[METRICS_MAX_RESPONSE];
+  size_t sz;
+  bool truncated;
+};
+
+void metrics_printf(struct MetricsWriter *w, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+// Metric header: type is "counter", "gauge" or "histogram"
+void metrics_write_help(struct MetricsWriter *w, const char *name, const char *type,
+                        const char *help);
+// Label value, escaped as the text format requires
+void metrics_write_label_value(struct MetricsWriter *w, const char *val);
+void metrics_write_histogram(struct MetricsWriter *w, const char *name, const char *help,
+                             const struct MetricsHistogram *h);
+
+// Serves scrapes over HTTP, from the event loop, on a Unix socket (if socket_path is set) and/or
+// on 127.0.0.1:port (if port isn't 0). Each scrape calls collect to fill the response.
+struct EventLoop;
+struct MetricsServer;
+typedef void (*metrics_collect_cb_t)(void *usr, struct MetricsWriter *w);
+
+struct MetricsServer *metrics_server_init(struct EventLoop *loop, const char *socket_path,
+                                          size_t port, metrics_collect_cb_t collect, void *usr);
+void metrics_server_free(struct MetricsServer *srv);
@@ -1,16 +1,36 @@
 #include "occupancy_commands.h"
 #include "cfg.h"
-
-#include <errno.h>
+#include "clock.h"
+#include "display_power.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "periodic_timer.h"
+#include "trace.h"
+
+#include <poll.h>
 #include <signal.h>
-#include <stdatomic.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+extern char **environ;
+
+enum CurrentState {
+  STATE_INVALID,
+  STATE_OCCUPIED,
+  STATE_VACANT,
+};
+
 struct OccupancyTransitionCommand {
   // Copy of config string (eg "echo one two three")
   // This string will get used by strtok, so it's not printable. We keep it to
@@ -20,26 +40,59 @@ struct OccupancyTransitionCommand {
   char *bin;
   // Array of ptrs to args (eg "one two three")
   char **args;
-  // pid is atomic so the signal handler can reset it on crash
-  atomic_int pid;
+  // Built-in actions run in the daemon: no child, so pid stays 0 and they are done once run.
+  // builtin_done is set when one runs, and cleared when its state ends, so each state runs it once.
+  enum CommandAction action;
+  bool builtin_done;
+  pid_t pid;
+  // Readable when the child exits; registered in the event loop with this command as context, so
+  // an exit is routed to its owner without searching for the pid
+  int pidfd;
+  struct EventLoopFd *pidfd_handle;
   bool should_restart_on_crash;
   bool should_run_now;
-  // Cooldown before restarting a crashed process
-  size_t restart_cmd_wait_time_seconds;
+  // Set on each transition to this command's state, cleared once launch_pending_commands handles
+  // it. A command still stopping from the previous run of its state keeps it, and is launched when
+  // it exits.
+  bool launch_deferred;
+  // Armed after a crash, relaunches the command when the cooldown expires
+  struct EventLoopTimer *restart_timer;
+  // Delays the launch after a transition, if the command asks for it
+  size_t start_delay_ms;
+  struct EventLoopTimer *start_timer;
+  uint64_t launch_requested_ns;
+  // Standby policy: freeze the command (and its children, it leads its own process group) with
+  // SIGSTOP when its state ends, SIGCONT it when the state comes back
+  bool standby_freeze;
+  bool frozen;
   size_t restart_count;
+  size_t crashes;
   size_t max_restarts;
-};
-
-enum CurrentState {
-  STATE_INVALID,
-  STATE_OCCUPIED,
-  STATE_VACANT,
+  // Stop sends stop_signal and returns; if the child is still around when stop_timer expires, it
+  // gets a SIGKILL. The exit is picked up by on_child_exit like any other.
+  int stop_signal;
+  size_t stop_timeout_ms;
+  bool stopping;
+  uint64_t stop_start_ns;
+  struct EventLoopTimer *stop_timer;
+  // State in which this command should run
+  enum CurrentState run_on_state;
+  struct OccupancyCommands *owner;
 };
 
 struct OccupancyCommands {
+  struct EventLoop *loop;
+  // Clock of the loop, for deadlines and latencies
+  struct Clock *clock;
   enum CurrentState current_state;
+  // When the current state was decided, to measure how long its commands take to run
+  uint64_t decision_ns;
   size_t restart_cmd_wait_time_seconds;
   size_t crash_on_repeated_cmd_failure_count;
+  bool launch_before_stop_completes;
+  // Some commands for current_state still need to be launched (see launch_deferred), waiting for
+  // the previous state to stop
+  bool launch_pending;
 
   size_t on_occupancy_cmds_cnt;
   struct OccupancyTransitionCommand *on_occupancy_cmds;
@@ -47,13 +100,13 @@ struct OccupancyCommands {
   size_t on_vacancy_cmds_cnt;
   struct OccupancyTransitionCommand *on_vacancy_cmds;
 
+  // Only if any command uses a display action
+  struct DisplayPower *display;
+
   // A ptr to the config is held for callbacks, only while init runs
   const struct PiPresenceMonConfig *cfg;
 };
 
-// Non null if the SIGCHLD handler has been set
-struct OccupancyCommands *g_sigchld_handler = NULL;
-
 static size_t count_argc(const char *cmd) {
   size_t argc = 0;
   for (size_t i = 0; cmd[i] != '\0'; ++i) {
@@ -63,13 +116,35 @@ static size_t count_argc(const char *cmd) {
   return argc;
 }
 
-static bool parse_transition_cmd_from_cfg(struct CommandConfig *cmdcfg,
+static void on_restart_timer(void *usr);
+static void on_stop_timer(void *usr);
+static void on_start_timer(void *usr);
+
+static bool parse_transition_cmd_from_cfg(struct OccupancyCommands *self,
+                                          enum CurrentState run_on_state,
+                                          struct CommandConfig *cmdcfg,
                                           struct OccupancyTransitionCommand *cmd_state) {
+  cmd_state->owner = self;
+  cmd_state->run_on_state = run_on_state;
+  cmd_state->action = cmdcfg->action;
   cmd_state->pid = 0;
+  cmd_state->pidfd = -1;
+  cmd_state->pidfd_handle = NULL;
   cmd_state->should_restart_on_crash = cmdcfg->should_restart_on_crash;
   cmd_state->restart_count = 0;
+  cmd_state->crashes = 0;
   cmd_state->max_restarts = cmdcfg->max_restarts;
+  cmd_state->stop_signal = cmdcfg->stop_signal;
+  cmd_state->stop_timeout_ms = cmdcfg->stop_timeout_ms;
+  cmd_state->stopping = false;
+  cmd_state->stop_start_ns = 0;
+  cmd_state->start_delay_ms = cmdcfg->start_delay_ms;
+  cmd_state->launch_requested_ns = 0;
+  cmd_state->standby_freeze = cmdcfg->standby_freeze;
+  cmd_state->frozen = false;
   cmd_state->should_run_now = false;
+  cmd_state->launch_deferred = false;
+  cmd_state->builtin_done = false;
   cmd_state->cmd = malloc((1 + strlen(cmdcfg->cmd)) * sizeof(char));
 
   if (!cmd_state->cmd)
@@ -94,6 +169,24 @@ static bool parse_transition_cmd_from_cfg(struct CommandConfig *cmdcfg,
 
   cmd_state->args[argc - 1] = NULL;
 
+  cmd_state->restart_timer = event_loop_timer_init(self->loop, on_restart_timer, cmd_state);
+  if (!cmd_state->restart_timer) {
+    fprintf(stderr, "occupancy_commands_init can't create restart timer\n");
+    return false;
+  }
+
+  cmd_state->stop_timer = event_loop_timer_init(self->loop, on_stop_timer, cmd_state);
+  if (!cmd_state->stop_timer) {
+    fprintf(stderr, "occupancy_commands_init can't create stop timer\n");
+    return false;
+  }
+
+  cmd_state->start_timer = event_loop_timer_init(self->loop, on_start_timer, cmd_state);
+  if (!cmd_state->start_timer) {
+    fprintf(stderr, "occupancy_commands_init can't create start timer\n");
+    return false;
+  }
+
   return true;
 
 ALLOC_ERR:
@@ -103,178 +196,469 @@ ALLOC_ERR:
   return false;
 }
 
-static void launch_commands(size_t sz, struct OccupancyTransitionCommand *cmds,
-                            struct OccupancyCommands *self, bool respawn) {
-  for (size_t cmd_i = 0; cmd_i < sz; ++cmd_i) {
-    if (cmds[cmd_i].pid != 0) {
-      if (respawn) {
-        // We're respawning crashed processes, ignore if child already running
-        continue;
-      } else {
-        printf("Error launching command %s: already launched with pid %d\n", cmds[cmd_i].bin,
-               cmds[cmd_i].pid);
-        printf("Will ignore further commands");
-        return;
-      }
+static void print_cmd(const struct OccupancyTransitionCommand *cmd) {
+  printf("\t");
+  for (size_t i = 0; cmd->args[i]; ++i) {
+    printf(" %s", cmd->args[i]);
+  }
+  printf("\n");
+}
+
+static void on_child_exit(void *usr, int pidfd, uint32_t events);
+
+// Watch the child through a pidfd. Nothing else reaps children, so the pid can't be reused before
+// this runs, even if the child already exited. Needs Linux 5.4+: pidfd_open is 5.3, but reaping
+// through waitid(P_PIDFD) is 5.4.
+static bool supervise_child(struct OccupancyTransitionCommand *cmd) {
+  cmd->pidfd = syscall(SYS_pidfd_open, cmd->pid, 0);
+  if (cmd->pidfd < 0) {
+    perror("Can't open pidfd for background task");
+    return false;
+  }
+
+  cmd->pidfd_handle =
+      event_loop_add_fd(cmd->owner->loop, cmd->pidfd, EPOLLIN, on_child_exit, cmd);
+  if (!cmd->pidfd_handle) {
+    close(cmd->pidfd);
+    cmd->pidfd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+// Reap the child, if it exited. Returns false if the child is still running.
+static bool reap_child(struct OccupancyTransitionCommand *cmd, int wait_flags, siginfo_t *info) {
+  memset(info, 0, sizeof(*info));
+  if (waitid(P_PIDFD, cmd->pidfd, info, WEXITED | wait_flags) != 0) {
+    perror("Error waiting for background task");
+  } else if (info->si_pid == 0) {
+    // WNOHANG, and the child is still running
+    return false;
+  }
+
+  event_loop_remove_fd(cmd->owner->loop, cmd->pidfd_handle);
+  close(cmd->pidfd);
+  cmd->pidfd_handle = NULL;
+  cmd->pidfd = -1;
+  cmd->pid = 0;
+  return true;
+}
+
+// Only for runs caused by a transition; restarts after a crash aren't part of that latency
+static void record_exec_latency(const struct OccupancyTransitionCommand *cmd) {
+  const uint64_t now_ns = clock_now_ns(cmd->owner->clock);
+  if (now_ns > cmd->owner->decision_ns) {
+    metrics_histogram_observe(&metrics_pipeline()->decision_to_exec_us,
+                              (now_ns - cmd->owner->decision_ns) / 1000);
+  }
+}
+
+static void record_stop_latency(uint64_t stop_ns) {
+  metrics_histogram_observe(&metrics_pipeline()->command_stop_us, stop_ns / 1000);
+}
+
+static void run_builtin(struct OccupancyTransitionCommand *cmd) {
+  cmd->should_run_now = false;
+  cmd->builtin_done = true;
+  printf("Running built-in %s, %llu ms since requested\n", cmd->bin,
+         (unsigned long long)(clock_now_ns(cmd->owner->clock) - cmd->launch_requested_ns) /
+             1000000);
+  const uint64_t run_start_ns = monotonic_now_ns();
+  switch (cmd->action) {
+  case CMD_ACTION_DISPLAY_ON:
+    display_power_set(cmd->owner->display, true);
+    break;
+  case CMD_ACTION_DISPLAY_OFF:
+    display_power_set(cmd->owner->display, false);
+    break;
+  case CMD_ACTION_EXEC:
+    break;
+  }
+  trace_span("builtin", run_start_ns, monotonic_now_ns(), cmd->action);
+}
+
+// posix_spawn shares the parent's memory until the child execs (glibc uses CLONE_VFORK), so there
+// are no page tables to copy, and it only returns once the exec is done or failed. Returns false
+// if the command couldn't be started.
+static bool spawn_command(struct OccupancyTransitionCommand *cmd) {
+  if (cmd->action != CMD_ACTION_EXEC) {
+    run_builtin(cmd);
+    return true;
+  }
+
+  cmd->should_run_now = true;
+
+  sigset_t child_mask;
+  event_loop_child_sigmask(&child_mask);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &child_mask);
+  short flags = POSIX_SPAWN_SETSIGMASK;
+  if (cmd->standby_freeze) {
+    // New process group, so that freezing also reaches anything this command spawns
+    posix_spawnattr_setpgroup(&attr, 0);
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  const uint64_t spawn_start_ns = monotonic_now_ns();
+  const int err = posix_spawnp(&cmd->pid, cmd->bin, NULL, &attr, cmd->args, environ);
+  const uint64_t spawn_end_ns = monotonic_now_ns();
+  posix_spawnattr_destroy(&attr);
+  trace_span("spawn", spawn_start_ns, spawn_end_ns, cmd->pid);
+
+  if (err != 0) {
+    fprintf(stderr, "Failed to launch background task %s: %s\n", cmd->bin, strerror(err));
+    cmd->pid = 0;
+    return false;
+  }
+
+  if (!supervise_child(cmd)) {
+    // Without a pidfd there's no way to know when this child exits
+    kill(cmd->pid, SIGKILL);
+    waitpid(cmd->pid, NULL, 0);
+    cmd->pid = 0;
+    return false;
+  }
+
+  printf("Launched %s with pid %i, spawn took %llu us, %llu ms since requested\n", cmd->bin,
+         cmd->pid, (unsigned long long)(spawn_end_ns - spawn_start_ns) / 1000,
+         (unsigned long long)(clock_now_ns(cmd->owner->clock) - cmd->launch_requested_ns) /
+             1000000);
+  return true;
+}
+
+static void launch_command(struct OccupancyTransitionCommand *cmd) {
+  if (event_loop_timer_armed(cmd->start_timer)) {
+    // Already waiting for its start delay, restarting the timer would push the launch back
+    return;
+  }
+
+  cmd->should_run_now = true;
+  cmd->launch_requested_ns = clock_now_ns(cmd->owner->clock);
+  if (cmd->start_delay_ms == 0) {
+    if (spawn_command(cmd)) {
+      record_exec_latency(cmd);
     }
+    return;
+  }
 
-    if (respawn && !cmds[cmd_i].should_restart_on_crash) {
-      // Command exited or crashed, but doesn't want to be restarted
+  // Some apps (eg Wayfire) crash if the monitor switches on or off too quickly; the parent waits
+  // for them, so commands without a delay don't pay for it
+  printf("Will launch %s in %zu ms\n", cmd->bin, cmd->start_delay_ms);
+  event_loop_timer_arm(cmd->start_timer, cmd->start_delay_ms, 0);
+}
+
+static void on_start_timer(void *usr) {
+  struct OccupancyTransitionCommand *cmd = usr;
+  if (cmd->owner->current_state != cmd->run_on_state || !cmd->should_run_now || cmd->pid != 0) {
+    // State changed during the delay
+    return;
+  }
+
+  trace_span("start_delay", cmd->launch_requested_ns, clock_now_ns(cmd->owner->clock),
+             cmd->start_delay_ms);
+  if (spawn_command(cmd)) {
+    record_exec_latency(cmd);
+  }
+}
+
+// Freeze or thaw a command's process group. The leader is only reaped by us, so its pgid can't be
+// reused while cmd->pid is set.
+static bool signal_command_group(struct OccupancyTransitionCommand *cmd, int signo) {
+  if (kill(-cmd->pid, signo) != 0) {
+    perror("Failed to signal background task process group");
+    return false;
+  }
+  return true;
+}
+
+static void thaw_command(struct OccupancyTransitionCommand *cmd) {
+  const uint64_t thaw_start_ns = monotonic_now_ns();
+  if (!signal_command_group(cmd, SIGCONT)) {
+    return;
+  }
+
+  cmd->frozen = false;
+  cmd->should_run_now = true;
+  trace_span("thaw", thaw_start_ns, monotonic_now_ns(), cmd->pid);
+  record_exec_latency(cmd);
+  printf("Thawed %s with pid %i in %llu us\n", cmd->bin, cmd->pid,
+         (unsigned long long)(monotonic_now_ns() - thaw_start_ns) / 1000);
+}
+
+static bool any_command_stopping(const struct OccupancyCommands *self) {
+  for (size_t i = 0; i < self->on_occupancy_cmds_cnt; ++i) {
+    if (self->on_occupancy_cmds[i].stopping)
+      return true;
+  }
+  for (size_t i = 0; i < self->on_vacancy_cmds_cnt; ++i) {
+    if (self->on_vacancy_cmds[i].stopping)
+      return true;
+  }
+  return false;
+}
+
+// Launch the deferred commands for the current state, unless they need to wait for the previous
+// state's commands to exit. Called on each transition and again every time a stopping command
+// exits; commands already handled by an earlier pass are left alone.
+static void launch_pending_commands(struct OccupancyCommands *self) {
+  if (!self->launch_pending) {
+    return;
+  }
+
+  if (!self->launch_before_stop_completes && any_command_stopping(self)) {
+    return;
+  }
+
+  size_t sz = self->on_occupancy_cmds_cnt;
+  struct OccupancyTransitionCommand *cmds = self->on_occupancy_cmds;
+  if (self->current_state == STATE_VACANT) {
+    sz = self->on_vacancy_cmds_cnt;
+    cmds = self->on_vacancy_cmds;
+  }
+
+  self->launch_pending = false;
+  for (size_t cmd_i = 0; cmd_i < sz; ++cmd_i) {
+    if (!cmds[cmd_i].launch_deferred) {
       continue;
     }
 
-    if (respawn && cmds[cmd_i].restart_cmd_wait_time_seconds > 0) {
-      cmds[cmd_i].restart_cmd_wait_time_seconds -= 1;
+    if (cmds[cmd_i].stopping) {
+      // Can happen if the state flips back before this command exited; launch it once it does
+      self->launch_pending = true;
       continue;
     }
 
-    if (respawn) {
-      cmds[cmd_i].restart_count++;
-      printf("Restarting (attempt #%zu) ambience app:", cmds[cmd_i].restart_count);
-    } else {
-      printf("Launching ambience app %zu:\n", cmd_i);
+    cmds[cmd_i].launch_deferred = false;
+    if (cmds[cmd_i].frozen) {
+      thaw_command(&cmds[cmd_i]);
+      continue;
     }
 
-    printf("\t");
-    for (size_t i = 0; cmds[cmd_i].args[i]; ++i) {
-      printf(" %s", cmds[cmd_i].args[i]);
+    if (cmds[cmd_i].pid != 0 || cmds[cmd_i].builtin_done) {
+      // Still running from the previous run of this state, or a built-in that already ran in it
+      continue;
     }
-    printf("\n");
 
-    if (respawn && self->crash_on_repeated_cmd_failure_count > 0 &&
-        cmds[cmd_i].restart_count > self->crash_on_repeated_cmd_failure_count) {
-      printf("Restart attempts (%zu) over retry limit, something is broken and will crash now\n",
-             cmds[cmd_i].restart_count);
-      abort();
-    }
+    printf("Launching ambience app %zu:\n", cmd_i);
+    print_cmd(&cmds[cmd_i]);
+    launch_command(&cmds[cmd_i]);
+  }
+}
 
-    cmds[cmd_i].pid = fork();
-    cmds[cmd_i].should_run_now = true;
-    if (cmds[cmd_i].pid == 0) {
-      // Wayfire crashes if the monitor switches on or off too quickly, so we give it a bit of time
-      printf("Sleep 1 before execv\n");
-      sleep(1);
-      execvp(cmds[cmd_i].bin, cmds[cmd_i].args);
-      perror("Background task failed to execve");
-      abort();
-    } else if (cmds[cmd_i].pid < 0) {
-      perror("Failed to launch background task");
-      cmds[cmd_i].pid = 0;
-    } else {
-      cmds[cmd_i].restart_cmd_wait_time_seconds = self->restart_cmd_wait_time_seconds;
+static void on_restart_timer(void *usr) {
+  struct OccupancyTransitionCommand *cmd = usr;
+  struct OccupancyCommands *self = cmd->owner;
+  if (self->current_state != cmd->run_on_state || !cmd->should_run_now || cmd->pid != 0) {
+    // State changed during the cooldown
+    return;
+  }
+
+  cmd->restart_count++;
+  trace_instant("restart", clock_now_ns(self->clock), cmd->restart_count);
+  printf("Restarting (attempt #%zu) ambience app:", cmd->restart_count);
+  print_cmd(cmd);
+
+  if (self->crash_on_repeated_cmd_failure_count > 0 &&
+      cmd->restart_count > self->crash_on_repeated_cmd_failure_count) {
+    printf("Restart attempts (%zu) over retry limit, something is broken and will crash now\n",
+           cmd->restart_count);
+    abort();
+  }
+
+  cmd->launch_requested_ns = clock_now_ns(cmd->owner->clock);
+  spawn_command(cmd);
+}
+
+// Ask a command to exit, without waiting for it
+static void begin_stop(struct OccupancyTransitionCommand *cmd) {
+  printf("Stopping:");
+  print_cmd(cmd);
+
+  cmd->stopping = true;
+  cmd->stop_start_ns = clock_now_ns(cmd->owner->clock);
+  if (cmd->frozen) {
+    // A stopped process won't act on anything but SIGKILL until it's continued
+    signal_command_group(cmd, SIGCONT);
+    cmd->frozen = false;
+  }
+
+  if (syscall(SYS_pidfd_send_signal, cmd->pidfd, cmd->stop_signal, NULL, 0) != 0) {
+    perror("Failed to stop background task, try to kill");
+    if (syscall(SYS_pidfd_send_signal, cmd->pidfd, SIGKILL, NULL, 0) != 0) {
+      // If this fails, the command will stay in stopping state, so a new one won't be launched
+      // Probably better to avoid launching new ambience apps, instead of leaking them
+      perror("Failed to kill background task");
+      return;
     }
   }
+
+  event_loop_timer_arm(cmd->stop_timer, cmd->stop_timeout_ms, 0);
+}
+
+static void on_stop_timer(void *usr) {
+  struct OccupancyTransitionCommand *cmd = usr;
+  if (!cmd->stopping || cmd->pid == 0) {
+    return;
+  }
+
+  printf("Command %s with pid %i still running %zu ms after stop request, killing\n", cmd->bin,
+         cmd->pid, cmd->stop_timeout_ms);
+  if (syscall(SYS_pidfd_send_signal, cmd->pidfd, SIGKILL, NULL, 0) != 0) {
+    perror("Failed to kill background task");
+  }
 }
 
-static void stop_commands(size_t sz, struct OccupancyTransitionCommand *cmds) {
+// Stop (or, with allow_standby, freeze) every command in cmds
+static void stop_commands(size_t sz, struct OccupancyTransitionCommand *cmds, bool allow_standby) {
   for (size_t cmd_i = 0; cmd_i < sz; ++cmd_i) {
-    if (!cmds[cmd_i].should_run_now && cmds[cmd_i].pid == 0) {
+    cmds[cmd_i].launch_deferred = false;
+    cmds[cmd_i].builtin_done = false;
+    const bool launch_delayed = event_loop_timer_armed(cmds[cmd_i].start_timer);
+    event_loop_timer_disarm(cmds[cmd_i].restart_timer);
+    event_loop_timer_disarm(cmds[cmd_i].start_timer);
+
+    if (cmds[cmd_i].stopping) {
       continue;
     }
 
-    if (cmds[cmd_i].should_run_now && cmds[cmd_i].pid == 0) {
-      printf("Warning: try stopping command %s, but is not running\n", cmds[cmd_i].bin);
+    if (launch_delayed && cmds[cmd_i].pid == 0) {
+      printf("Cancel delayed launch of %s\n", cmds[cmd_i].bin);
+      cmds[cmd_i].should_run_now = false;
       continue;
     }
 
-    cmds[cmd_i].should_run_now = false;
-
-    printf("Stopping:");
-    for (size_t i = 0; cmds[cmd_i].args[i]; ++i) {
-      printf(" %s", cmds[cmd_i].args[i]);
+    if (!cmds[cmd_i].should_run_now && cmds[cmd_i].pid == 0) {
+      continue;
     }
-    printf("\n");
-
-    if (kill(cmds[cmd_i].pid, SIGINT) != 0) {
-      perror("Failed to stop background task, try to kill");
-      if (kill(cmds[cmd_i].pid, SIGKILL) != 0) {
-        perror("Failed to kill background task");
-        // If this fails, pid will be non zero, so a new one won't be launched
-        // Probably better to avoid launching new ambience apps, instead of leaking them
-        return;
+
+    if (cmds[cmd_i].frozen) {
+      if (!allow_standby) {
+        begin_stop(&cmds[cmd_i]);
       }
+      continue;
     }
 
-    int wstatus;
-    waitpid(cmds[cmd_i].pid, &wstatus, 0);
-    cmds[cmd_i].pid = 0;
+    if (cmds[cmd_i].should_run_now && cmds[cmd_i].pid == 0) {
+      printf("Warning: try stopping command %s, but is not running\n", cmds[cmd_i].bin);
+      cmds[cmd_i].should_run_now = false;
+      continue;
+    }
 
-    if (wstatus != 0) {
-      printf("ERROR: Background task %s exit with status %d\n", cmds[cmd_i].bin, wstatus);
+    cmds[cmd_i].should_run_now = false;
+    if (allow_standby && cmds[cmd_i].standby_freeze &&
+        signal_command_group(&cmds[cmd_i], SIGSTOP)) {
+      printf("Frozen:");
+      print_cmd(&cmds[cmd_i]);
+      cmds[cmd_i].frozen = true;
+      continue;
     }
+
+    begin_stop(&cmds[cmd_i]);
   }
 }
 
-bool sighandler_search_exit_child(size_t sz, struct OccupancyTransitionCommand *cmds, int pid,
-                                  int wstatus) {
-  for (size_t i = 0; i < sz; ++i) {
-    if (pid == cmds[i].pid) {
-      if (cmds[i].should_run_now) {
-        if (wstatus == 0) {
-          printf("Command %s with pid %i exit normally\n", cmds[i].bin, pid);
-          cmds[i].should_run_now = false;
-        } else {
-          printf("CRASH: Command %s with pid %i exit, ret %i\n", cmds[i].bin, pid, wstatus);
-          if (cmds[i].should_restart_on_crash) {
-            printf("Will restart in %zu seconds...\n", cmds[i].restart_cmd_wait_time_seconds);
-          } else {
-            printf("This app WON'T restart.\n");
-          }
-        }
-      } else {
-        printf("Command %s with pid %i exit, ret %i\n", cmds[i].bin, pid, wstatus);
+// Shutdown path, the event loop won't run anymore: signal everything at once, then wait for each
+// command up to its own stop deadline. Total wait is bounded by the slowest timeout, not the sum.
+static void stop_all_commands_blocking(struct OccupancyCommands *self) {
+  struct OccupancyTransitionCommand *lists[] = {self->on_occupancy_cmds, self->on_vacancy_cmds};
+  const size_t list_szs[] = {self->on_occupancy_cmds_cnt, self->on_vacancy_cmds_cnt};
+
+  for (size_t l = 0; l < 2; ++l) {
+    stop_commands(list_szs[l], lists[l], false);
+  }
+
+  for (size_t l = 0; l < 2; ++l) {
+    for (size_t cmd_i = 0; cmd_i < list_szs[l]; ++cmd_i) {
+      struct OccupancyTransitionCommand *cmd = &lists[l][cmd_i];
+      if (cmd->pid == 0) {
+        continue;
       }
-      cmds[i].pid = 0;
-      return true;
+
+      const uint64_t deadline_ns = cmd->stop_start_ns + cmd->stop_timeout_ms * 1000000ull;
+      const uint64_t now_ns = clock_now_ns(self->clock);
+      const int wait_ms =
+          deadline_ns > now_ns ? (int)((deadline_ns - now_ns + 999999) / 1000000) : 0;
+      struct pollfd pfd = {.fd = cmd->pidfd, .events = POLLIN};
+      if (poll(&pfd, 1, wait_ms) == 0) {
+        on_stop_timer(cmd);
+      }
+
+      const pid_t pid = cmd->pid;
+      siginfo_t info;
+      reap_child(cmd, 0, &info);
+      cmd->stopping = false;
+      const uint64_t stop_ns = clock_now_ns(self->clock) - cmd->stop_start_ns;
+      record_stop_latency(stop_ns);
+      trace_span("command_stop", cmd->stop_start_ns, cmd->stop_start_ns + stop_ns, pid);
+      printf("Command %s with pid %i stopped in %llu ms, ret %i\n", cmd->bin, pid,
+             (unsigned long long)stop_ns / 1000000, info.si_status);
     }
   }
-  return false;
 }
 
-void sighandler_on_child_cmd_exit() {
-  while (true) {
-    int wstatus;
-    int exitedpid = waitpid(-1, &wstatus, WNOHANG);
-    if (exitedpid == 0) {
-      break;
-    } else if (exitedpid < 0 && errno == 10) {
-      // No more pids
-      break;
-    } else if (exitedpid < 0) {
-      perror("Error waitpid on signal handler");
-      break;
-    }
+static void on_child_exit(void *usr, int pidfd, uint32_t events) {
+  struct OccupancyTransitionCommand *cmd = usr;
+  struct OccupancyCommands *self = cmd->owner;
+  const pid_t pid = cmd->pid;
+  siginfo_t info;
+  if (!reap_child(cmd, WNOHANG, &info)) {
+    return;
+  }
 
-    bool found =
-        sighandler_search_exit_child(g_sigchld_handler->on_occupancy_cmds_cnt,
-                                     g_sigchld_handler->on_occupancy_cmds, exitedpid, wstatus);
-    if (!found) {
-      sighandler_search_exit_child(g_sigchld_handler->on_vacancy_cmds_cnt,
-                                   g_sigchld_handler->on_vacancy_cmds, exitedpid, wstatus);
-    }
-    if (!found) {
-      printf("Error: received SIGCHLD for unknown child with pid %i\n", exitedpid);
+  // si_status is the exit code, or the signal that killed the child
+  const int ret = info.si_status;
+  if (cmd->stopping) {
+    cmd->stopping = false;
+    event_loop_timer_disarm(cmd->stop_timer);
+    const uint64_t stop_ns = clock_now_ns(self->clock) - cmd->stop_start_ns;
+    record_stop_latency(stop_ns);
+    trace_span("command_stop", cmd->stop_start_ns, cmd->stop_start_ns + stop_ns, pid);
+    printf("Command %s with pid %i stopped in %llu ms, ret %i\n", cmd->bin, pid,
+           (unsigned long long)stop_ns / 1000000, ret);
+    launch_pending_commands(self);
+  } else if (cmd->frozen) {
+    printf("Frozen command %s with pid %i exit, ret %i. Will relaunch instead of thaw\n", cmd->bin,
+           pid, ret);
+    cmd->frozen = false;
+  } else if (!cmd->should_run_now) {
+    printf("Command %s with pid %i exit, ret %i\n", cmd->bin, pid, ret);
+  } else if (info.si_code == CLD_EXITED && ret == 0) {
+    printf("Command %s with pid %i exit normally\n", cmd->bin, pid);
+    cmd->should_run_now = false;
+  } else {
+    printf("CRASH: Command %s with pid %i exit, ret %i\n", cmd->bin, pid, ret);
+    cmd->crashes++;
+    if (cmd->should_restart_on_crash) {
+      printf("Will restart in %zu seconds...\n", self->restart_cmd_wait_time_seconds);
+      event_loop_timer_arm(cmd->restart_timer, 1000 * self->restart_cmd_wait_time_seconds, 0);
+    } else {
+      printf("This app WON'T restart.\n");
+      cmd->should_run_now = false;
     }
   }
 }
 
-struct OccupancyCommands *occupancy_commands_init(const struct PiPresenceMonConfig *cfg) {
-  if (g_sigchld_handler != NULL) {
-    fprintf(stderr, "Handler for occupancy command exit already set. Are you creating two "
-                    "OccupancyCommands object?\n");
-    return NULL;
-  }
-
+struct OccupancyCommands *occupancy_commands_init(const struct PiPresenceMonConfig *cfg,
+                                                  struct EventLoop *loop) {
   struct OccupancyCommands *self = malloc(sizeof(struct OccupancyCommands));
   if (!self) {
     fprintf(stderr, "occupancy_commands_init bad alloc\n");
     goto ERR;
   }
 
+  self->loop = loop;
+  self->clock = event_loop_clock(loop);
   self->current_state = STATE_INVALID;
   self->cfg = cfg;
   self->restart_cmd_wait_time_seconds = cfg->restart_cmd_wait_time_seconds;
   self->crash_on_repeated_cmd_failure_count = cfg->crash_on_repeated_cmd_failure_count;
+  self->launch_before_stop_completes = cfg->launch_before_stop_completes;
+  self->launch_pending = false;
+  self->decision_ns = 0;
+  self->display = NULL;
 
   self->on_occupancy_cmds_cnt = cfg->on_occupancy_sz;
   self->on_occupancy_cmds =
@@ -296,7 +680,8 @@ struct OccupancyCommands *occupancy_commands_init(const struct PiPresenceMonConf
   printf("OccupancyCommands starting. On occupancy, will:\n");
   for (size_t i = 0; i < cfg->on_occupancy_sz; ++i) {
     struct OccupancyTransitionCommand *cmd_cfg = &self->on_occupancy_cmds[i];
-    const bool ok = parse_transition_cmd_from_cfg(&cfg->on_occupancy[i], cmd_cfg);
+    const bool ok =
+        parse_transition_cmd_from_cfg(self, STATE_OCCUPIED, &cfg->on_occupancy[i], cmd_cfg);
     if (!ok) {
       goto ERR;
     }
@@ -306,20 +691,31 @@ struct OccupancyCommands *occupancy_commands_init(const struct PiPresenceMonConf
   printf("On vacancy, will:\n");
   for (size_t i = 0; i < cfg->on_vacancy_sz; ++i) {
     struct OccupancyTransitionCommand *cmd_cfg = &self->on_vacancy_cmds[i];
-    const bool ok = parse_transition_cmd_from_cfg(&cfg->on_vacancy[i], cmd_cfg);
+    const bool ok =
+        parse_transition_cmd_from_cfg(self, STATE_VACANT, &cfg->on_vacancy[i], cmd_cfg);
     if (!ok) {
       goto ERR;
     }
     printf(" * exec `%s`\n", cmd_cfg->cmd);
   }
 
+  bool needs_display = false;
+  for (size_t i = 0; i < cfg->on_occupancy_sz; ++i) {
+    needs_display |= cfg->on_occupancy[i].action != CMD_ACTION_EXEC;
+  }
+  for (size_t i = 0; i < cfg->on_vacancy_sz; ++i) {
+    needs_display |= cfg->on_vacancy[i].action != CMD_ACTION_EXEC;
+  }
+  if (needs_display) {
+    self->display = display_power_init(cfg);
+    if (!self->display) {
+      goto ERR;
+    }
+  }
+
   // Nothing else in here should access the config struct
   self->cfg = NULL;
 
-  // Set up sighandler
-  g_sigchld_handler = self;
-  signal(SIGCHLD, sighandler_on_child_cmd_exit);
-
   return self;
 ERR:
   occupancy_commands_free(self);
@@ -332,14 +728,16 @@ void occupancy_commands_free(struct OccupancyCommands *self) {
   }
 
   if (self->current_state != STATE_INVALID) {
-    stop_commands(self->on_occupancy_cmds_cnt, self->on_occupancy_cmds);
-    stop_commands(self->on_vacancy_cmds_cnt, self->on_vacancy_cmds);
+    stop_all_commands_blocking(self);
   }
 
   if (self->on_occupancy_cmds) {
     for (size_t i = 0; i < self->on_occupancy_cmds_cnt; ++i) {
       free(self->on_occupancy_cmds[i].cmd);
       free(self->on_occupancy_cmds[i].args);
+      event_loop_timer_free(self->loop, self->on_occupancy_cmds[i].restart_timer);
+      event_loop_timer_free(self->loop, self->on_occupancy_cmds[i].stop_timer);
+      event_loop_timer_free(self->loop, self->on_occupancy_cmds[i].start_timer);
     }
     free(self->on_occupancy_cmds);
   }
@@ -348,14 +746,27 @@ void occupancy_commands_free(struct OccupancyCommands *self) {
     for (size_t i = 0; i < self->on_vacancy_cmds_cnt; ++i) {
       free(self->on_vacancy_cmds[i].cmd);
       free(self->on_vacancy_cmds[i].args);
+      event_loop_timer_free(self->loop, self->on_vacancy_cmds[i].restart_timer);
+      event_loop_timer_free(self->loop, self->on_vacancy_cmds[i].stop_timer);
+      event_loop_timer_free(self->loop, self->on_vacancy_cmds[i].start_timer);
     }
     free(self->on_vacancy_cmds);
   }
 
+  display_power_free(self->display);
   free(self);
 }
 
-void occupancy_commands_on_occupancy(struct OccupancyCommands *self) {
+// Mark every command of the new state for launch_pending_commands
+static void defer_launch(struct OccupancyCommands *self, size_t sz,
+                         struct OccupancyTransitionCommand *cmds) {
+  for (size_t cmd_i = 0; cmd_i < sz; ++cmd_i) {
+    cmds[cmd_i].launch_deferred = true;
+  }
+  self->launch_pending = true;
+}
+
+void occupancy_commands_on_occupancy(struct OccupancyCommands *self, uint64_t decision_ns) {
   if (self->current_state == STATE_OCCUPIED) {
     printf("Occupancy commands error: tried to set state to OCCUPIED while already in OCCUPIED "
            "state\n");
@@ -363,11 +774,15 @@ void occupancy_commands_on_occupancy(struct OccupancyCommands *self) {
   }
 
   self->current_state = STATE_OCCUPIED;
-  stop_commands(self->on_vacancy_cmds_cnt, self->on_vacancy_cmds);
-  launch_commands(self->on_occupancy_cmds_cnt, self->on_occupancy_cmds, self, false);
+  self->decision_ns = decision_ns;
+  const uint64_t stop_start_ns = monotonic_now_ns();
+  stop_commands(self->on_vacancy_cmds_cnt, self->on_vacancy_cmds, true);
+  trace_span("stop_commands", stop_start_ns, monotonic_now_ns(), STATE_VACANT);
+  defer_launch(self, self->on_occupancy_cmds_cnt, self->on_occupancy_cmds);
+  launch_pending_commands(self);
 }
 
-void occupancy_commands_on_vacancy(struct OccupancyCommands *self) {
+void occupancy_commands_on_vacancy(struct OccupancyCommands *self, uint64_t decision_ns) {
   if (self->current_state == STATE_VACANT) {
     printf(
         "Occupancy commands error: tried to set state to VACANT while already in VACANT state\n");
@@ -375,14 +790,35 @@ void occupancy_commands_on_vacancy(struct OccupancyCommands *self) {
   }
 
   self->current_state = STATE_VACANT;
-  stop_commands(self->on_occupancy_cmds_cnt, self->on_occupancy_cmds);
-  launch_commands(self->on_vacancy_cmds_cnt, self->on_vacancy_cmds, self, false);
+  self->decision_ns = decision_ns;
+  const uint64_t stop_start_ns = monotonic_now_ns();
+  stop_commands(self->on_occupancy_cmds_cnt, self->on_occupancy_cmds, true);
+  trace_span("stop_commands", stop_start_ns, monotonic_now_ns(), STATE_OCCUPIED);
+  defer_launch(self, self->on_vacancy_cmds_cnt, self->on_vacancy_cmds);
+  launch_pending_commands(self);
 }
 
-void occupancy_commands_tick(struct OccupancyCommands *self) {
-  if (self->current_state == STATE_OCCUPIED) {
-    launch_commands(self->on_occupancy_cmds_cnt, self->on_occupancy_cmds, self, true);
-  } else if (self->current_state == STATE_VACANT) {
-    launch_commands(self->on_vacancy_cmds_cnt, self->on_vacancy_cmds, self, true);
+static void write_command_metrics(struct MetricsWriter *w, const char *name, const char *state,
+                                  size_t sz, const struct OccupancyTransitionCommand *cmds,
+                                  bool crashes) {
+  for (size_t i = 0; i < sz; ++i) {
+    metrics_printf(w, "%s{state=\"%s\",index=\"%zu\",cmd=\"", name, state, i);
+    metrics_write_label_value(w, cmds[i].bin);
+    metrics_printf(w, "\"} %zu\n", crashes ? cmds[i].crashes : cmds[i].restart_count);
+  }
+}
+
+void occupancy_commands_write_metrics(const struct OccupancyCommands *self,
+                                      struct MetricsWriter *w) {
+  static const char *names[] = {"pipresencemon_command_restarts_total",
+                                "pipresencemon_command_crashes_total"};
+  static const char *helps[] = {"Relaunches of a command after it crashed",
+                                "Unexpected exits of a command while its state was current"};
+  for (size_t m = 0; m < 2; ++m) {
+    metrics_write_help(w, names[m], "counter", helps[m]);
+    write_command_metrics(w, names[m], "occupied", self->on_occupancy_cmds_cnt,
+                          self->on_occupancy_cmds, m == 1);
+    write_command_metrics(w, names[m], "vacant", self->on_vacancy_cmds_cnt,
+                          self->on_vacancy_cmds, m == 1);
   }
 }
@@ -1,18 +1,25 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
+struct EventLoop;
+struct MetricsWriter;
 struct PiPresenceMonConfig;
 struct OccupancyCommands;
 
-struct OccupancyCommands *occupancy_commands_init(const struct PiPresenceMonConfig *cfg);
+// Child exits and restart cooldowns are handled in loop
+struct OccupancyCommands *occupancy_commands_init(const struct PiPresenceMonConfig *cfg,
+                                                  struct EventLoop *loop);
 void occupancy_commands_free(struct OccupancyCommands *self);
 
-// Call when occupancy is detected
-void occupancy_commands_on_occupancy(struct OccupancyCommands *self);
+// Call when occupancy is detected. decision_ns is when that was decided (on the loop's clock), to
+// measure how long until the state's commands run.
+void occupancy_commands_on_occupancy(struct OccupancyCommands *self, uint64_t decision_ns);
 
 // Call when vacancy detected
-void occupancy_commands_on_vacancy(struct OccupancyCommands *self);
+void occupancy_commands_on_vacancy(struct OccupancyCommands *self, uint64_t decision_ns);
 
-// Call periodically; used to respawn crashed commands
-void occupancy_commands_tick(struct OccupancyCommands *self);
+// Per command restart and crash counters. Call from the loop's thread.
+void occupancy_commands_write_metrics(const struct OccupancyCommands *self,
+                                      struct MetricsWriter *w);
@@ -0,0 +1,44 @@
+#include "occupancy_detector.h"
+
+#include <string.h>
+
+void occupancy_detector_init(struct OccupancyDetector *d, const struct PiPresenceMonConfig *cfg,
+                             size_t window_sz, bool start_active) {
+  memset(d, 0, sizeof(*d));
+  d->kind = cfg->occupancy_detector;
+  d->active = start_active;
+  d->score_changed = true;
+  d->rise_pct = cfg->rising_edge_occupancy_threshold_pct;
+  d->fall_pct = cfg->falling_edge_vacancy_threshold_pct;
+
+  // alpha = 2/(N+1) gives the EWMA the same centre of mass as an N sample window
+  d->ewma_level = start_active ? OCCUPANCY_DETECTOR_EWMA_ONE : 0;
+  d->ewma_alpha = 2 * OCCUPANCY_DETECTOR_EWMA_ONE / (window_sz + 1);
+  d->ewma_rise = cfg->rising_edge_occupancy_threshold_pct * OCCUPANCY_DETECTOR_EWMA_ONE / 100;
+  d->ewma_fall = cfg->falling_edge_vacancy_threshold_pct * OCCUPANCY_DETECTOR_EWMA_ONE / 100;
+
+  // Each state is expected to last about a window
+  const float p_occupied_active = cfg->hmm_active_when_occupied_pct / 100.f;
+  const float p_vacant_active = cfg->hmm_active_when_vacant_pct / 100.f;
+  d->hmm_p_occupied = start_active ? 1.f - 1e-6f : 1e-6f;
+  d->hmm_p_enter = 1.f / window_sz;
+  d->hmm_p_leave = 1.f / window_sz;
+  d->hmm_emit_occupied[false] = 1.f - p_occupied_active;
+  d->hmm_emit_occupied[true] = p_occupied_active;
+  d->hmm_emit_vacant[false] = 1.f - p_vacant_active;
+  d->hmm_emit_vacant[true] = p_vacant_active;
+  d->hmm_rise = cfg->rising_edge_occupancy_threshold_pct / 100.f;
+  d->hmm_fall = cfg->falling_edge_vacancy_threshold_pct / 100.f;
+}
+
+size_t occupancy_detector_score_pct(const struct OccupancyDetector *d, size_t window_active_pct) {
+  switch (d->kind) {
+  case DETECTOR_WINDOW:
+    return window_active_pct;
+  case DETECTOR_EWMA:
+    return 100 * (int64_t)d->ewma_level / OCCUPANCY_DETECTOR_EWMA_ONE;
+  case DETECTOR_HMM:
+    return (size_t)(100 * d->hmm_p_occupied);
+  }
+  return 0;
+}
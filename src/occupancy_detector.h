@@ -0,0 +1,136 @@
+#pragma once
+
+#include "cfg.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed point 1.0 for the EWMA. 31 bits keep the products below (both factors at most 1.0) within
+// 64 bits, and leave enough fraction that on the longest supported window the step only rounds to
+// 0 within 0.05% of the target.
+#define OCCUPANCY_DETECTOR_EWMA_ONE ((int64_t)1 << 31)
+
+// Decides if a sensor is currently active (before any vacancy timeout) from its samples. Every
+// detector computes a score and applies the configured rising/falling thresholds to it, as
+// hysteresis. Not thread safe: meant to be owned by a sampler thread.
+struct OccupancyDetector {
+  enum OccupancyDetectorKind kind;
+  bool active;
+  // Set if the last update changed the score; once it stops changing, only a different sample can
+  // change the output
+  bool score_changed;
+
+  // DETECTOR_WINDOW: score is the active % of a window of samples, kept by the caller
+  size_t rise_pct;
+  size_t fall_pct;
+
+  // DETECTOR_EWMA: level and thresholds in fixed point, OCCUPANCY_DETECTOR_EWMA_ONE is 100% active
+  uint32_t ewma_level;
+  uint32_t ewma_alpha;
+  uint32_t ewma_rise;
+  uint32_t ewma_fall;
+
+  // DETECTOR_HMM: posterior probability of occupancy, and the model. emit_*[s] is the likelihood
+  // of reading sample s in each state.
+  float hmm_p_occupied;
+  float hmm_p_enter;
+  float hmm_p_leave;
+  float hmm_emit_occupied[2];
+  float hmm_emit_vacant[2];
+  float hmm_rise;
+  float hmm_fall;
+};
+
+// window_sz is the size of the sensor history, in samples. It sets the time constant of the EWMA
+// and the expected dwell time of the HMM states.
+void occupancy_detector_init(struct OccupancyDetector *d, const struct PiPresenceMonConfig *cfg,
+                             size_t window_sz, bool start_active);
+
+// Score of the detector, in %. window_active_pct is only used by DETECTOR_WINDOW.
+size_t occupancy_detector_score_pct(const struct OccupancyDetector *d, size_t window_active_pct);
+
+// Feed a new sample, returns the new output. `kind` must be d->kind: it's a parameter so that
+// callers can specialize their sampling loop for each detector, with a constant kind this inlines
+// to the code of a single detector with no dispatch.
+static inline __attribute__((always_inline)) bool
+occupancy_detector_update(struct OccupancyDetector *d, const enum OccupancyDetectorKind kind,
+                          bool sample, size_t window_active_pct) {
+  switch (kind) {
+  case DETECTOR_WINDOW:
+    d->score_changed = false;
+    if (d->active && window_active_pct < d->fall_pct) {
+      d->active = false;
+    } else if (!d->active && window_active_pct > d->rise_pct) {
+      d->active = true;
+    }
+    break;
+
+  case DETECTOR_EWMA: {
+    // level += alpha * (target - level). Once the step rounds to 0 the level stays where it is, a
+    // hair away from the target, rather than jumping to it in one sample
+    const int64_t target = sample ? OCCUPANCY_DETECTOR_EWMA_ONE : 0;
+    const int64_t diff = target - (int64_t)d->ewma_level;
+    const int64_t step = (diff * d->ewma_alpha) / OCCUPANCY_DETECTOR_EWMA_ONE;
+    d->ewma_level += step;
+    d->score_changed = (step != 0);
+    if (d->active && d->ewma_level < d->ewma_fall) {
+      d->active = false;
+    } else if (!d->active && d->ewma_level > d->ewma_rise) {
+      d->active = true;
+    }
+    break;
+  }
+
+  case DETECTOR_HMM: {
+    // Forward algorithm, one step: predict with the transition model, then weight by how likely
+    // this sample is in each state
+    const float p = d->hmm_p_occupied;
+    const float predicted = p * (1.f - d->hmm_p_leave) + (1.f - p) * d->hmm_p_enter;
+    const float occupied = predicted * d->hmm_emit_occupied[sample];
+    const float vacant = (1.f - predicted) * d->hmm_emit_vacant[sample];
+    float posterior = occupied / (occupied + vacant);
+    // Keep away from 0 and 1, where float rounding would make the state stick
+    posterior = posterior < 1e-6f ? 1e-6f : posterior;
+    posterior = posterior > 1.f - 1e-6f ? 1.f - 1e-6f : posterior;
+    const float delta = posterior - p;
+    d->score_changed = (delta > 1e-6f || delta < -1e-6f);
+    d->hmm_p_occupied = posterior;
+    if (d->active && posterior < d->hmm_fall) {
+      d->active = false;
+    } else if (!d->active && posterior > d->hmm_rise) {
+      d->active = true;
+    }
+    break;
+  }
+  }
+
+  return d->active;
+}
+
+// Delays the falling edge of a detector: vacancy is only reported once the detector output has
+// been inactive for timeout_ns. Time comes from the caller, so this also runs on a virtual clock.
+struct VacancyTimeout {
+  uint64_t timeout_ns;
+  uint64_t deadline_ns;
+  bool active;
+};
+
+static inline void vacancy_timeout_init(struct VacancyTimeout *t, uint64_t timeout_ns,
+                                        uint64_t now_ns, bool start_active) {
+  t->timeout_ns = timeout_ns;
+  t->deadline_ns = now_ns + timeout_ns;
+  t->active = start_active;
+}
+
+// Returns the reported state
+static inline bool vacancy_timeout_update(struct VacancyTimeout *t, bool detected,
+                                          uint64_t now_ns) {
+  if (detected) {
+    t->deadline_ns = now_ns + t->timeout_ns;
+    t->active = true;
+  } else if (t->active && now_ns >= t->deadline_ns) {
+    t->active = false;
+  }
+  return t->active;
+}
@@ -0,0 +1,122 @@
+#include "periodic_timer.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+uint64_t monotonic_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static struct timespec ns_to_timespec(uint64_t ns) {
+  struct timespec ts = {.tv_sec = ns / NSEC_PER_SEC, .tv_nsec = ns % NSEC_PER_SEC};
+  return ts;
+}
+
+bool periodic_timer_init(struct PeriodicTimer *t, size_t period_ms) {
+  return periodic_timer_init_ns(t, period_ms * 1000000ull);
+}
+
+bool periodic_timer_init_ns(struct PeriodicTimer *t, uint64_t period_ns) {
+  memset(t, 0, sizeof(*t));
+  if (period_ns == 0) {
+    fprintf(stderr, "PeriodicTimer needs a non-zero period\n");
+    return false;
+  }
+
+  t->period_ns = period_ns;
+  t->armed = false;
+  t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (t->fd < 0) {
+    perror("PeriodicTimer can't create timerfd");
+    return false;
+  }
+
+  return true;
+}
+
+void periodic_timer_free(struct PeriodicTimer *t) {
+  if (t->fd >= 0) {
+    close(t->fd);
+  }
+  t->fd = -1;
+}
+
+bool periodic_timer_arm(struct PeriodicTimer *t) {
+  const uint64_t now = monotonic_now_ns();
+  t->next_deadline_ns = now + t->period_ns;
+  t->last_wakeup_ns = now;
+
+  struct itimerspec spec = {
+      .it_interval = ns_to_timespec(t->period_ns),
+      .it_value = ns_to_timespec(t->next_deadline_ns),
+  };
+  if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+    perror("PeriodicTimer can't arm timerfd");
+    return false;
+  }
+
+  t->armed = true;
+  return true;
+}
+
+void periodic_timer_disarm(struct PeriodicTimer *t) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (timerfd_settime(t->fd, 0, &spec, NULL) != 0) {
+    perror("PeriodicTimer can't disarm timerfd");
+  }
+  t->armed = false;
+}
+
+int periodic_timer_fd(const struct PeriodicTimer *t) { return t->fd; }
+
+uint64_t periodic_timer_wait(struct PeriodicTimer *t) {
+  uint64_t expirations = 0;
+  while (read(t->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    if (errno != EINTR) {
+      logger_log(LOG_LEVEL_ERROR, "PeriodicTimer can't read timerfd: %s", strerror(errno));
+      return 0;
+    }
+  }
+
+  const uint64_t now = monotonic_now_ns();
+  // The last expiration happened (expirations - 1) periods after the one we were waiting for
+  const uint64_t deadline = t->next_deadline_ns + (expirations - 1) * t->period_ns;
+  const uint64_t jitter = (now > deadline) ? now - deadline : 0;
+
+  t->stats.ticks++;
+  t->stats.missed_ticks += expirations - 1;
+  t->stats.last_period_ns = now - t->last_wakeup_ns;
+  t->stats.total_jitter_ns += jitter;
+  if (jitter > t->stats.max_jitter_ns) {
+    t->stats.max_jitter_ns = jitter;
+  }
+  if (t->jitter_us) {
+    metrics_histogram_observe(t->jitter_us, jitter / 1000);
+  }
+
+  t->next_deadline_ns = deadline + t->period_ns;
+  t->last_wakeup_ns = now;
+  return expirations;
+}
+
+void periodic_timer_print_stats(const struct PeriodicTimer *t, const char *name) {
+  const struct SamplingStats *s = &t->stats;
+  const uint64_t avg_jitter_ns = s->ticks ? s->total_jitter_ns / s->ticks : 0;
+  logger_log(LOG_LEVEL_INFO,
+             "%s sampling stats: period %llu usecs, %zu ticks, %zu missed, last period %llu usecs, "
+             "jitter avg %llu usecs max %llu usecs",
+             name, (unsigned long long)t->period_ns / 1000, s->ticks, s->missed_ticks,
+             (unsigned long long)s->last_period_ns / 1000, (unsigned long long)avg_jitter_ns / 1000,
+             (unsigned long long)s->max_jitter_ns / 1000);
+}
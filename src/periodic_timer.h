@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Drift-free periodic wakeups, backed by a timerfd. Expirations are scheduled on an absolute grid
+// (start + N * period), so the time spent handling a tick doesn't delay the next one.
+
+struct MetricsHistogram;
+
+struct SamplingStats {
+  // Ticks handled, and ticks that expired while the previous one was still being handled
+  size_t ticks;
+  size_t missed_ticks;
+  // Time between the last two wakeups
+  uint64_t last_period_ns;
+  // Lateness of wakeups relative to their scheduled deadline
+  uint64_t max_jitter_ns;
+  uint64_t total_jitter_ns;
+};
+
+struct PeriodicTimer {
+  int fd;
+  uint64_t period_ns;
+  bool armed;
+  // Scheduled time of the next expiration, and time of the last wakeup
+  uint64_t next_deadline_ns;
+  uint64_t last_wakeup_ns;
+  struct SamplingStats stats;
+  // Optional, also record the jitter of each wakeup here
+  struct MetricsHistogram *jitter_us;
+};
+
+uint64_t monotonic_now_ns();
+
+bool periodic_timer_init(struct PeriodicTimer *t, size_t period_ms);
+bool periodic_timer_init_ns(struct PeriodicTimer *t, uint64_t period_ns);
+void periodic_timer_free(struct PeriodicTimer *t);
+
+// Start ticking, first expiration one period from now
+bool periodic_timer_arm(struct PeriodicTimer *t);
+void periodic_timer_disarm(struct PeriodicTimer *t);
+
+// fd that becomes readable when the timer expires, to use with poll()
+int periodic_timer_fd(const struct PeriodicTimer *t);
+
+// Block until the next expiration (or return immediately, if the fd is readable). Returns the
+// number of periods elapsed since the last call, which is more than 1 if ticks were missed, or 0
+// on error.
+uint64_t periodic_timer_wait(struct PeriodicTimer *t);
+
+void periodic_timer_print_stats(const struct PeriodicTimer *t, const char *name);
@@ -1,18 +1,402 @@
 #include "cfg.h"
+#include "clock.h"
+#include "control_server.h"
+#include "event_loop.h"
+#include "gpio_multi_pin_monitor.h"
+#include "gpio_scope.h"
 #include "gpio_pin_active_monitor.h"
+#include "input_activity.h"
+#include "logger.h"
+#include "metrics.h"
 #include "occupancy_commands.h"
+#include "periodic_timer.h"
+#include "sensor_fusion_monitor.h"
+#include "state_publisher.h"
+#include "trace.h"
+#include "transition_notifier.h"
 
 #include <signal.h>
-#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <syslog.h>
-#include <unistd.h>
 
-atomic_bool gUsrStop = false;
-void sighandler(int _unused __attribute__((unused))) { gUsrStop = true; }
+// A single sensor pin gets its own monitor; with extra pins, all are sampled together. A list of
+// sensors is fused into a single state.
+struct Sensors {
+  struct GpioPinActiveMonitor *single;
+  struct GpioMultiPinMonitor *multi;
+  struct SensorFusionMonitor *fusion;
+};
+
+static bool sensors_init(struct Sensors *sensors, const struct PiPresenceMonConfig *cfg) {
+  sensors->single = NULL;
+  sensors->multi = NULL;
+  sensors->fusion = NULL;
+  if (cfg->sensors_sz > 0) {
+    sensors->fusion = sensor_fusion_monitor_init(cfg, clock_real());
+    return sensors->fusion != NULL;
+  }
+
+  if (cfg->extra_sensor_pins_sz == 0) {
+    sensors->single = gpio_active_monitor_init(cfg, clock_real());
+    return sensors->single != NULL;
+  }
+
+  gpio_reg_t pin_mask = (gpio_reg_t)1 << cfg->sensor_pin;
+  for (size_t i = 0; i < cfg->extra_sensor_pins_sz; ++i) {
+    pin_mask |= (gpio_reg_t)1 << cfg->extra_sensor_pins[i];
+  }
+  sensors->multi = gpio_multi_pin_monitor_init(cfg, pin_mask);
+  return sensors->multi != NULL;
+}
+
+static void sensors_free(struct Sensors *sensors) {
+  gpio_active_monitor_free(sensors->single);
+  gpio_multi_pin_monitor_free(sensors->multi);
+  sensor_fusion_monitor_free(sensors->fusion);
+}
+
+static bool sensors_report_occupancy(struct Sensors *sensors) {
+  if (sensors->fusion) {
+    return sensor_fusion_monitor_active(sensors->fusion);
+  }
+  if (sensors->multi) {
+    return gpio_multi_pin_monitor_active_pins(sensors->multi) != 0;
+  }
+  return gpio_active_monitor_pin_active(sensors->single);
+}
+
+static int sensors_transition_fd(struct Sensors *sensors) {
+  if (sensors->fusion) {
+    return sensor_fusion_monitor_transition_fd(sensors->fusion);
+  }
+  if (sensors->multi) {
+    return gpio_multi_pin_monitor_transition_fd(sensors->multi);
+  }
+  return gpio_active_monitor_transition_fd(sensors->single);
+}
+
+static bool sensors_read_transition(struct Sensors *sensors, struct OccupancyTransition *t) {
+  if (sensors->fusion) {
+    return sensor_fusion_monitor_read_transition(sensors->fusion, t);
+  }
+  if (sensors->multi) {
+    return gpio_multi_pin_monitor_read_transition(sensors->multi, t);
+  }
+  return gpio_active_monitor_read_transition(sensors->single, t);
+}
+
+// Per pin (or per sensor) active % of the current window, and glitches rejected
+static void sensors_write_metrics(struct Sensors *sensors, const struct PiPresenceMonConfig *cfg,
+                                  struct MetricsWriter *w) {
+  metrics_write_help(w, "pipresencemon_sensor_active_pct", "gauge",
+                     "Active readings in the sensor window, in %");
+  size_t rejected;
+  if (sensors->fusion) {
+    for (size_t i = 0; i < cfg->sensors_sz; ++i) {
+      metrics_printf(w, "pipresencemon_sensor_active_pct{sensor=\"");
+      metrics_write_label_value(w, cfg->sensors[i].name);
+      metrics_printf(w, "\"} %zu\n", sensor_fusion_monitor_sensor_active_pct(sensors->fusion, i));
+    }
+    rejected = sensor_fusion_monitor_rejected_glitches(sensors->fusion);
+  } else if (sensors->multi) {
+    metrics_printf(w, "pipresencemon_sensor_active_pct{pin=\"%zu\"} %zu\n", cfg->sensor_pin,
+                   gpio_multi_pin_monitor_active_pct(sensors->multi, cfg->sensor_pin));
+    for (size_t i = 0; i < cfg->extra_sensor_pins_sz; ++i) {
+      const size_t pin = cfg->extra_sensor_pins[i];
+      metrics_printf(w, "pipresencemon_sensor_active_pct{pin=\"%zu\"} %zu\n", pin,
+                     gpio_multi_pin_monitor_active_pct(sensors->multi, pin));
+    }
+    rejected = gpio_multi_pin_monitor_rejected_glitches(sensors->multi);
+  } else {
+    metrics_printf(w, "pipresencemon_sensor_active_pct{pin=\"%zu\"} %zu\n", cfg->sensor_pin,
+                   gpio_active_monitor_active_pct(sensors->single));
+    rejected = gpio_active_monitor_rejected_glitches(sensors->single);
+  }
+
+  metrics_write_help(w, "pipresencemon_sensor_glitches_total", "counter",
+                     "Raw sensor excursions rejected by the glitch filter");
+  metrics_printf(w, "pipresencemon_sensor_glitches_total %zu\n", rejected);
+}
+
+static void state_add_source(struct PiPresenceState *page, size_t pin, size_t active_pct) {
+  if (page->sources_sz < PIPRESENCE_STATE_MAX_SOURCES) {
+    page->sources[page->sources_sz].pin = pin;
+    page->sources[page->sources_sz].active_pct = active_pct;
+    page->sources_sz++;
+  }
+}
+
+// Score and per sensor active % for the state page
+static void sensors_write_state(struct Sensors *sensors, const struct PiPresenceMonConfig *cfg,
+                                struct PiPresenceState *page) {
+  page->sources_sz = 0;
+  if (sensors->fusion) {
+    for (size_t i = 0; i < cfg->sensors_sz; ++i) {
+      state_add_source(page, cfg->sensors[i].uart ? PIPRESENCE_STATE_NO_PIN : cfg->sensors[i].pin,
+                       sensor_fusion_monitor_sensor_active_pct(sensors->fusion, i));
+    }
+    page->active_pct = sensor_fusion_monitor_score_pct(sensors->fusion);
+  } else if (sensors->multi) {
+    state_add_source(page, cfg->sensor_pin,
+                     gpio_multi_pin_monitor_active_pct(sensors->multi, cfg->sensor_pin));
+    for (size_t i = 0; i < cfg->extra_sensor_pins_sz; ++i) {
+      const size_t pin = cfg->extra_sensor_pins[i];
+      state_add_source(page, pin, gpio_multi_pin_monitor_active_pct(sensors->multi, pin));
+    }
+    // Any pin can report occupancy, the busiest one is the closest to the threshold
+    page->active_pct = 0;
+    for (size_t i = 0; i < page->sources_sz; ++i) {
+      if (page->sources[i].active_pct > page->active_pct) {
+        page->active_pct = page->sources[i].active_pct;
+      }
+    }
+  } else {
+    page->active_pct = gpio_active_monitor_active_pct(sensors->single);
+    state_add_source(page, cfg->sensor_pin, page->active_pct);
+  }
+}
+
+static void sensors_on_user_activity(struct Sensors *sensors, uint64_t now_ns) {
+  if (sensors->fusion) {
+    sensor_fusion_monitor_on_user_activity(sensors->fusion, now_ns);
+  } else if (sensors->multi) {
+    gpio_multi_pin_monitor_on_user_activity(sensors->multi);
+  } else {
+    gpio_active_monitor_on_user_activity(sensors->single, now_ns);
+  }
+}
+
+struct PiPresenceMon {
+  struct EventLoop *loop;
+  struct Sensors sensors;
+  struct OccupancyCommands *occupancy_cmds;
+  // What the sensors (and user activity) report, and what commands and clients see: the same,
+  // unless overridden through the control socket
+  bool sensors_occupied;
+  bool currently_occupied;
+  // Optional, see control_socket
+  struct ControlServer *control;
+  struct EventLoopTimer *force_timer;
+  enum ControlForce force;
+  uint64_t force_until_ns;
+  // Optional, see gpio_scope_period_us
+  struct GpioScope *scope;
+  const char *scope_dump_path;
+  // Optional, see input_devices
+  struct InputActivity *input;
+  // Last user activity forwarded to the sensors, a vacancy they decided before it is stale
+  uint64_t last_user_activity_ns;
+  // Optional, see metrics_socket
+  struct MetricsServer *metrics;
+  const struct PiPresenceMonConfig *cfg;
+  const char *trace_dump_path;
+  // Optional, see state_page_path. Refreshed on each transition, and every
+  // PIPRESENCE_STATE_REFRESH_MS so readers can tell a live daemon from a killed one.
+  struct StatePublisher *state;
+  struct EventLoopTimer *state_timer;
+  size_t transitions;
+  uint64_t last_transition_ns;
+};
+
+static void on_stop_signal(void *usr, int signo) {
+  struct PiPresenceMon *self = usr;
+  printf("Received signal %d, shutting down\n", signo);
+  event_loop_stop(self->loop);
+}
+
+static void on_scope_dump_signal(void *usr, int signo) {
+  struct PiPresenceMon *self = usr;
+  gpio_scope_dump(self->scope, self->scope_dump_path);
+}
+
+static void publish_state(struct PiPresenceMon *self) {
+  if (!self->state) {
+    return;
+  }
+
+  struct PiPresenceState *page = state_publisher_begin(self->state);
+  page->occupied = self->currently_occupied;
+  page->transitions = self->transitions;
+  page->last_transition_ns = self->last_transition_ns;
+  page->updated_ns = monotonic_now_ns();
+  sensors_write_state(&self->sensors, self->cfg, page);
+  state_publisher_end(self->state);
+}
+
+static void on_state_timer(void *usr) {
+  publish_state(usr);
+}
+
+static bool effective_occupancy(const struct PiPresenceMon *self) {
+  if (self->force != CONTROL_FORCE_NONE) {
+    return self->force == CONTROL_FORCE_OCCUPIED;
+  }
+  // A wakelock only holds off vacancy, it doesn't report occupancy of an empty room
+  return self->sensors_occupied ||
+         (self->currently_occupied && control_server_wakelocks(self->control) > 0);
+}
+
+// Report the effective occupancy to commands and clients, if it changed
+static void update_occupancy(struct PiPresenceMon *self, uint64_t decision_ns) {
+  const bool occupied = effective_occupancy(self);
+  if (occupied == self->currently_occupied) {
+    return;
+  }
+
+  self->currently_occupied = occupied;
+  if (occupied) {
+    relaxed_inc(metrics_pipeline()->transitions_occupied);
+    occupancy_commands_on_occupancy(self->occupancy_cmds, decision_ns);
+  } else {
+    relaxed_inc(metrics_pipeline()->transitions_vacant);
+    occupancy_commands_on_vacancy(self->occupancy_cmds, decision_ns);
+  }
+  self->transitions++;
+  self->last_transition_ns = decision_ns;
+  publish_state(self);
+  control_server_notify(self->control, occupied, decision_ns);
+}
+
+static void on_trace_dump_signal(void *usr, int signo) {
+  struct PiPresenceMon *self = usr;
+  trace_dump(self->trace_dump_path);
+}
+
+static void on_sensor_transition(void *usr, int fd, uint32_t events) {
+  struct PiPresenceMon *self = usr;
+  struct OccupancyTransition transition;
+  if (!sensors_read_transition(&self->sensors, &transition)) {
+    return;
+  }
+
+  if (!transition.occupied && transition.timestamp_ns < self->last_user_activity_ns) {
+    // Queued before the sensors heard of the user activity, which already reset them to occupied:
+    // reporting it would turn the display off right after the activity turned it on
+    printf("Ignoring vacancy detected by GPIO sensor before the last user activity\n");
+    return;
+  }
+
+  self->sensors_occupied = transition.occupied;
+  const uint64_t pickup_ns = monotonic_now_ns();
+  const unsigned long long pickup_usecs = (pickup_ns - transition.timestamp_ns) / 1000;
+  trace_span("pickup", transition.timestamp_ns, pickup_ns, transition.occupied);
+  struct PipelineMetrics *metrics = metrics_pipeline();
+  metrics_histogram_observe(&metrics->decision_to_pickup_us, pickup_usecs);
+  if (transition.sensor_change_ns != 0 && transition.timestamp_ns > transition.sensor_change_ns) {
+    metrics_histogram_observe(&metrics->edge_to_decision_us,
+                              (transition.timestamp_ns - transition.sensor_change_ns) / 1000);
+  }
+  if (transition.occupied != self->currently_occupied) {
+    const bool overridden = effective_occupancy(self) != transition.occupied;
+    printf("%s detected by GPIO sensor (%zu%% activity, %llu usecs ago)%s\n",
+           transition.occupied ? "Occupancy" : "Vacancy", transition.active_pct, pickup_usecs,
+           overridden ? ", overridden by control socket" : "");
+  }
+  update_occupancy(self, transition.timestamp_ns);
+  trace_span("handle_transition", pickup_ns, monotonic_now_ns(), transition.occupied);
+}
+
+// Someone is using the device: report occupancy now, the sensors will keep it until their vacancy
+// timeout runs out (or they see someone themselves)
+static void on_user_activity(void *usr, const char *device_name, uint64_t now_ns) {
+  struct PiPresenceMon *self = usr;
+  sensors_on_user_activity(&self->sensors, now_ns);
+  self->last_user_activity_ns = now_ns;
+  trace_instant("user_activity", now_ns, self->currently_occupied);
+  self->sensors_occupied = true;
+  if (!self->currently_occupied && effective_occupancy(self)) {
+    printf("User activity on %s, reporting occupancy\n", device_name);
+  }
+  update_occupancy(self, now_ns);
+}
+
+static void on_control_query(void *usr, char *buf, size_t sz) {
+  struct PiPresenceMon *self = usr;
+  const uint64_t now_ns = monotonic_now_ns();
+  const uint64_t force_left_s =
+      (self->force != CONTROL_FORCE_NONE && self->force_until_ns > now_ns)
+          ? (self->force_until_ns - now_ns) / 1000000000ull
+          : 0;
+  snprintf(buf, sz,
+           "occupied=%d sensors=%d force=%s force_left_s=%llu wakelocks=%zu transitions=%zu "
+           "last_transition_s=%llu",
+           self->currently_occupied ? 1 : 0, self->sensors_occupied ? 1 : 0,
+           control_force_name(self->force), (unsigned long long)force_left_s,
+           control_server_wakelocks(self->control), self->transitions,
+           (unsigned long long)((now_ns - self->last_transition_ns) / 1000000000ull));
+}
+
+static void on_control_force(void *usr, enum ControlForce force, size_t minutes) {
+  struct PiPresenceMon *self = usr;
+  self->force = force;
+  if (force == CONTROL_FORCE_NONE) {
+    printf("Control socket cleared the occupancy override\n");
+    event_loop_timer_disarm(self->force_timer);
+  } else {
+    printf("Control socket forces %s for %zu minutes\n", control_force_name(force), minutes);
+    self->force_until_ns = monotonic_now_ns() + minutes * 60 * 1000000000ull;
+    if (!event_loop_timer_arm(self->force_timer, minutes * 60 * 1000, 0)) {
+      fprintf(stderr, "Can't arm override timer, clearing override\n");
+      self->force = CONTROL_FORCE_NONE;
+    }
+  }
+  update_occupancy(self, monotonic_now_ns());
+}
+
+static void on_force_timer(void *usr) {
+  struct PiPresenceMon *self = usr;
+  printf("Occupancy override expired\n");
+  self->force = CONTROL_FORCE_NONE;
+  update_occupancy(self, monotonic_now_ns());
+}
+
+static void on_control_wakelocks(void *usr, size_t held) {
+  struct PiPresenceMon *self = usr;
+  printf("Control socket wakelocks held: %zu\n", held);
+  update_occupancy(self, monotonic_now_ns());
+}
+
+static void on_metrics_scrape(void *usr, struct MetricsWriter *w) {
+  struct PiPresenceMon *self = usr;
+  struct PipelineMetrics *metrics = metrics_pipeline();
+
+  metrics_write_help(w, "pipresencemon_samples_total", "counter", "Sensor samples taken");
+  metrics_printf(w, "pipresencemon_samples_total %llu\n",
+                 (unsigned long long)atomic_load_explicit(&metrics->samples,
+                                                          memory_order_relaxed));
+  metrics_write_help(w, "pipresencemon_transitions_total", "counter",
+                     "Occupancy state changes reported");
+  metrics_printf(w, "pipresencemon_transitions_total{state=\"occupied\"} %llu\n",
+                 (unsigned long long)atomic_load_explicit(&metrics->transitions_occupied,
+                                                          memory_order_relaxed));
+  metrics_printf(w, "pipresencemon_transitions_total{state=\"vacant\"} %llu\n",
+                 (unsigned long long)atomic_load_explicit(&metrics->transitions_vacant,
+                                                          memory_order_relaxed));
+  metrics_printf(w, "# HELP pipresencemon_occupied Current occupancy state\n"
+                    "# TYPE pipresencemon_occupied gauge\n"
+                    "pipresencemon_occupied %d\n",
+                 self->currently_occupied ? 1 : 0);
+  sensors_write_metrics(&self->sensors, self->cfg, w);
+
+  metrics_write_histogram(w, "pipresencemon_sample_jitter_us", "Lateness of sensor sample wakeups",
+                          &metrics->sample_jitter_us);
+  metrics_write_histogram(w, "pipresencemon_edge_to_decision_us",
+                          "From a filtered sensor change to the monitor deciding a transition",
+                          &metrics->edge_to_decision_us);
+  metrics_write_histogram(w, "pipresencemon_decision_to_pickup_us",
+                          "From a transition decision to the main loop handling it",
+                          &metrics->decision_to_pickup_us);
+  metrics_write_histogram(w, "pipresencemon_decision_to_exec_us",
+                          "From a transition decision to each of its commands running",
+                          &metrics->decision_to_exec_us);
+  metrics_write_histogram(w, "pipresencemon_command_stop_us",
+                          "From asking a command to stop to it exiting", &metrics->command_stop_us);
+  occupancy_commands_write_metrics(self->occupancy_cmds, w);
+}
 
 int main(int argc, const char **argv) {
   openlog(argv[0], 0, LOG_USER);
@@ -28,45 +412,119 @@ int main(int argc, const char **argv) {
   syslog(LOG_INFO, "Starting PiPresenceMonitor service...\n");
   cfg_debug(cfg);
 
-  struct GpioPinActiveMonitor *gpio_mon = gpio_active_monitor_init(cfg);
-  struct OccupancyCommands *occupancy_cmds = occupancy_commands_init(cfg);
-  if (!gpio_mon || !occupancy_cmds) {
+  // The loop must exist before any thread is started, so that signals are only delivered to it
+  struct PiPresenceMon self;
+  memset(&self, 0, sizeof(self));
+  self.cfg = cfg;
+  self.trace_dump_path = cfg->trace_dump_path;
+  trace_thread_name("main");
+  self.loop = event_loop_init(clock_real());
+  if (self.loop && !logger_init(cfg)) {
+    fprintf(stderr, "Warning: can't start logger, sensor messages will be logged synchronously\n");
+  }
+  const bool sensors_ok = self.loop && sensors_init(&self.sensors, cfg);
+  if (self.loop && cfg->gpio_scope_period_us) {
+    self.scope = gpio_scope_init(cfg);
+    self.scope_dump_path = cfg->gpio_scope_dump_path;
+    if (!self.scope ||
+        !event_loop_on_signal(self.loop, SIGUSR1, on_scope_dump_signal, &self)) {
+      fprintf(stderr, "Startup fail: can't start GPIO scope\n");
+      ret = 1;
+      goto CLEANUP;
+    }
+  }
+  self.occupancy_cmds = self.loop ? occupancy_commands_init(cfg, self.loop) : NULL;
+  if (!sensors_ok || !self.occupancy_cmds) {
     fprintf(stderr, "Startup fail\n");
     ret = 1;
     goto CLEANUP;
   }
 
-  signal(SIGINT, sighandler);
-  bool currently_occupied = gpio_active_monitor_pin_active(gpio_mon);
-  if (currently_occupied) {
-    printf("Startup assumes occupancy\n");
-    occupancy_commands_on_occupancy(occupancy_cmds);
-  } else if (currently_occupied) {
-    printf("Startup assumes vacancy\n");
-    occupancy_commands_on_vacancy(occupancy_cmds);
-  }
-
-  while (!gUsrStop) {
-    const bool occupancy = gpio_active_monitor_pin_active(gpio_mon);
-    const bool was_occupied = currently_occupied;
-    currently_occupied = occupancy;
-    if (!was_occupied && occupancy) {
-      printf("Occupancy detected by GPIO sensor\n");
-      occupancy_commands_on_occupancy(occupancy_cmds);
-    } else if (was_occupied && !occupancy) {
-      printf("Vacancy detected by GPIO sensor\n");
-      occupancy_commands_on_vacancy(occupancy_cmds);
+  struct EventLoopFd *transitions_handle =
+      event_loop_add_fd(self.loop, sensors_transition_fd(&self.sensors), EPOLLIN,
+                        on_sensor_transition, &self);
+  if (!transitions_handle || !event_loop_on_signal(self.loop, SIGINT, on_stop_signal, &self) ||
+      !event_loop_on_signal(self.loop, SIGTERM, on_stop_signal, &self) ||
+      !event_loop_on_signal(self.loop, SIGHUP, on_stop_signal, &self) ||
+      !event_loop_on_signal(self.loop, SIGUSR2, on_trace_dump_signal, &self)) {
+    fprintf(stderr, "Startup fail\n");
+    ret = 1;
+    goto CLEANUP;
+  }
+
+  if (cfg->input_devices_sz > 0) {
+    self.input = input_activity_init(self.loop, cfg->input_devices_sz, cfg->input_devices,
+                                     on_user_activity, &self);
+    if (!self.input) {
+      fprintf(stderr, "Warning: can't watch any input device, ignoring user activity\n");
     }
+  }
 
-    occupancy_commands_tick(occupancy_cmds);
-    sleep(1);
+  if (cfg->metrics_socket || cfg->metrics_port) {
+    self.metrics = metrics_server_init(self.loop, cfg->metrics_socket, cfg->metrics_port,
+                                       on_metrics_scrape, &self);
+    if (!self.metrics) {
+      fprintf(stderr, "Warning: can't serve metrics\n");
+    }
+  }
+
+  if (cfg->state_page_path) {
+    self.state = state_publisher_init(cfg->state_page_path);
+    self.state_timer = self.state ? event_loop_timer_init(self.loop, on_state_timer, &self) : NULL;
+    if (!self.state_timer ||
+        !event_loop_timer_arm(self.state_timer, PIPRESENCE_STATE_REFRESH_MS,
+                              PIPRESENCE_STATE_REFRESH_MS)) {
+      fprintf(stderr, "Warning: can't publish occupancy state\n");
+    }
+  }
+
+  if (cfg->control_socket) {
+    const struct ControlHandlers handlers = {
+        .query = on_control_query,
+        .force = on_control_force,
+        .wakelocks_changed = on_control_wakelocks,
+        .usr = &self,
+    };
+    self.force_timer = event_loop_timer_init(self.loop, on_force_timer, &self);
+    self.control =
+        self.force_timer ? control_server_init(self.loop, cfg->control_socket, &handlers) : NULL;
+    if (!self.control) {
+      fprintf(stderr, "Warning: can't serve control socket\n");
+    }
   }
 
+  self.sensors_occupied = sensors_report_occupancy(&self.sensors);
+  self.currently_occupied = self.sensors_occupied;
+  self.last_transition_ns = monotonic_now_ns();
+  publish_state(&self);
+  if (self.currently_occupied) {
+    printf("Startup assumes occupancy\n");
+    occupancy_commands_on_occupancy(self.occupancy_cmds, monotonic_now_ns());
+  } else {
+    printf("Startup assumes vacancy\n");
+    occupancy_commands_on_vacancy(self.occupancy_cmds, monotonic_now_ns());
+  }
+
+  event_loop_run(self.loop);
+  event_loop_remove_fd(self.loop, transitions_handle);
   ret = 0;
 
 CLEANUP:
-  occupancy_commands_free(occupancy_cmds);
-  gpio_active_monitor_free(gpio_mon);
+  control_server_free(self.control);
+  if (self.force_timer) {
+    event_loop_timer_free(self.loop, self.force_timer);
+  }
+  if (self.state_timer) {
+    event_loop_timer_free(self.loop, self.state_timer);
+  }
+  state_publisher_free(self.state);
+  metrics_server_free(self.metrics);
+  input_activity_free(self.input);
+  occupancy_commands_free(self.occupancy_cmds);
+  gpio_scope_free(self.scope);
+  sensors_free(&self.sensors);
+  event_loop_free(self.loop);
+  logger_free();
   pipresencemon_cfg_free(cfg);
   return ret;
 }
@@ -0,0 +1,335 @@
+// Offline replay of a sensor trace through the occupancy detectors, on a virtual clock.
+//
+// Trace format, one sample per line: `<timestamp_ms> <sample 0|1> [<ground truth 0|1>]`. Lines
+// starting with # are ignored. With ground truth, reports detection latency and false transitions.
+//
+// Usage: pipresencemon_replay <config.json> <trace|-|synth:N> [window|ewma|hmm] [-v]
+// synth:N generates a deterministic trace of N samples, with ground truth, instead of reading one.
+#include "cfg.h"
+#include "occupancy_detector.h"
+#include "sensor_pipeline.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct TraceSample {
+  uint64_t t_ms;
+  bool sample;
+  // -1 if the trace has no ground truth
+  int truth;
+};
+
+struct TraceSource {
+  FILE *fp;
+  size_t line;
+  // synth:N mode
+  size_t synth_left;
+  size_t synth_period_ms;
+  uint64_t synth_t_ms;
+  uint64_t synth_rng;
+  bool synth_truth;
+  uint64_t synth_truth_until_ms;
+  bool synth_burst;
+};
+
+struct ReplayStats {
+  size_t samples;
+  uint64_t first_t_ms;
+  uint64_t last_t_ms;
+  size_t to_occupied;
+  size_t to_vacant;
+  bool has_truth;
+  size_t false_occupancies;
+  size_t false_vacancies;
+  // Pending ground truth change, waiting for the detector to catch up
+  bool occupancy_pending;
+  bool vacancy_pending;
+  uint64_t truth_changed_t_ms;
+  size_t occupancy_detections;
+  uint64_t occupancy_latency_total_ms;
+  uint64_t occupancy_latency_max_ms;
+  size_t vacancy_detections;
+  uint64_t vacancy_latency_total_ms;
+  uint64_t vacancy_latency_max_ms;
+};
+
+static uint64_t synth_rand(struct TraceSource *src) {
+  // xorshift64, so a given N always generates the same trace
+  src->synth_rng ^= src->synth_rng << 13;
+  src->synth_rng ^= src->synth_rng >> 7;
+  src->synth_rng ^= src->synth_rng << 17;
+  return src->synth_rng;
+}
+
+// PIR-like trace: occupied and vacant periods of 1 to 30 minutes. While occupied, the sensor
+// fires in bursts; while vacant, it false-triggers once in a while.
+static void synth_next(struct TraceSource *src, struct TraceSample *s) {
+  if (src->synth_t_ms >= src->synth_truth_until_ms) {
+    src->synth_truth = !src->synth_truth;
+    src->synth_truth_until_ms = src->synth_t_ms + 60 * 1000 * (1 + synth_rand(src) % 30);
+  }
+
+  const uint64_t r = synth_rand(src) % 1000;
+  if (src->synth_truth) {
+    // Bursts start with 5% chance per sample and last 30% of the time on average
+    src->synth_burst = src->synth_burst ? (r < 880) : (r < 50);
+  } else {
+    src->synth_burst = (r < 2);
+  }
+
+  s->t_ms = src->synth_t_ms;
+  s->sample = src->synth_burst;
+  s->truth = src->synth_truth;
+  src->synth_t_ms += src->synth_period_ms;
+}
+
+// Returns false at the end of the trace, or on a parse error
+static bool trace_next(struct TraceSource *src, struct TraceSample *s, bool *err) {
+  if (!src->fp) {
+    if (src->synth_left == 0) {
+      return false;
+    }
+    src->synth_left--;
+    synth_next(src, s);
+    return true;
+  }
+
+  char buf[128];
+  while (fgets(buf, sizeof(buf), src->fp)) {
+    src->line++;
+    if (buf[0] == '#' || buf[0] == '\n') {
+      continue;
+    }
+
+    char *p = buf;
+    char *end;
+    s->t_ms = strtoull(p, &end, 10);
+    p = end;
+    const long sample = strtol(p, &end, 10);
+    if (end == p || (sample != 0 && sample != 1)) {
+      fprintf(stderr, "Trace error on line %zu: expected `<timestamp_ms> <0|1> [<0|1>]`\n",
+              src->line);
+      *err = true;
+      return false;
+    }
+    p = end;
+    s->sample = sample;
+    const long truth = strtol(p, &end, 10);
+    s->truth = (end == p) ? -1 : (truth != 0);
+    return true;
+  }
+
+  return false;
+}
+
+static void on_reported_change(struct ReplayStats *st, const struct TraceSample *s, bool reported,
+                               bool verbose) {
+  if (verbose) {
+    printf("t=%llu ms: report %s\n", (unsigned long long)s->t_ms,
+           reported ? "occupancy" : "vacancy");
+  }
+
+  if (reported) {
+    st->to_occupied++;
+  } else {
+    st->to_vacant++;
+  }
+
+  if (s->truth < 0) {
+    return;
+  }
+
+  if (reported && !s->truth) {
+    st->false_occupancies++;
+  } else if (!reported && s->truth) {
+    st->false_vacancies++;
+  }
+
+  if (reported && st->occupancy_pending) {
+    const uint64_t latency = s->t_ms - st->truth_changed_t_ms;
+    st->occupancy_pending = false;
+    st->occupancy_detections++;
+    st->occupancy_latency_total_ms += latency;
+    st->occupancy_latency_max_ms =
+        latency > st->occupancy_latency_max_ms ? latency : st->occupancy_latency_max_ms;
+  } else if (!reported && st->vacancy_pending) {
+    const uint64_t latency = s->t_ms - st->truth_changed_t_ms;
+    st->vacancy_pending = false;
+    st->vacancy_detections++;
+    st->vacancy_latency_total_ms += latency;
+    st->vacancy_latency_max_ms =
+        latency > st->vacancy_latency_max_ms ? latency : st->vacancy_latency_max_ms;
+  }
+}
+
+static void on_truth_change(struct ReplayStats *st, const struct TraceSample *s, bool reported) {
+  st->truth_changed_t_ms = s->t_ms;
+  st->occupancy_pending = s->truth && !reported;
+  st->vacancy_pending = !s->truth && reported;
+  // Already reporting the new state (eg still within the vacancy timeout): detected with no delay
+  if (s->truth && reported) {
+    st->occupancy_detections++;
+  } else if (!s->truth && !reported) {
+    st->vacancy_detections++;
+  }
+}
+
+// Every sample goes through the same SensorPipeline as in GpioPinActiveMonitor, then the vacancy
+// timeout, with the clock taken from the trace. Specialized per detector kind, like the monitor.
+static inline __attribute__((always_inline)) bool
+replay_run(struct TraceSource *src, struct SensorPipeline *pipeline,
+           struct VacancyTimeout *timeout, struct ReplayStats *st, bool verbose,
+           const enum OccupancyDetectorKind kind) {
+  int last_truth = -1;
+  bool reported = timeout->active;
+
+  struct TraceSample s;
+  bool err = false;
+  while (trace_next(src, &s, &err)) {
+    if (st->samples == 0) {
+      st->first_t_ms = s.t_ms;
+      vacancy_timeout_init(timeout, timeout->timeout_ns, s.t_ms * 1000000ull, timeout->active);
+    }
+    st->samples++;
+    st->last_t_ms = s.t_ms;
+
+    if (s.truth >= 0 && s.truth != last_truth) {
+      st->has_truth = true;
+      on_truth_change(st, &s, reported);
+      last_truth = s.truth;
+    }
+
+    // The trace is a single pin, filtered as pin 0
+    const uint64_t t_ns = s.t_ms * 1000000ull;
+    const struct SensorPipelineSample ps = sensor_pipeline_update(pipeline, kind, s.sample, t_ns);
+    const bool now_reported = vacancy_timeout_update(timeout, ps.detected, t_ns);
+    if (now_reported != reported) {
+      reported = now_reported;
+      on_reported_change(st, &s, reported, verbose);
+    }
+  }
+
+  return !err;
+}
+
+static uint64_t wall_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void print_stats(const struct ReplayStats *st, uint64_t wall_ns) {
+  const double wall_s = wall_ns / 1e9;
+  printf("Replayed %zu samples (%.1f hours of trace) in %.3f s: %.0f samples/s\n", st->samples,
+         (st->last_t_ms - st->first_t_ms) / 3600e3, wall_s, wall_s > 0 ? st->samples / wall_s : 0);
+  printf("Transitions: %zu to occupied, %zu to vacant\n", st->to_occupied, st->to_vacant);
+  if (!st->has_truth) {
+    printf("No ground truth in trace, can't report latency or false transitions\n");
+    return;
+  }
+
+  printf("Occupancy detection latency: %zu detections, avg %llu ms, max %llu ms\n",
+         st->occupancy_detections,
+         (unsigned long long)(st->occupancy_detections
+                                  ? st->occupancy_latency_total_ms / st->occupancy_detections
+                                  : 0),
+         (unsigned long long)st->occupancy_latency_max_ms);
+  printf("Vacancy detection latency: %zu detections, avg %llu ms, max %llu ms\n",
+         st->vacancy_detections,
+         (unsigned long long)(st->vacancy_detections
+                                  ? st->vacancy_latency_total_ms / st->vacancy_detections
+                                  : 0),
+         (unsigned long long)st->vacancy_latency_max_ms);
+  printf("False occupancies: %zu, false vacancies: %zu\n", st->false_occupancies,
+         st->false_vacancies);
+}
+
+int main(int argc, const char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <config.json> <trace|-|synth:N> [window|ewma|hmm] [-v]\n", argv[0]);
+    return 1;
+  }
+
+  struct PiPresenceMonConfig *cfg = pipresencemon_cfg_init(argv[1]);
+  if (!cfg) {
+    return 1;
+  }
+
+  bool verbose = false;
+  for (int i = 3; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (strcmp(argv[i], "window") == 0) {
+      cfg->occupancy_detector = DETECTOR_WINDOW;
+    } else if (strcmp(argv[i], "ewma") == 0) {
+      cfg->occupancy_detector = DETECTOR_EWMA;
+    } else if (strcmp(argv[i], "hmm") == 0) {
+      cfg->occupancy_detector = DETECTOR_HMM;
+    } else {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      pipresencemon_cfg_free(cfg);
+      return 1;
+    }
+  }
+
+  struct TraceSource src;
+  memset(&src, 0, sizeof(src));
+  if (strncmp(argv[2], "synth:", strlen("synth:")) == 0) {
+    src.synth_left = strtoull(argv[2] + strlen("synth:"), NULL, 10);
+    src.synth_period_ms = cfg->sensor_poll_period_ms;
+    src.synth_rng = 0x9e3779b97f4a7c15ull ^ src.synth_left;
+  } else if (strcmp(argv[2], "-") == 0) {
+    src.fp = stdin;
+  } else {
+    src.fp = fopen(argv[2], "r");
+    if (!src.fp) {
+      perror("Can't open trace");
+      pipresencemon_cfg_free(cfg);
+      return 1;
+    }
+  }
+
+  // Same initial state as GpioPinActiveMonitor
+  const bool start_active = true;
+  struct SensorPipeline pipeline;
+  if (!sensor_pipeline_init(&pipeline, cfg, 1, start_active)) {
+    pipresencemon_cfg_free(cfg);
+    return 1;
+  }
+  struct VacancyTimeout timeout;
+  vacancy_timeout_init(&timeout, 1000000000ull * cfg->vacancy_motion_timeout_seconds, 0,
+                       start_active);
+
+  struct ReplayStats st;
+  memset(&st, 0, sizeof(st));
+  const uint64_t start_ns = wall_now_ns();
+  bool ok = false;
+  switch (pipeline.detector.kind) {
+  case DETECTOR_WINDOW:
+    ok = replay_run(&src, &pipeline, &timeout, &st, verbose, DETECTOR_WINDOW);
+    break;
+  case DETECTOR_EWMA:
+    ok = replay_run(&src, &pipeline, &timeout, &st, verbose, DETECTOR_EWMA);
+    break;
+  case DETECTOR_HMM:
+    ok = replay_run(&src, &pipeline, &timeout, &st, verbose, DETECTOR_HMM);
+    break;
+  }
+  const uint64_t wall_ns = wall_now_ns() - start_ns;
+
+  if (ok) {
+    print_stats(&st, wall_ns);
+    printf("Glitch filter rejected %zu glitches\n", glitch_filter_rejected(&pipeline.filter));
+  }
+
+  if (src.fp && src.fp != stdin) {
+    fclose(src.fp);
+  }
+  sensor_pipeline_free(&pipeline);
+  pipresencemon_cfg_free(cfg);
+  return ok ? 0 : 1;
+}
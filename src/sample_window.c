@@ -0,0 +1,91 @@
+#include "sample_window.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint64_t sample_window_word_t;
+#define WORD_BITS (8 * sizeof(sample_window_word_t))
+
+struct SampleWindow {
+  size_t sz;
+  // Index of the bit that will be written next (ie the oldest sample)
+  size_t write_idx;
+  sample_window_word_t *words;
+};
+
+struct SampleWindow *sample_window_init(size_t sz, bool initial_sample) {
+  if (sz == 0) {
+    fprintf(stderr, "SampleWindow can't be empty\n");
+    return NULL;
+  }
+
+  struct SampleWindow *w = malloc(sizeof(struct SampleWindow));
+  if (!w) {
+    perror("SampleWindow bad alloc");
+    return NULL;
+  }
+
+  const size_t words_cnt = (sz + WORD_BITS - 1) / WORD_BITS;
+  w->sz = sz;
+  w->write_idx = 0;
+  w->words = malloc(words_cnt * sizeof(w->words[0]));
+  if (!w->words) {
+    perror("SampleWindow bad window alloc");
+    free(w);
+    return NULL;
+  }
+
+  // Padding bits in the last word are never counted, so their value doesn't matter
+  memset(w->words, initial_sample ? 0xff : 0, words_cnt * sizeof(w->words[0]));
+  return w;
+}
+
+void sample_window_free(struct SampleWindow *w) {
+  if (!w) {
+    return;
+  }
+  free(w->words);
+  free(w);
+}
+
+size_t sample_window_size(const struct SampleWindow *w) { return w->sz; }
+
+bool sample_window_push(struct SampleWindow *w, bool sample) {
+  sample_window_word_t *word = &w->words[w->write_idx / WORD_BITS];
+  const sample_window_word_t bit = (sample_window_word_t)1 << (w->write_idx % WORD_BITS);
+  const bool evicted = (*word & bit) != 0;
+  *word = sample ? (*word | bit) : (*word & ~bit);
+  w->write_idx = (w->write_idx + 1 == w->sz) ? 0 : w->write_idx + 1;
+  return evicted;
+}
+
+// Count of set bits in [from, to), which must not wrap around the ring
+static size_t count_range(const struct SampleWindow *w, size_t from, size_t to) {
+  size_t cnt = 0;
+  while (from < to) {
+    const size_t bit_off = from % WORD_BITS;
+    const size_t bits = (to - from < WORD_BITS - bit_off) ? to - from : WORD_BITS - bit_off;
+    sample_window_word_t word = w->words[from / WORD_BITS] >> bit_off;
+    if (bits < WORD_BITS) {
+      word &= ((sample_window_word_t)1 << bits) - 1;
+    }
+    cnt += __builtin_popcountll(word);
+    from += bits;
+  }
+  return cnt;
+}
+
+size_t sample_window_active_count_last(const struct SampleWindow *w, size_t n) {
+  if (n > w->sz) {
+    n = w->sz;
+  }
+
+  // The last n samples are the n bits right before write_idx, possibly wrapping around the end
+  if (n <= w->write_idx) {
+    return count_range(w, w->write_idx - n, w->write_idx);
+  }
+
+  const size_t wrapped = n - w->write_idx;
+  return count_range(w, 0, w->write_idx) + count_range(w, w->sz - wrapped, w->sz);
+}
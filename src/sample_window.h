@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Ring of the last N boolean sensor samples, bit-packed 64 samples per word. Not thread safe.
+struct SampleWindow;
+
+struct SampleWindow *sample_window_init(size_t sz, bool initial_sample);
+void sample_window_free(struct SampleWindow *w);
+
+// Size of the window, in samples
+size_t sample_window_size(const struct SampleWindow *w);
+
+// Push a new sample, evicting the oldest one. Returns the evicted sample, so callers can keep a
+// running count in O(1).
+bool sample_window_push(struct SampleWindow *w, bool sample);
+
+// Count of active samples in the last n pushed samples (n is clamped to the window size). Costs
+// O(n/64) popcounts.
+size_t sample_window_active_count_last(const struct SampleWindow *w, size_t n);
@@ -0,0 +1,90 @@
+// Decoder for GPIO scope dumps (see gpio_scope.h), prints one line per register change.
+//
+// Usage: pipresencemon_scope_decode <dump> [--csv]
+// Times are relative to the start of the dump. With --csv, prints
+// `time_us,register,changed_pins_mask` lines, with a header, for plotting.
+#include "gpio.h"
+#include "gpio_scope.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void print_changed_pins(gpio_reg_t prev, gpio_reg_t reg) {
+  for (size_t pin = 0; pin < GPIO_PINS; ++pin) {
+    const gpio_reg_t mask = 1u << pin;
+    if ((prev ^ reg) & mask) {
+      printf(" %zu%s", pin, (reg & mask) ? "+" : "-");
+    }
+  }
+}
+
+int main(int argc, const char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <dump> [--csv]\n", argv[0]);
+    return 1;
+  }
+  const bool csv = (argc > 2 && strcmp(argv[2], "--csv") == 0);
+
+  FILE *fp = fopen(argv[1], "rb");
+  if (!fp) {
+    perror("Can't open dump");
+    return 1;
+  }
+
+  struct GpioScopeDumpHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != GPIO_SCOPE_MAGIC) {
+    fprintf(stderr, "%s isn't a GPIO scope dump\n", argv[1]);
+    fclose(fp);
+    return 1;
+  }
+
+  uint8_t *data = malloc(hdr.data_sz ? hdr.data_sz : 1);
+  if (!data || fread(data, 1, hdr.data_sz, fp) != hdr.data_sz) {
+    fprintf(stderr, "%s is truncated, expected %llu bytes of records\n", argv[1],
+            (unsigned long long)hdr.data_sz);
+    free(data);
+    fclose(fp);
+    return 1;
+  }
+  fclose(fp);
+
+  if (csv) {
+    printf("time_us,register,changed_pins_mask\n");
+    printf("0,0x%08x,0x0\n", hdr.base_reg);
+  } else {
+    printf("# Sampled every %u usecs, %llu changes captured, %llu dropped (ring full)\n",
+           hdr.period_us, (unsigned long long)hdr.records,
+           (unsigned long long)hdr.dropped_records);
+    printf("%12.3f ms  0x%08x  (start)\n", 0.0, hdr.base_reg);
+  }
+
+  uint64_t t_us = 0;
+  gpio_reg_t reg = hdr.base_reg;
+  size_t pos = 0;
+  while (pos < hdr.data_sz) {
+    uint64_t delta_us, new_reg;
+    if (!gpio_scope_varint_decode(data, hdr.data_sz, &pos, &delta_us) ||
+        !gpio_scope_varint_decode(data, hdr.data_sz, &pos, &new_reg)) {
+      fprintf(stderr, "Dump ends in a partial record at byte %zu\n", pos);
+      free(data);
+      return 1;
+    }
+
+    t_us += delta_us;
+    if (csv) {
+      printf("%llu,0x%08x,0x%x\n", (unsigned long long)t_us, (gpio_reg_t)new_reg,
+             reg ^ (gpio_reg_t)new_reg);
+    } else {
+      printf("%12.3f ms  0x%08x ", t_us / 1000.0, (gpio_reg_t)new_reg);
+      print_changed_pins(reg, new_reg);
+      printf("\n");
+    }
+    reg = new_reg;
+  }
+
+  free(data);
+  return 0;
+}
@@ -0,0 +1,497 @@
+#include "sensor_fusion_monitor.h"
+#include "cfg.h"
+#include "clock.h"
+#include "glitch_filter.h"
+#include "gpio.h"
+#include "ld2410.h"
+#include "logger.h"
+#include "metrics.h"
+#include "occupancy_detector.h"
+#include "periodic_timer.h"
+#include "sample_window.h"
+#include "trace.h"
+#include "transition_notifier.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// A radar that sends no report for this long is considered absent
+#define SENSOR_FUSION_RADAR_STALE_NS (1000 * 1000 * 1000ull)
+
+struct FusedSensor {
+  const struct SensorConfig *cfg;
+  // GPIO sensors: pin in the register
+  gpio_reg_t bit;
+  // UART radars: tty (-1 otherwise), frame parser and presence from the last report
+  int uart_fd;
+  struct Ld2410Parser radar;
+  size_t radar_frames;
+  uint64_t radar_last_report_ns;
+  bool radar_present;
+  bool radar_stale;
+  // Only the sampler thread touches the window; the count can be read from any thread
+  struct SampleWindow *window;
+  size_t window_sz;
+  atomic_size_t active_count;
+  bool last_sample;
+};
+
+struct SensorFusionMonitor {
+  // NULL if no sensor uses a pin
+  struct GPIO *gpio;
+  const struct Clock *clock;
+  bool gpio_debug;
+
+  size_t sensors_sz;
+  struct FusedSensor sensors[CFG_MAX_SENSORS];
+  size_t total_weight;
+  // Pins of active_low sensors, flipped after each read
+  gpio_reg_t active_low_pins;
+
+  pthread_t thread_id;
+  atomic_bool thread_stop;
+  // Wakes up the sampler thread while it's blocked waiting for the next sample
+  int wake_fd;
+  // Time of the latest user activity, and the latest one applied by the sampler thread
+  atomic_uint_least64_t user_activity_ns;
+  uint64_t seen_user_activity_ns;
+  struct PeriodicTimer sample_timer;
+
+  // Only used by the sampler thread
+  struct GlitchFilter filter;
+  struct OccupancyDetector detector;
+  struct VacancyTimeout vacancy_timeout;
+  // Fused state, before the vacancy timeout
+  bool currently_active;
+  // Sensor whose veto currently decides the state, or NULL
+  const struct FusedSensor *veto_sensor;
+
+  atomic_size_t score_pct;
+  // Last time any sensor's sample changed, reported with transitions
+  uint64_t sensor_change_ns;
+  atomic_size_t rejected_glitches;
+  atomic_bool active;
+  // Notifies changes of `active`
+  struct TransitionNotifier transitions;
+};
+
+static void sensor_fusion_monitor_on_radar(struct SensorFusionMonitor *mon,
+                                           struct FusedSensor *sensor) {
+  if (!ld2410_parser_read(&sensor->radar, sensor->uart_fd)) {
+    logger_log(LOG_LEVEL_WARN, "Radar %s UART closed, ignoring it from now on", sensor->cfg->name);
+    close(sensor->uart_fd);
+    sensor->uart_fd = -1;
+    sensor->radar_present = false;
+    return;
+  }
+
+  ld2410_parser_parse(&sensor->radar);
+  if (sensor->radar.frames == sensor->radar_frames) {
+    return;
+  }
+
+  sensor->radar_frames = sensor->radar.frames;
+  sensor->radar_last_report_ns = monotonic_now_ns();
+  const struct Ld2410Report *r = &sensor->radar.last;
+  const bool present =
+      ld2410_report_present(r, sensor->cfg->max_distance_cm, sensor->cfg->min_energy);
+  if (sensor->radar_stale) {
+    logger_log(LOG_LEVEL_INFO, "Radar %s is reporting again", sensor->cfg->name);
+    sensor->radar_stale = false;
+  }
+  if (mon->gpio_debug && present != sensor->radar_present) {
+    logger_log(LOG_LEVEL_DEBUG, "Radar %s reports %s: moving %ucm (%u%%), static %ucm (%u%%)",
+               sensor->cfg->name, present ? "presence" : "no presence", r->moving_cm,
+               r->moving_energy, r->static_cm, r->static_energy);
+  }
+  sensor->radar_present = present;
+}
+
+// Radars that stopped sending reports can't be trusted to see anyone
+static void sensor_fusion_monitor_check_radars(struct SensorFusionMonitor *mon) {
+  const uint64_t now_ns = monotonic_now_ns();
+  for (size_t i = 0; i < mon->sensors_sz; ++i) {
+    struct FusedSensor *sensor = &mon->sensors[i];
+    if (sensor->uart_fd < 0 || sensor->radar_stale ||
+        now_ns - sensor->radar_last_report_ns < SENSOR_FUSION_RADAR_STALE_NS) {
+      continue;
+    }
+    logger_log(LOG_LEVEL_WARN,
+               "Radar %s stopped reporting (%zu frames, %zu bad, %zu bytes skipped)",
+               sensor->cfg->name, sensor->radar.frames, sensor->radar.bad_frames,
+               sensor->radar.skipped_bytes);
+    sensor->radar_stale = true;
+    sensor->radar_present = false;
+  }
+}
+
+// Block until the next sample is due, handling radar reports as they arrive. Returns true if a
+// sample is due, false on a wake up (to stop, or for user activity).
+static bool sensor_fusion_monitor_wait(struct SensorFusionMonitor *mon) {
+  while (!mon->thread_stop) {
+    struct pollfd fds[2 + CFG_MAX_SENSORS] = {
+        {.fd = periodic_timer_fd(&mon->sample_timer), .events = POLLIN},
+        {.fd = mon->wake_fd, .events = POLLIN},
+    };
+    // poll() ignores negative fds, so sensors without a UART are no-ops
+    for (size_t i = 0; i < mon->sensors_sz; ++i) {
+      fds[2 + i].fd = mon->sensors[i].uart_fd;
+      fds[2 + i].events = POLLIN;
+    }
+
+    if (poll(fds, 2 + mon->sensors_sz, -1) < 0) {
+      if (errno != EINTR) {
+        logger_log(LOG_LEVEL_ERROR, "SensorFusionMonitor can't wait for next sample: %s",
+                   strerror(errno));
+        // Avoid spinning if poll keeps failing
+        periodic_timer_wait(&mon->sample_timer);
+        return true;
+      }
+      continue;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t wakes;
+      if (read(mon->wake_fd, &wakes, sizeof(wakes)) != sizeof(wakes)) {
+        logger_log(LOG_LEVEL_ERROR, "SensorFusionMonitor can't read wake up eventfd: %s",
+                   strerror(errno));
+      }
+      return false;
+    }
+
+    for (size_t i = 0; i < mon->sensors_sz; ++i) {
+      if (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        sensor_fusion_monitor_on_radar(mon, &mon->sensors[i]);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      periodic_timer_wait(&mon->sample_timer);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Push one filtered register read to every sensor. Returns the weighted score, and the sensors
+// currently asserting a veto, if any.
+static size_t sensor_fusion_monitor_push(struct SensorFusionMonitor *mon, gpio_reg_t reading,
+                                         const struct FusedSensor **force,
+                                         const struct FusedSensor **block) {
+  *force = NULL;
+  *block = NULL;
+  size_t weighted_pct = 0;
+  for (size_t i = 0; i < mon->sensors_sz; ++i) {
+    struct FusedSensor *sensor = &mon->sensors[i];
+    const bool sample = sensor->uart_fd >= 0 ? sensor->radar_present : (reading & sensor->bit);
+    const bool evicted = sample_window_push(sensor->window, sample);
+    if (sample != sensor->last_sample) {
+      sensor->last_sample = sample;
+      mon->sensor_change_ns = monotonic_now_ns();
+      trace_instant("sensor_edge", mon->sensor_change_ns, i);
+    }
+    const size_t active_count = sensor->active_count + sample - evicted;
+    sensor->active_count = active_count;
+    weighted_pct += sensor->cfg->weight * (100 * active_count / sensor->window_sz);
+
+    if (active_count == 0) {
+      continue;
+    }
+    if (sensor->cfg->veto == SENSOR_VETO_FORCE_OCCUPANCY && !*force) {
+      *force = sensor;
+    } else if (sensor->cfg->veto == SENSOR_VETO_BLOCK_VACANCY && !*block) {
+      *block = sensor;
+    }
+  }
+  return weighted_pct / mon->total_weight;
+}
+
+// Take a sample of every sensor and fuse them into currently_active
+static void sensor_fusion_monitor_sample(struct SensorFusionMonitor *mon) {
+  sensor_fusion_monitor_check_radars(mon);
+  relaxed_inc(metrics_pipeline()->samples);
+  const gpio_reg_t inputs = mon->gpio ? gpio_get_inputs(mon->gpio) : 0;
+  const gpio_reg_t raw = inputs ^ mon->active_low_pins;
+  const gpio_reg_t prev_reading = mon->filter.output;
+  const gpio_reg_t reading = glitch_filter_update(&mon->filter, raw, clock_now_ns(mon->clock));
+  mon->rejected_glitches = glitch_filter_rejected(&mon->filter);
+  if (mon->gpio_debug && reading != prev_reading) {
+    for (size_t i = 0; i < mon->sensors_sz; ++i) {
+      if ((reading ^ prev_reading) & mon->sensors[i].bit) {
+        logger_log(LOG_LEVEL_DEBUG, "Sensor %s reports %s", mon->sensors[i].cfg->name,
+                   (reading & mon->sensors[i].bit) ? "active" : "inactive");
+      }
+    }
+  }
+
+  const struct FusedSensor *force, *block;
+  const size_t score_pct = sensor_fusion_monitor_push(mon, reading, &force, &block);
+  mon->score_pct = score_pct;
+  const bool detected =
+      occupancy_detector_update(&mon->detector, DETECTOR_WINDOW, false, score_pct);
+
+  const struct FusedSensor *veto = NULL;
+  bool fused = detected;
+  if (force) {
+    veto = force;
+    fused = true;
+  } else if (block && mon->currently_active && !detected) {
+    veto = block;
+    fused = true;
+  }
+
+  if (veto != mon->veto_sensor && veto) {
+    logger_log(LOG_LEVEL_INFO, "Sensor %s %s (fused score %zu%%)", veto->cfg->name,
+               veto == force ? "forces occupancy" : "blocks vacancy", score_pct);
+  }
+  mon->veto_sensor = veto;
+
+  if (mon->currently_active && !fused) {
+    logger_log(LOG_LEVEL_INFO, "Sensors report vacancy: fused score %zu%%", score_pct);
+    trace_instant("threshold_vacant", monotonic_now_ns(), score_pct);
+    mon->currently_active = false;
+  } else if (!mon->currently_active && fused) {
+    logger_log(LOG_LEVEL_INFO, "Sensors report occupancy: fused score %zu%%", score_pct);
+    trace_instant("threshold_occupied", monotonic_now_ns(), score_pct);
+    mon->currently_active = true;
+  }
+}
+
+static void *sensor_fusion_monitor_update(void *usr) {
+  struct SensorFusionMonitor *mon = usr;
+  trace_thread_name("SensorFusionMonitor");
+  bool sample_due = true;
+  periodic_timer_arm(&mon->sample_timer);
+  while (!mon->thread_stop) {
+    if (sample_due) {
+      sensor_fusion_monitor_sample(mon);
+    }
+
+    // User activity counts as detection at the time it happened
+    const uint64_t user_activity_ns = mon->user_activity_ns;
+    if (user_activity_ns != mon->seen_user_activity_ns) {
+      mon->seen_user_activity_ns = user_activity_ns;
+      vacancy_timeout_update(&mon->vacancy_timeout, true, user_activity_ns);
+    }
+
+    const bool reported = vacancy_timeout_update(&mon->vacancy_timeout, mon->currently_active,
+                                                 clock_now_ns(mon->clock));
+    if (reported != mon->active) {
+      if (!reported) {
+        logger_log(LOG_LEVEL_INFO, "Reporting vacancy");
+      }
+      mon->active = reported;
+      trace_span("edge_to_decision", mon->sensor_change_ns, monotonic_now_ns(), reported);
+      transition_notifier_publish(&mon->transitions, reported, mon->score_pct,
+                                  mon->sensor_change_ns);
+    }
+
+    sample_due = sensor_fusion_monitor_wait(mon);
+    if (mon->gpio_debug && sample_due && (mon->sample_timer.stats.ticks % 100) == 0) {
+      periodic_timer_print_stats(&mon->sample_timer, "SensorFusionMonitor");
+    }
+  }
+  return NULL;
+}
+
+static void sensor_fusion_monitor_free_sensors(struct SensorFusionMonitor *mon) {
+  for (size_t i = 0; i < mon->sensors_sz; ++i) {
+    sample_window_free(mon->sensors[i].window);
+    if (mon->sensors[i].uart_fd >= 0) {
+      close(mon->sensors[i].uart_fd);
+    }
+  }
+}
+
+struct SensorFusionMonitor *sensor_fusion_monitor_init(const struct PiPresenceMonConfig *cfg,
+                                                       const struct Clock *clock) {
+  const bool start_active = true;
+
+  struct SensorFusionMonitor *mon = malloc(sizeof(struct SensorFusionMonitor));
+  if (!mon) {
+    perror("SensorFusionMonitor bad alloc");
+    return NULL;
+  }
+
+  memset(mon, 0, sizeof(*mon));
+  mon->wake_fd = -1;
+  mon->clock = clock;
+  mon->gpio_debug = cfg->gpio_debug;
+  mon->sensors_sz = cfg->sensors_sz;
+
+  for (size_t i = 0; i < cfg->sensors_sz; ++i) {
+    mon->sensors[i].uart_fd = -1;
+  }
+
+  gpio_reg_t pins = 0;
+  for (size_t i = 0; i < cfg->sensors_sz; ++i) {
+    struct FusedSensor *sensor = &mon->sensors[i];
+    sensor->cfg = &cfg->sensors[i];
+    if (sensor->cfg->uart) {
+      sensor->uart_fd = ld2410_open(sensor->cfg->uart);
+      if (sensor->uart_fd < 0) {
+        sensor_fusion_monitor_free_sensors(mon);
+        free(mon);
+        return NULL;
+      }
+      ld2410_parser_init(&sensor->radar);
+      // Until the first report arrives, the radar is as active as every other sensor
+      sensor->radar_present = start_active;
+      sensor->radar_last_report_ns = monotonic_now_ns();
+    } else {
+      sensor->bit = (gpio_reg_t)1 << cfg->sensors[i].pin;
+    }
+
+    sensor->window_sz = 1000 * cfg->sensors[i].window_seconds / cfg->sensor_poll_period_ms;
+    sensor->active_count = start_active ? sensor->window_sz : 0;
+    sensor->last_sample = start_active;
+    sensor->window = sample_window_init(sensor->window_sz, start_active);
+    if (!sensor->window) {
+      fprintf(stderr, "SensorFusionMonitor can't create a window of %zu samples for %s\n",
+              sensor->window_sz, sensor->cfg->name);
+      sensor_fusion_monitor_free_sensors(mon);
+      free(mon);
+      return NULL;
+    }
+
+    pins |= sensor->bit;
+    mon->total_weight += cfg->sensors[i].weight;
+    if (sensor->bit && cfg->sensors[i].active_low) {
+      mon->active_low_pins |= sensor->bit;
+    }
+  }
+
+  if (cfg->gpio_chip && !cfg->gpio_use_mock && pins) {
+    fprintf(stderr, "Warning: GPIO edge events only support a single pin, sensor fusion will "
+                    "poll /dev/gpiomem instead\n");
+  }
+
+  mon->gpio = pins ? gpio_open(cfg->gpio_use_mock, cfg->gpio_mock_trace, clock) : NULL;
+  if (pins && !mon->gpio) {
+    sensor_fusion_monitor_free_sensors(mon);
+    free(mon);
+    return NULL;
+  }
+
+  glitch_filter_init(&mon->filter, cfg, pins, start_active);
+  // The detector only sees the fused score, so it always works as a window detector
+  struct PiPresenceMonConfig detector_cfg = *cfg;
+  detector_cfg.occupancy_detector = DETECTOR_WINDOW;
+  occupancy_detector_init(&mon->detector, &detector_cfg, 1, start_active);
+  vacancy_timeout_init(&mon->vacancy_timeout, 1000000000ull * cfg->vacancy_motion_timeout_seconds,
+                       clock_now_ns(clock), start_active);
+  mon->currently_active = start_active;
+  mon->active = start_active;
+  mon->score_pct = start_active ? 100 : 0;
+  mon->thread_stop = false;
+
+  mon->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (mon->wake_fd < 0) {
+    perror("SensorFusionMonitor can't create wake up eventfd");
+    goto ERR_GPIO;
+  }
+
+  if (!periodic_timer_init(&mon->sample_timer, cfg->sensor_poll_period_ms)) {
+    goto ERR_WAKE_FD;
+  }
+  mon->sample_timer.jitter_us = &metrics_pipeline()->sample_jitter_us;
+
+  if (!transition_notifier_init(&mon->transitions)) {
+    goto ERR_TIMER;
+  }
+
+  if (pthread_create(&mon->thread_id, NULL, sensor_fusion_monitor_update, mon) != 0) {
+    perror("SensorFusionMonitor thread create error");
+    transition_notifier_free(&mon->transitions);
+    goto ERR_TIMER;
+  }
+
+  printf("SensorFusionMonitor sampling %zu sensors\n", mon->sensors_sz);
+  return mon;
+
+ERR_TIMER:
+  periodic_timer_free(&mon->sample_timer);
+ERR_WAKE_FD:
+  close(mon->wake_fd);
+ERR_GPIO:
+  gpio_close(mon->gpio);
+  sensor_fusion_monitor_free_sensors(mon);
+  free(mon);
+  return NULL;
+}
+
+void sensor_fusion_monitor_free(struct SensorFusionMonitor *mon) {
+  if (!mon) {
+    return;
+  }
+
+  mon->thread_stop = true;
+  const uint64_t wake = 1;
+  if (write(mon->wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+    perror("SensorFusionMonitor can't wake up sampler thread");
+  }
+
+  if (pthread_join(mon->thread_id, NULL) != 0) {
+    perror("SensorFusionMonitor pthread_join fail");
+  }
+
+  periodic_timer_print_stats(&mon->sample_timer, "SensorFusionMonitor");
+  printf("SensorFusionMonitor rejected %zu glitches\n", (size_t)mon->rejected_glitches);
+  for (size_t i = 0; i < mon->sensors_sz; ++i) {
+    const struct FusedSensor *sensor = &mon->sensors[i];
+    if (sensor->cfg->uart) {
+      printf("Radar %s: %zu frames, %zu bad, %zu bytes skipped\n", sensor->cfg->name,
+             sensor->radar.frames, sensor->radar.bad_frames, sensor->radar.skipped_bytes);
+    }
+  }
+  periodic_timer_free(&mon->sample_timer);
+  transition_notifier_free(&mon->transitions);
+  close(mon->wake_fd);
+  gpio_close(mon->gpio);
+  sensor_fusion_monitor_free_sensors(mon);
+  free(mon);
+}
+
+bool sensor_fusion_monitor_active(struct SensorFusionMonitor *mon) {
+  return mon->active ? true : false;
+}
+
+size_t sensor_fusion_monitor_score_pct(struct SensorFusionMonitor *mon) {
+  return mon->score_pct;
+}
+
+size_t sensor_fusion_monitor_sensor_active_pct(struct SensorFusionMonitor *mon, size_t idx) {
+  if (idx >= mon->sensors_sz) {
+    return 0;
+  }
+  return 100 * mon->sensors[idx].active_count / mon->sensors[idx].window_sz;
+}
+
+void sensor_fusion_monitor_on_user_activity(struct SensorFusionMonitor *mon, uint64_t now_ns) {
+  mon->user_activity_ns = now_ns;
+  const uint64_t wake = 1;
+  if (write(mon->wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+    perror("SensorFusionMonitor can't wake up sampler thread");
+  }
+}
+
+size_t sensor_fusion_monitor_rejected_glitches(struct SensorFusionMonitor *mon) {
+  return mon->rejected_glitches;
+}
+
+int sensor_fusion_monitor_transition_fd(struct SensorFusionMonitor *mon) {
+  return transition_notifier_fd(&mon->transitions);
+}
+
+bool sensor_fusion_monitor_read_transition(struct SensorFusionMonitor *mon,
+                                           struct OccupancyTransition *transition) {
+  return transition_notifier_consume(&mon->transitions, transition);
+}
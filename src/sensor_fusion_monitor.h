@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fuses the sensors in PiPresenceMonConfig.sensors into a single occupancy state. One thread
+// samples every sensor at once, keeps a window per sensor, and combines them: the weighted mean of
+// their active % goes through the rising/falling thresholds, then sensor vetoes (see SensorVeto)
+// override the result, and the vacancy timeout delays vacancy like in GpioPinActiveMonitor.
+struct Clock;
+struct OccupancyTransition;
+struct PiPresenceMonConfig;
+struct SensorFusionMonitor;
+
+// Sampling is paced by a real timer; clock is used for the vacancy timeout
+struct SensorFusionMonitor *sensor_fusion_monitor_init(const struct PiPresenceMonConfig *cfg,
+                                                       const struct Clock *clock);
+void sensor_fusion_monitor_free(struct SensorFusionMonitor *mon);
+
+bool sensor_fusion_monitor_active(struct SensorFusionMonitor *mon);
+// Weighted score of all sensors, in %
+size_t sensor_fusion_monitor_score_pct(struct SensorFusionMonitor *mon);
+// Active % in the window of a sensor, by its index in cfg->sensors
+size_t sensor_fusion_monitor_sensor_active_pct(struct SensorFusionMonitor *mon, size_t idx);
+// Raw sensor excursions discarded by the glitch filter, over all sensors (see sensor_filter)
+size_t sensor_fusion_monitor_rejected_glitches(struct SensorFusionMonitor *mon);
+// Someone is using the device, at now_ns of the monitor clock: same as
+// gpio_active_monitor_on_user_activity. Thread safe.
+void sensor_fusion_monitor_on_user_activity(struct SensorFusionMonitor *mon, uint64_t now_ns);
+
+// fd that becomes readable when sensor_fusion_monitor_active() changes
+int sensor_fusion_monitor_transition_fd(struct SensorFusionMonitor *mon);
+// Consume pending transitions (never blocks). Returns true, and the latest one, if there was any.
+bool sensor_fusion_monitor_read_transition(struct SensorFusionMonitor *mon,
+                                           struct OccupancyTransition *transition);
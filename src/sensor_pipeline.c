@@ -0,0 +1,38 @@
+#include "sensor_pipeline.h"
+
+#include <stdio.h>
+
+bool sensor_pipeline_init(struct SensorPipeline *p, const struct PiPresenceMonConfig *cfg,
+                          gpio_reg_t pins, bool start_active) {
+  p->window_sz = 1000 * cfg->sensor_monitor_window_seconds / cfg->sensor_poll_period_ms;
+  p->window = sample_window_init(p->window_sz, start_active);
+  if (!p->window) {
+    fprintf(stderr, "SensorPipeline can't create a window of %zu samples\n", p->window_sz);
+    return false;
+  }
+  pthread_mutex_init(&p->window_lock, NULL);
+  p->active_count = start_active ? p->window_sz : 0;
+  glitch_filter_init(&p->filter, cfg, pins, start_active);
+  occupancy_detector_init(&p->detector, cfg, p->window_sz, start_active);
+  return true;
+}
+
+void sensor_pipeline_free(struct SensorPipeline *p) {
+  pthread_mutex_destroy(&p->window_lock);
+  sample_window_free(p->window);
+}
+
+size_t sensor_pipeline_active_pct_last(struct SensorPipeline *p, size_t n) {
+  if (n > p->window_sz) {
+    n = p->window_sz;
+  }
+
+  if (n == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&p->window_lock);
+  const size_t cnt = sample_window_active_count_last(p->window, n);
+  pthread_mutex_unlock(&p->window_lock);
+  return 100 * cnt / n;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "cfg.h"
+#include "glitch_filter.h"
+#include "gpio.h"
+#include "occupancy_detector.h"
+#include "sample_window.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The steps that turn a raw sensor read into a detection: glitch filter, sample window (with a
+// running count of active samples), occupancy detector. GpioPinActiveMonitor runs every tick
+// through it and replay runs every trace sample through it, so offline results are those of the
+// service. The vacancy timeout comes after it, on each caller's clock.
+// Only one thread (the sampler) may update it; the window can be read from others.
+struct SensorPipeline {
+  struct GlitchFilter filter;
+  size_t window_sz;
+  struct SampleWindow *window;
+  // Only the sampler writes to the window, the lock is for readers in other threads
+  pthread_mutex_t window_lock;
+  atomic_size_t active_count;
+  struct OccupancyDetector detector;
+};
+
+// Result of feeding one read to the pipeline
+struct SensorPipelineSample {
+  // Filtered state of the sensor, what went into the window
+  bool state;
+  size_t window_pct;
+  // Detector output
+  bool detected;
+};
+
+// Window of sensor_monitor_window_seconds worth of samples. pins are those the filter watches.
+bool sensor_pipeline_init(struct SensorPipeline *p, const struct PiPresenceMonConfig *cfg,
+                          gpio_reg_t pins, bool start_active);
+void sensor_pipeline_free(struct SensorPipeline *p);
+
+static inline size_t sensor_pipeline_active_pct(const struct SensorPipeline *p) {
+  return 100 * p->active_count / p->window_sz;
+}
+
+// Active % of the last n samples, safe to call from any thread
+size_t sensor_pipeline_active_pct_last(struct SensorPipeline *p, size_t n);
+
+// Feed a raw read taken at now_ns. `kind` must be p->detector.kind, see occupancy_detector_update.
+static inline __attribute__((always_inline)) struct SensorPipelineSample
+sensor_pipeline_update(struct SensorPipeline *p, const enum OccupancyDetectorKind kind,
+                       gpio_reg_t raw, uint64_t now_ns) {
+  struct SensorPipelineSample s;
+  s.state = glitch_filter_update(&p->filter, raw, now_ns) != 0;
+
+  pthread_mutex_lock(&p->window_lock);
+  const bool evicted = sample_window_push(p->window, s.state);
+  pthread_mutex_unlock(&p->window_lock);
+  p->active_count += s.state;
+  p->active_count -= evicted;
+
+  s.window_pct = sensor_pipeline_active_pct(p);
+  s.detected = occupancy_detector_update(&p->detector, kind, s.state, s.window_pct);
+  return s;
+}
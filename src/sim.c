@@ -0,0 +1,209 @@
+// Runs a simulated day of occupancy transitions through OccupancyCommands, on an event loop with a
+// simulated clock: launches, crashes, restart cooldowns, start delays, freezes and stops all follow
+// simulated time, while the commands themselves are real processes. Exits with an error if the day
+// doesn't complete, if restarts don't follow the cooldown, or if the delayed command doesn't start
+// exactly its start delay after each decision.
+//
+// Usage: pipresencemon_sim [hours] [seed]
+#include "cfg.h"
+#include "clock.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "occupancy_commands.h"
+#include "periodic_timer.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Time spent in each state, in simulated minutes
+#define SIM_MIN_STATE_MINUTES 5
+#define SIM_MAX_STATE_MINUTES 120
+// Metric labels of the crashing command below
+#define SIM_CRASHING_CMD_LABELS "{state=\"occupied\",index=\"2\",cmd=\"false\"} "
+#define SIM_RESTART_WAIT_SECONDS 60
+#define SIM_START_DELAY_MS 2000
+// Commands are real processes, so their exits happen in real time: the loop gives them 1 ms before
+// jumping to the next timer, and an exit that comes later is only seen after that jump. A timer
+// ticking this often bounds how late (in simulated time) an exit can be seen.
+#define SIM_TICK_MS 10000
+// An exit (eg of the crashing command) may be seen up to this many ticks late
+#define SIM_MAX_LATE_TICKS 2
+
+struct Sim {
+  struct EventLoop *loop;
+  struct Clock *clock;
+  struct OccupancyCommands *cmds;
+  struct EventLoopTimer *transition_timer;
+  struct EventLoopTimer *tick_timer;
+  uint64_t end_ns;
+  uint64_t rng;
+  bool occupied;
+  uint64_t state_start_ns;
+  size_t transitions;
+  size_t vacancies;
+  // Restarts of the crashing command that fit in the occupied time: with every crash seen right
+  // away, and with every crash seen SIM_MAX_LATE_TICKS late
+  size_t max_restarts;
+  size_t min_restarts;
+};
+
+static uint64_t sim_rand(struct Sim *sim) {
+  // xorshift64, so a given seed always runs the same day
+  sim->rng ^= sim->rng << 13;
+  sim->rng ^= sim->rng >> 7;
+  sim->rng ^= sim->rng << 17;
+  return sim->rng;
+}
+
+// The crashing command crashes as soon as it's launched, and is restarted every cooldown until
+// the occupied state ends
+static void sim_count_restarts(struct Sim *sim, uint64_t now_ns) {
+  if (!sim->occupied) {
+    return;
+  }
+  const uint64_t occupied_ms = (now_ns - sim->state_start_ns) / 1000000;
+  sim->max_restarts += occupied_ms / (SIM_RESTART_WAIT_SECONDS * 1000);
+  sim->min_restarts +=
+      occupied_ms / (SIM_RESTART_WAIT_SECONDS * 1000 + SIM_MAX_LATE_TICKS * SIM_TICK_MS);
+}
+
+static void on_transition_timer(void *usr) {
+  struct Sim *sim = usr;
+  const uint64_t now_ns = clock_now_ns(sim->clock);
+  sim_count_restarts(sim, now_ns);
+  sim->state_start_ns = now_ns;
+  if (now_ns >= sim->end_ns) {
+    event_loop_stop(sim->loop);
+    return;
+  }
+
+  sim->occupied = !sim->occupied;
+  sim->transitions++;
+  sim->vacancies += !sim->occupied;
+  printf("SIM %llu min: %s\n", (unsigned long long)(now_ns / 60000000000ull),
+         sim->occupied ? "occupied" : "vacant");
+  if (sim->occupied) {
+    occupancy_commands_on_occupancy(sim->cmds, now_ns);
+  } else {
+    occupancy_commands_on_vacancy(sim->cmds, now_ns);
+  }
+
+  const size_t minutes = SIM_MIN_STATE_MINUTES +
+                         sim_rand(sim) % (SIM_MAX_STATE_MINUTES - SIM_MIN_STATE_MINUTES + 1);
+  event_loop_timer_arm(sim->transition_timer, minutes * 60 * 1000, 0);
+}
+
+static void on_tick_timer(void *usr) {}
+
+// Value of a counter in a scrape, or -1 if it's not there
+static long long scrape_counter(const struct MetricsWriter *w, const char *series) {
+  const char *line = strstr(w->buf, series);
+  return line ? atoll(line + strlen(series)) : -1;
+}
+
+int main(int argc, const char **argv) {
+  const size_t hours = (argc > 1) ? strtoul(argv[1], NULL, 10) : 24;
+  const uint64_t seed = (argc > 2) ? strtoull(argv[2], NULL, 10) : 1;
+  if (hours == 0 || seed == 0) {
+    fprintf(stderr, "Usage: %s [hours] [seed], both non zero\n", argv[0]);
+    return 1;
+  }
+
+  // A command that runs until stopped, one that is frozen on vacancy instead, and one that crashes
+  // right away and is restarted after every cooldown
+  struct CommandConfig on_occupancy[] = {
+      {.cmd = "sleep 86400", .stop_signal = SIGTERM, .stop_timeout_ms = 3000},
+      {.cmd = "sleep 86401", .stop_signal = SIGTERM, .stop_timeout_ms = 3000,
+       .standby_freeze = true},
+      {.cmd = "false", .should_restart_on_crash = true, .max_restarts = 10,
+       .stop_signal = SIGTERM, .stop_timeout_ms = 3000},
+  };
+  // A delayed command, and one that exits normally
+  struct CommandConfig on_vacancy[] = {
+      {.cmd = "sleep 86402", .stop_signal = SIGTERM, .stop_timeout_ms = 3000,
+       .start_delay_ms = SIM_START_DELAY_MS},
+      {.cmd = "true", .stop_signal = SIGTERM, .stop_timeout_ms = 3000},
+  };
+
+  struct PiPresenceMonConfig cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.restart_cmd_wait_time_seconds = SIM_RESTART_WAIT_SECONDS;
+  // Launch at the transition, without waiting for the previous state's commands to exit: then the
+  // only commands that don't run at their decision time are the delayed ones, and
+  // decision_to_exec_us holds exactly their start delays
+  cfg.launch_before_stop_completes = true;
+  cfg.on_occupancy = on_occupancy;
+  cfg.on_occupancy_sz = sizeof(on_occupancy) / sizeof(on_occupancy[0]);
+  cfg.on_vacancy = on_vacancy;
+  cfg.on_vacancy_sz = sizeof(on_vacancy) / sizeof(on_vacancy[0]);
+
+  struct Clock clock;
+  clock_sim_init(&clock, 0);
+  struct Sim sim;
+  memset(&sim, 0, sizeof(sim));
+  sim.clock = &clock;
+  sim.rng = seed;
+  sim.end_ns = hours * 3600 * 1000000000ull;
+  sim.occupied = true;
+
+  sim.loop = event_loop_init(&clock);
+  sim.cmds = sim.loop ? occupancy_commands_init(&cfg, sim.loop) : NULL;
+  sim.transition_timer =
+      sim.cmds ? event_loop_timer_init(sim.loop, on_transition_timer, &sim) : NULL;
+  sim.tick_timer = sim.cmds ? event_loop_timer_init(sim.loop, on_tick_timer, &sim) : NULL;
+  if (!sim.transition_timer || !sim.tick_timer) {
+    fprintf(stderr, "Sim setup fail\n");
+    return 1;
+  }
+
+  const uint64_t real_start_ns = monotonic_now_ns();
+  occupancy_commands_on_occupancy(sim.cmds, clock_now_ns(&clock));
+  event_loop_timer_arm(sim.transition_timer, SIM_MIN_STATE_MINUTES * 60 * 1000, 0);
+  event_loop_timer_arm(sim.tick_timer, SIM_TICK_MS, SIM_TICK_MS);
+  event_loop_run(sim.loop);
+  const uint64_t real_ns = monotonic_now_ns() - real_start_ns;
+
+  static struct MetricsWriter scrape;
+  occupancy_commands_write_metrics(sim.cmds, &scrape);
+  const long long crashes =
+      scrape_counter(&scrape, "pipresencemon_command_crashes_total" SIM_CRASHING_CMD_LABELS);
+  const long long restarts =
+      scrape_counter(&scrape, "pipresencemon_command_restarts_total" SIM_CRASHING_CMD_LABELS);
+
+  // Only delayed launches take simulated time from the decision, each exactly its start delay
+  const struct MetricsHistogram *delays = &metrics_pipeline()->decision_to_exec_us;
+  size_t delayed_launches = 0;
+  for (size_t i = 0; i <= METRICS_HISTOGRAM_BUCKETS; ++i) {
+    delayed_launches += delays->buckets[i];
+  }
+  const uint64_t delays_us = delays->sum_us;
+
+  event_loop_timer_free(sim.loop, sim.tick_timer);
+  event_loop_timer_free(sim.loop, sim.transition_timer);
+  occupancy_commands_free(sim.cmds);
+  event_loop_free(sim.loop);
+
+  printf("\n%s", scrape.buf);
+  printf("Simulated %zu hours (%zu transitions, %lld crashes, %lld restarts) in %llu ms\n", hours,
+         sim.transitions, crashes, restarts, (unsigned long long)real_ns / 1000000);
+  printf("Expected %zu to %zu restarts, %zu delayed launches of %d ms; got %zu totalling %llu ms\n",
+         sim.min_restarts, sim.max_restarts, sim.vacancies, SIM_START_DELAY_MS, delayed_launches,
+         (unsigned long long)delays_us / 1000);
+
+  // Every state lasts at most SIM_MAX_STATE_MINUTES
+  bool ok = clock_now_ns(&clock) >= sim.end_ns &&
+            sim.transitions >= hours * 60 / SIM_MAX_STATE_MINUTES;
+  // Restarts follow the cooldown, within how late crashes can be seen
+  ok &= crashes > 0 && restarts >= (long long)sim.min_restarts &&
+        restarts <= (long long)sim.max_restarts;
+  // Each vacancy launches the delayed command once, start delay after the decision
+  ok &= delayed_launches == sim.vacancies &&
+        delays_us == (uint64_t)sim.vacancies * SIM_START_DELAY_MS * 1000;
+  if (!ok) {
+    fprintf(stderr, "Simulation didn't run as expected\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Occupancy state, published by the daemon in a small file (state_page_path, eg
+// /run/pipresencemon.state) that other local apps can mmap. The daemon updates it in place under a
+// seqlock: a reader copies the page and retries if an update overlapped, so it gets a consistent
+// snapshot with plain loads, no syscalls and no way to block the daemon.
+// This header is all a reader needs (C or C++, gcc or clang):
+//
+//   const struct PiPresenceState *page = pipresence_state_open("/run/pipresencemon.state");
+//   struct PiPresenceState state;
+//   if (page && pipresence_state_read(page, &state) && !pipresence_state_stale(&state) &&
+//       state.occupied) { ... }
+//
+// The daemon rewrites the page on each transition, and at least every PIPRESENCE_STATE_REFRESH_MS.
+// When it exits it clears `running`, but if it's killed (SIGKILL, OOM) `running` stays 1: only
+// updated_ns going stale tells. A new daemon creates a new file, so a reader that finds the page
+// stale should close it and open it again.
+
+#define PIPRESENCE_STATE_MAGIC 0x45544154534d5050ull
+#define PIPRESENCE_STATE_VERSION 1
+#define PIPRESENCE_STATE_MAX_SOURCES 32
+// The daemon refreshes the page at least this often, even without transitions
+#define PIPRESENCE_STATE_REFRESH_MS 1000
+// A page not refreshed for this long belongs to a daemon that is gone
+#define PIPRESENCE_STATE_STALE_MS (3 * PIPRESENCE_STATE_REFRESH_MS)
+// Pin of sources that aren't read from a GPIO (eg UART radars)
+#define PIPRESENCE_STATE_NO_PIN 0xff
+
+// A sensor: a GPIO pin, or one of the fused sensors (in config order)
+struct PiPresenceStateSource {
+  uint8_t pin;
+  // Active readings in the sensor window, in %
+  uint8_t active_pct;
+  uint8_t reserved[2];
+};
+
+struct PiPresenceState {
+  uint64_t magic;
+  uint32_t version;
+  // Seqlock sequence: odd while an update is in progress
+  uint32_t seq;
+  // 1 while the daemon runs; also stays 1 if it was killed, see pipresence_state_stale
+  uint32_t running;
+  uint32_t occupied;
+  // Score that decides occupancy, in %: window activity, or the fused score of all sensors
+  uint32_t active_pct;
+  uint32_t sources_sz;
+  uint64_t transitions;
+  // CLOCK_MONOTONIC ns of the last occupancy change, and of the last update of this page
+  uint64_t last_transition_ns;
+  uint64_t updated_ns;
+  struct PiPresenceStateSource sources[PIPRESENCE_STATE_MAX_SOURCES];
+};
+
+// Returns NULL if the daemon isn't publishing at path
+static inline const struct PiPresenceState *pipresence_state_open(const char *path) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  void *page = mmap(NULL, sizeof(struct PiPresenceState), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    return NULL;
+  }
+
+  const struct PiPresenceState *state = (const struct PiPresenceState *)page;
+  if (state->magic != PIPRESENCE_STATE_MAGIC || state->version != PIPRESENCE_STATE_VERSION) {
+    munmap(page, sizeof(struct PiPresenceState));
+    return NULL;
+  }
+  return state;
+}
+
+static inline void pipresence_state_close(const struct PiPresenceState *page) {
+  if (page) {
+    munmap((void *)page, sizeof(struct PiPresenceState));
+  }
+}
+
+// Copy a consistent snapshot of page. Returns false if the daemon kept updating it for every try
+// (it updates about once per second, so this only happens if the reader is starved).
+static inline bool pipresence_state_read(const struct PiPresenceState *page,
+                                         struct PiPresenceState *snapshot) {
+  for (int tries = 0; tries < 1000; ++tries) {
+    const uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      continue;
+    }
+    memcpy(snapshot, page, sizeof(*snapshot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// True if the snapshot doesn't come from a running daemon: it exited, or it stopped refreshing the
+// page (killed, or hung) PIPRESENCE_STATE_STALE_MS ago
+static inline bool pipresence_state_stale(const struct PiPresenceState *snapshot) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t now_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  return !snapshot->running ||
+         now_ns - snapshot->updated_ns > PIPRESENCE_STATE_STALE_MS * 1000000ull;
+}
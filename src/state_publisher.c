@@ -0,0 +1,106 @@
+#include "state_publisher.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct StatePublisher {
+  char *path;
+  int fd;
+  struct PiPresenceState *page;
+};
+
+struct StatePublisher *state_publisher_init(const char *path) {
+  struct StatePublisher *pub = malloc(sizeof(struct StatePublisher));
+  if (!pub) {
+    perror("StatePublisher bad alloc");
+    return NULL;
+  }
+
+  pub->path = strdup(path);
+  pub->page = NULL;
+  pub->fd = -1;
+  if (!pub->path) {
+    perror("StatePublisher bad alloc");
+    goto ERR;
+  }
+
+  // Readers only ever see a complete page: it's set up under a temp name, then moved in place
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  pub->fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (pub->fd < 0) {
+    fprintf(stderr, "StatePublisher can't create %s\n", tmp_path);
+    perror("StatePublisher init fail");
+    goto ERR;
+  }
+
+  if (ftruncate(pub->fd, sizeof(struct PiPresenceState)) != 0) {
+    perror("StatePublisher can't size state page");
+    goto ERR_UNLINK;
+  }
+
+  void *page = mmap(NULL, sizeof(struct PiPresenceState), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    pub->fd, 0);
+  if (page == MAP_FAILED) {
+    perror("StatePublisher can't mmap state page");
+    goto ERR_UNLINK;
+  }
+
+  pub->page = page;
+  memset(pub->page, 0, sizeof(*pub->page));
+  pub->page->magic = PIPRESENCE_STATE_MAGIC;
+  pub->page->version = PIPRESENCE_STATE_VERSION;
+  pub->page->running = 1;
+
+  if (rename(tmp_path, path) != 0) {
+    fprintf(stderr, "StatePublisher can't move state page to %s\n", path);
+    perror("StatePublisher init fail");
+    goto ERR_UNLINK;
+  }
+
+  printf("Publishing occupancy state at %s\n", path);
+  return pub;
+
+ERR_UNLINK:
+  unlink(tmp_path);
+ERR:
+  if (pub->page) {
+    munmap(pub->page, sizeof(*pub->page));
+  }
+  if (pub->fd >= 0) {
+    close(pub->fd);
+  }
+  free(pub->path);
+  free(pub);
+  return NULL;
+}
+
+void state_publisher_free(struct StatePublisher *pub) {
+  if (!pub) {
+    return;
+  }
+
+  // Readers that still have the page mapped see the daemon is gone
+  state_publisher_begin(pub)->running = 0;
+  state_publisher_end(pub);
+
+  munmap(pub->page, sizeof(*pub->page));
+  close(pub->fd);
+  unlink(pub->path);
+  free(pub->path);
+  free(pub);
+}
+
+struct PiPresenceState *state_publisher_begin(struct StatePublisher *pub) {
+  const uint32_t seq = __atomic_load_n(&pub->page->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&pub->page->seq, seq + 1, __ATOMIC_RELAXED);
+  // The odd sequence must be visible before any write to the page
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return pub->page;
+}
+
+void state_publisher_end(struct StatePublisher *pub) {
+  const uint32_t seq = __atomic_load_n(&pub->page->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&pub->page->seq, seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "state_page.h"
+
+// Daemon side of state_page.h: creates the page file and updates it under the seqlock. Single
+// writer; call everything from the same thread.
+struct StatePublisher;
+
+// Creates path (replacing any previous page, atomically). Returns NULL on error.
+struct StatePublisher *state_publisher_init(const char *path);
+// Marks the page as not running and removes the file
+void state_publisher_free(struct StatePublisher *pub);
+
+// Every write to the page must be between begin and end; readers retry while it's in progress
+struct PiPresenceState *state_publisher_begin(struct StatePublisher *pub);
+void state_publisher_end(struct StatePublisher *pub);
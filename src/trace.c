@@ -0,0 +1,138 @@
+#include "trace.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef PIPRESENCEMON_TRACING
+
+static struct TraceRing rings[TRACE_MAX_THREADS];
+static atomic_size_t rings_used;
+__thread struct TraceRing *trace_thread_ring;
+
+struct TraceRing *trace_ring_register() {
+  static atomic_bool warned;
+  const size_t idx = atomic_fetch_add(&rings_used, 1);
+  if (idx >= TRACE_MAX_THREADS) {
+    atomic_fetch_sub(&rings_used, 1);
+    if (!atomic_exchange(&warned, true)) {
+      fprintf(stderr, "Trace supports up to %d threads, some won't be traced\n",
+              TRACE_MAX_THREADS);
+    }
+    return NULL;
+  }
+
+  trace_thread_ring = &rings[idx];
+  return trace_thread_ring;
+}
+
+void trace_thread_name(const char *name) {
+  struct TraceRing *ring = trace_thread_ring ? trace_thread_ring : trace_ring_register();
+  if (ring) {
+    ring->thread_name = name;
+  }
+}
+
+static void write_event(FILE *fp, bool *first, const struct TraceEvent *ev, size_t tid) {
+  // Chrome wants usecs, keep the ns as decimals
+  fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"pipresencemon\",\"pid\":%d,\"tid\":%zu,",
+          *first ? "" : ",", ev->name, getpid(), tid);
+  *first = false;
+  if (ev->dur_ns == TRACE_INSTANT) {
+    fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",");
+  } else {
+    fprintf(fp, "\"ph\":\"X\",\"dur\":%llu.%03llu,", (unsigned long long)ev->dur_ns / 1000,
+            (unsigned long long)ev->dur_ns % 1000);
+  }
+  fprintf(fp, "\"ts\":%llu.%03llu,\"args\":{\"v\":%lld}}", (unsigned long long)ev->ts_ns / 1000,
+          (unsigned long long)ev->ts_ns % 1000, (long long)ev->arg);
+}
+
+// Copy out the events of a ring that weren't overwritten while copying, oldest first
+static size_t snapshot_ring(const struct TraceRing *ring, struct TraceEvent *out) {
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  const size_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+  for (size_t i = first; i < head; ++i) {
+    out[i - first] = ring->events[i % TRACE_RING_EVENTS];
+  }
+
+  // Events written since head was read may have torn the oldest slots, including the one being
+  // written right now (index new_head - TRACE_RING_EVENTS): keep only the ones after it
+  atomic_thread_fence(memory_order_acquire);
+  const size_t new_head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  const size_t overwritten = new_head + 1 > first + TRACE_RING_EVENTS
+                                 ? new_head + 1 - (first + TRACE_RING_EVENTS)
+                                 : 0;
+  if (overwritten >= head - first) {
+    return 0;
+  }
+  memmove(out, out + overwritten, (head - first - overwritten) * sizeof(*out));
+  return head - first - overwritten;
+}
+
+bool trace_dump(const char *path) {
+  struct TraceEvent *events = malloc(TRACE_RING_EVENTS * sizeof(struct TraceEvent));
+  if (!events) {
+    perror("Trace dump bad alloc");
+    return false;
+  }
+
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE *fp = fopen(tmp_path, "we");
+  if (!fp) {
+    fprintf(stderr, "Trace can't create dump %s\n", tmp_path);
+    perror("Trace dump fail");
+    free(events);
+    return false;
+  }
+
+  size_t events_sz = 0;
+  bool first = true;
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  const size_t used = atomic_load(&rings_used);
+  for (size_t tid = 0; tid < used && tid < TRACE_MAX_THREADS; ++tid) {
+    const struct TraceRing *ring = &rings[tid];
+    if (ring->thread_name) {
+      fprintf(fp,
+              "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,"
+              "\"args\":{\"name\":\"%s\"}}",
+              first ? "" : ",", getpid(), tid, ring->thread_name);
+      first = false;
+    }
+
+    const size_t sz = snapshot_ring(ring, events);
+    for (size_t i = 0; i < sz; ++i) {
+      write_event(fp, &first, &events[i], tid);
+    }
+    events_sz += sz;
+  }
+  fprintf(fp, "\n]}\n");
+  free(events);
+
+  if (fclose(fp) != 0) {
+    perror("Trace can't write dump");
+    unlink(tmp_path);
+    return false;
+  }
+
+  if (rename(tmp_path, path) != 0) {
+    perror("Trace can't move dump in place");
+    unlink(tmp_path);
+    return false;
+  }
+
+  printf("Trace dumped %zu events to %s\n", events_sz, path);
+  return true;
+}
+
+#else
+
+bool trace_dump(const char *path) {
+  fprintf(stderr, "Built without tracing, rebuild with `make TRACING=1` to dump traces\n");
+  return false;
+}
+
+#endif
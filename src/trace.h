@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Spans along the sensor to command pipeline (sensor edge, threshold crossing, main loop pickup,
+// stopping the old state, spawn...), to see which stage made a transition slow. Each thread
+// records into its own preallocated ring, so recording is a few plain stores and a release store,
+// with timestamps the caller already has: no locks, allocs or syscalls. The oldest events are
+// overwritten when a ring is full. trace_dump writes all rings as Chrome trace-event JSON, which
+// can be opened in ui.perfetto.dev or chrome://tracing.
+// Built with PIPRESENCEMON_TRACING (make TRACING=1, the default); without it, recording compiles
+// to nothing and trace_dump only reports that tracing is off.
+
+// Timestamps are CLOCK_MONOTONIC, as monotonic_now_ns() returns
+#define TRACE_RING_EVENTS 1024
+#define TRACE_MAX_THREADS 4
+// dur_ns of point events
+#define TRACE_INSTANT UINT64_MAX
+
+struct TraceEvent {
+  // Must be a string literal (or otherwise outlive the process' tracing)
+  const char *name;
+  uint64_t ts_ns;
+  uint64_t dur_ns;
+  // Event specific value (pid, active %...), shown as an arg
+  int64_t arg;
+};
+
+struct TraceRing {
+  const char *thread_name;
+  // Events written so far; the next one goes to head % TRACE_RING_EVENTS
+  atomic_size_t head;
+  struct TraceEvent events[TRACE_RING_EVENTS];
+};
+
+#ifdef PIPRESENCEMON_TRACING
+
+extern __thread struct TraceRing *trace_thread_ring;
+// Claims a ring for the calling thread, NULL if there are more than TRACE_MAX_THREADS
+struct TraceRing *trace_ring_register();
+
+static inline void trace_record(const char *name, uint64_t ts_ns, uint64_t dur_ns, int64_t arg) {
+  struct TraceRing *ring = trace_thread_ring ? trace_thread_ring : trace_ring_register();
+  if (!ring) {
+    return;
+  }
+
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct TraceEvent *ev = &ring->events[head % TRACE_RING_EVENTS];
+  ev->name = name;
+  ev->ts_ns = ts_ns;
+  ev->dur_ns = dur_ns;
+  ev->arg = arg;
+  // A dump that sees the new head also sees the event
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static inline void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns, int64_t arg) {
+  trace_record(name, start_ns, end_ns - start_ns, arg);
+}
+
+static inline void trace_instant(const char *name, uint64_t ts_ns, int64_t arg) {
+  trace_record(name, ts_ns, TRACE_INSTANT, arg);
+}
+
+// Name for the calling thread's track in the dump
+void trace_thread_name(const char *name);
+
+#else
+
+static inline void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns, int64_t arg) {
+}
+static inline void trace_instant(const char *name, uint64_t ts_ns, int64_t arg) {}
+static inline void trace_thread_name(const char *name) {}
+
+#endif
+
+// Write every ring to path as Chrome trace-event JSON (through a temp file and a rename). Safe to
+// call while other threads record: events overwritten during the copy are left out.
+bool trace_dump(const char *path);
@@ -0,0 +1,56 @@
+#include "transition_notifier.h"
+#include "periodic_timer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+bool transition_notifier_init(struct TransitionNotifier *n) {
+  memset(n, 0, sizeof(*n));
+  n->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (n->fd < 0) {
+    perror("TransitionNotifier can't create eventfd");
+    return false;
+  }
+  pthread_mutex_init(&n->lock, NULL);
+  return true;
+}
+
+void transition_notifier_free(struct TransitionNotifier *n) {
+  if (n->fd < 0) {
+    return;
+  }
+  close(n->fd);
+  n->fd = -1;
+  pthread_mutex_destroy(&n->lock);
+}
+
+void transition_notifier_publish(struct TransitionNotifier *n, bool occupied, size_t active_pct,
+                                 uint64_t sensor_change_ns) {
+  pthread_mutex_lock(&n->lock);
+  n->last.occupied = occupied;
+  n->last.timestamp_ns = monotonic_now_ns();
+  n->last.active_pct = active_pct;
+  n->last.sensor_change_ns = sensor_change_ns;
+  pthread_mutex_unlock(&n->lock);
+
+  const uint64_t one = 1;
+  if (write(n->fd, &one, sizeof(one)) != sizeof(one)) {
+    perror("TransitionNotifier can't notify transition");
+  }
+}
+
+int transition_notifier_fd(const struct TransitionNotifier *n) { return n->fd; }
+
+bool transition_notifier_consume(struct TransitionNotifier *n, struct OccupancyTransition *out) {
+  uint64_t pending = 0;
+  if (read(n->fd, &pending, sizeof(pending)) != sizeof(pending) || pending == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&n->lock);
+  *out = n->last;
+  pthread_mutex_unlock(&n->lock);
+  return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Occupancy transition, as decided by a sensor monitor
+struct OccupancyTransition {
+  bool occupied;
+  // CLOCK_MONOTONIC time at which the monitor decided this transition
+  uint64_t timestamp_ns;
+  // Sensor activity that triggered the transition
+  size_t active_pct;
+  // CLOCK_MONOTONIC time at which the sensor reading last changed before this transition, 0 if it
+  // never did
+  uint64_t sensor_change_ns;
+};
+
+// Publishes transitions from a sensor thread to a consumer blocked on an eventfd. Only the latest
+// transition is kept: if the consumer is slow, it only sees the most recent state.
+struct TransitionNotifier {
+  int fd;
+  pthread_mutex_t lock;
+  struct OccupancyTransition last;
+};
+
+bool transition_notifier_init(struct TransitionNotifier *n);
+void transition_notifier_free(struct TransitionNotifier *n);
+
+void transition_notifier_publish(struct TransitionNotifier *n, bool occupied, size_t active_pct,
+                                 uint64_t sensor_change_ns);
+
+// fd that becomes readable when there's an unread transition
+int transition_notifier_fd(const struct TransitionNotifier *n);
+
+// Consume pending notifications (never blocks). Returns true, and the latest transition, if
+// there was at least one unread transition.
+bool transition_notifier_consume(struct TransitionNotifier *n, struct OccupancyTransition *out);